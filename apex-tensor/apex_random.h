@@ -32,14 +32,21 @@
 typedef unsigned char uint8_t;
 typedef unsigned short int uint16_t;
 typedef unsigned int  uint32_t;
+typedef unsigned long long uint64_t;
 #else
 #include <inttypes.h>
 #endif
 
 /*! namespace of PRNG */
 namespace apex_random{
+	/*! \brief seed of the global PRNG, also used as default key of random streams */
+	inline uint32_t &global_seed( void ){
+		static uint32_t seed_ = 0;
+		return seed_;
+	}
 	/*! \brief seed the PRNG */
 	inline void seed( uint32_t seed ){
+		global_seed() = seed;
 		srand( seed );
 	}
 			
@@ -120,4 +127,115 @@ namespace apex_random{
     }
 };
 
+namespace apex_random{
+    /*!
+     * \brief counter based random stream(Philox4x32-10), independent of the global PRNG,
+     *   the i-th output of a stream is a pure function of (key, sub, i),
+     *   so a task can get its own stream by its index and the result does not depend on
+     *   which thread runs the task. A stream itself is not thread safe, each thread holds its own
+     */
+    class RandomStream{
+    private:
+        uint32_t key[2], ctr[4], out[4];
+        int nout;
+        inline static void philox_round( uint32_t c[4], const uint32_t k[2] ){
+            const uint64_t p0 = static_cast<uint64_t>( 0xD2511F53U ) * c[0];
+            const uint64_t p1 = static_cast<uint64_t>( 0xCD9E8D57U ) * c[2];
+            const uint32_t c1 = c[1], c3 = c[3];
+            c[0] = static_cast<uint32_t>( p1 >> 32 ) ^ c1 ^ k[0];
+            c[1] = static_cast<uint32_t>( p1 );
+            c[2] = static_cast<uint32_t>( p0 >> 32 ) ^ c3 ^ k[1];
+            c[3] = static_cast<uint32_t>( p0 );
+        }
+        // generate next 4 outputs and advance the counter
+        inline void refill( void ){
+            uint32_t k[2] = { key[0], key[1] };
+            for( int i = 0; i < 4; i ++ ) out[i] = ctr[i];
+            for( int r = 0; r < 10; r ++ ){
+                if( r != 0 ){
+                    k[0] += 0x9E3779B9U; k[1] += 0xBB67AE85U;
+                }
+                philox_round( out, k );
+            }
+            if( ++ ctr[0] == 0 ) ++ ctr[1];
+            nout = 0;
+        }
+    public:
+        RandomStream( uint64_t key = 0, uint64_t sub = 0 ){ this->seed( key, sub ); }
+        /*! \brief seed the stream with a key */
+        inline void seed( uint64_t key ){
+            this->seed( key, 0 );
+        }
+        /*! 
+         * \brief seed the stream with a pair of keys, e.g. global seed and index of the task,
+         *  stream with same key and different sub are independent
+         */
+        inline void seed( uint64_t key, uint64_t sub ){
+            this->key[0] = static_cast<uint32_t>( key );
+            this->key[1] = static_cast<uint32_t>( key >> 32 );
+            ctr[0] = ctr[1] = 0;
+            ctr[2] = static_cast<uint32_t>( sub );
+            ctr[3] = static_cast<uint32_t>( sub >> 32 );
+            nout = 4;
+        }
+        /*! \brief skip first n groups of 4 outputs of the stream, O(1) */
+        inline void skip( uint64_t n ){
+            ctr[0] = static_cast<uint32_t>( n );
+            ctr[1] = static_cast<uint32_t>( n >> 32 );
+            nout = 4;
+        }
+        /*! \brief return a random number */
+        inline uint32_t next_uint32( void ){
+            if( nout == 4 ) this->refill();
+            return out[ nout ++ ];
+        }
+        /*! \brief return a random number in n */
+        inline uint32_t next_uint32( uint32_t n ){
+            return static_cast<uint32_t>( ( static_cast<uint64_t>( next_uint32() ) * n ) >> 32 );
+        }
+        /*! \brief return a real number uniform in [0,1) */
+        inline double next_double( void ){
+            return static_cast<double>( next_uint32() ) / 4294967296.0;
+        }
+        /*! \brief return a real numer uniform in (0,1) */
+        inline double next_double2( void ){
+            return ( static_cast<double>( next_uint32() ) + 1.0 ) / 4294967297.0;
+        }
+        /*! \brief return  x~N(0,1) */
+        inline double sample_normal( void ){
+            double x,y,s;
+            do{
+                x = 2 * next_double2() - 1.0;
+                y = 2 * next_double2() - 1.0;
+                s = x*x + y*y;
+            }while( s >= 1.0 || s == 0.0 );
+            return x * sqrt( -2.0 * log(s) / s ) ;
+        }
+        /*! \brief  return 1 with probability p, coin flip */
+        inline int sample_binary( double p ){
+            return next_double() <  p;  
+        }
+    };
+    /*! 
+     * \brief create the stream of a task from the global seed, 
+     *   tag distinguishes different usage, sub is the index of the task
+     */
+    inline RandomStream task_stream( uint32_t tag, uint64_t sub ){
+        return RandomStream( ( static_cast<uint64_t>( tag ) << 32 ) | global_seed(), sub );
+    }
+
+    template<typename T>
+    inline void shuffle( T *data, size_t sz, RandomStream &rnd ){
+        if( sz == 0 ) return;
+        for( uint32_t i = (uint32_t)sz - 1; i > 0; i-- ){
+            exchange( data[i], data[ rnd.next_uint32( i+1 ) ] );
+        }
+    }
+    // random shuffle the data inside using given stream
+    template<typename T>
+    inline void shuffle( std::vector<T> &data, RandomStream &rnd ){
+        shuffle( &data[0], data.size(), rnd );
+    }
+};
+
 #endif
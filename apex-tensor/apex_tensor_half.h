@@ -0,0 +1,270 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _APEX_TENSOR_HALF_H_
+#define _APEX_TENSOR_HALF_H_
+
+/*!
+ * \file apex_tensor_half.h
+ * \brief 16-bit storage of float matrix, in IEEE half(fp16) or bfloat16(bf16),
+ *   rows are converted to float before calculation, and converted back with stochastic rounding after update
+ *
+ *   conversion uses SSE2, fp16 conversion uses F16C when compiled with -mf16c
+ */
+#include <cstdio>
+#include <cstring>
+#include "apex_tensor.h"
+#include "apex_random.h"
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+namespace apex_half{
+    /*! \brief type of 16-bit float */
+    namespace half_type{
+        /*! \brief not 16-bit, float is used */
+        const int FP32 = 0;
+        /*! \brief IEEE half: 5 bits exponent, 10 bits mantissa */
+        const int FP16 = 1;
+        /*! \brief bfloat16: high 16 bits of float */
+        const int BF16 = 2;
+    };
+
+    inline uint32_t float_bits( float f ){
+        uint32_t b; memcpy( &b, &f, sizeof(b) ); return b;
+    }
+    inline float bits_float( uint32_t b ){
+        float f; memcpy( &f, &b, sizeof(f) ); return f;
+    }
+    /*! \brief fp16 to float, exact */
+    inline float fp16_to_float( uint16_t h ){
+        const uint32_t sign = static_cast<uint32_t>( h & 0x8000 ) << 16;
+        const uint32_t e = ( h >> 10 ) & 0x1f, m = h & 0x3ff;
+        if( e == 0 ){
+            // zero and subnormal: m * 2^-24
+            const float f = static_cast<float>( m ) * 5.9604644775390625e-8f;
+            return bits_float( float_bits( f ) | sign );
+        }
+        if( e == 31 ) return bits_float( sign | 0x7f800000 | ( m << 13 ) );
+        return bits_float( sign | ( ( e + 112 ) << 23 ) | ( m << 13 ) );
+    }
+    // float to fp16, stochastic: whether to round with random bits rnd instead of to nearest even
+    inline uint16_t float_to_fp16( float f, bool stochastic, uint32_t rnd ){
+        const uint32_t b = float_bits( f );
+        const uint16_t sign = static_cast<uint16_t>( ( b >> 16 ) & 0x8000 );
+        const uint32_t a = b & 0x7fffffff;
+        if( a > 0x7f800000 ) return sign | 0x7e00;
+        if( a < ( 113U << 23 ) ){
+            // result is subnormal, counted in unit of 2^-24, 1024 units carry into the smallest normal
+            const float q = bits_float( a ) * 16777216.0f;
+            const float r = stochastic ? floorf( q + static_cast<float>( rnd >> 8 ) * 5.9604644775390625e-8f ) : rintf( q );
+            return sign | static_cast<uint16_t>( r );
+        }
+        uint32_t v = a - ( 112U << 23 );
+        v += stochastic ? ( rnd & 0x1fff ) : ( 0xfff + ( ( v >> 13 ) & 1 ) );
+        v >>= 13;
+        return sign | static_cast<uint16_t>( v >= 0x7c00 ? 0x7c00 : v );
+    }
+    /*! \brief float to fp16, rounded to nearest even */
+    inline uint16_t float_to_fp16( float f ){
+        return float_to_fp16( f, false, 0 );
+    }
+    /*! 
+     * \brief float to fp16 with stochastic rounding, the value is rounded up with probability
+     *    proportional to its distance to the fp16 value below
+     * \param f the input
+     * \param rnd 32 random bits
+     */
+    inline uint16_t float_to_fp16( float f, uint32_t rnd ){
+        return float_to_fp16( f, true, rnd );
+    }
+    /*! \brief bf16 to float, exact */
+    inline float bf16_to_float( uint16_t h ){
+        return bits_float( static_cast<uint32_t>( h ) << 16 );
+    }
+    /*! \brief float to bf16, rounded to nearest even */
+    inline uint16_t float_to_bf16( float f ){
+        const uint32_t b = float_bits( f );
+        if( ( b & 0x7fffffff ) > 0x7f800000 ) return static_cast<uint16_t>( ( b >> 16 ) | 0x40 );
+        return static_cast<uint16_t>( ( b + 0x7fff + ( ( b >> 16 ) & 1 ) ) >> 16 );
+    }
+    /*! 
+     * \brief float to bf16 with stochastic rounding
+     * \param f the input
+     * \param rnd 32 random bits
+     */
+    inline uint16_t float_to_bf16( float f, uint32_t rnd ){
+        const uint32_t b = float_bits( f );
+        if( ( b & 0x7fffffff ) > 0x7f800000 ) return static_cast<uint16_t>( ( b >> 16 ) | 0x40 );
+        return static_cast<uint16_t>( ( b + ( rnd & 0xffff ) ) >> 16 );
+    }
+
+    /*!
+     * \brief xorshift generator of the random bits for stochastic rounding,
+     *   it has 4 lanes so that 4 elements are rounded at once
+     */
+    struct RoundRandom{
+        uint32_t s[4];
+        RoundRandom( void ){
+            s[0] = 123456789; s[1] = 362436069; s[2] = 521288629; s[3] = 88675123;
+        }
+        /*! \brief take the state from a random stream */
+        inline void seed( apex_random::RandomStream rnd ){
+            // xorshift state must not be 0
+            for( int i = 0; i < 4; i ++ ){
+                do{ s[i] = rnd.next_uint32(); }while( s[i] == 0 );
+            }
+        }
+        inline uint32_t next( void ){
+            uint32_t x = s[0];
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            return s[0] = x;
+        }
+    };
+
+    /*! \brief dst[i] = float( src[i] ) */
+    inline void decode( float *dst, const uint16_t *src, int n, int type ){
+        int i = 0;
+        if( type == half_type::BF16 ){
+#if __APEX_TENSOR_USE_SSE__
+            const __m128i zero = _mm_setzero_si128();
+            for( ; i + 8 <= n; i += 8 ){
+                const __m128i h = _mm_loadu_si128( reinterpret_cast<const __m128i*>( src + i ) );
+                _mm_storeu_ps( dst + i    , _mm_castsi128_ps( _mm_unpacklo_epi16( zero, h ) ) );
+                _mm_storeu_ps( dst + i + 4, _mm_castsi128_ps( _mm_unpackhi_epi16( zero, h ) ) );
+            }
+#endif
+            for( ; i < n; i ++ ) dst[i] = bf16_to_float( src[i] );
+        }else{
+#ifdef __F16C__
+            for( ; i + 4 <= n; i += 4 ){
+                _mm_storeu_ps( dst + i, _mm_cvtph_ps( _mm_loadl_epi64( reinterpret_cast<const __m128i*>( src + i ) ) ) );
+            }
+#endif
+            for( ; i < n; i ++ ) dst[i] = fp16_to_float( src[i] );
+        }
+    }
+    /*! \brief dst[i] = half( src[i] ), rounded to nearest even */
+    inline void encode( uint16_t *dst, const float *src, int n, int type ){
+        int i = 0;
+        if( type == half_type::BF16 ){
+            for( ; i < n; i ++ ) dst[i] = float_to_bf16( src[i] );
+        }else{
+#ifdef __F16C__
+            for( ; i + 4 <= n; i += 4 ){
+                _mm_storel_epi64( reinterpret_cast<__m128i*>( dst + i ),
+                                  _mm_cvtps_ph( _mm_loadu_ps( src + i ), _MM_FROUND_TO_NEAREST_INT ) );
+            }
+#endif
+            for( ; i < n; i ++ ) dst[i] = float_to_fp16( src[i] );
+        }
+    }
+    /*! \brief dst[i] = half( src[i] ), stochastically rounded, so that the expectation of the result equals src[i] */
+    inline void encode( uint16_t *dst, const float *src, int n, int type, RoundRandom &rnd ){
+        int i = 0;
+        if( type == half_type::BF16 ){
+#if __APEX_TENSOR_USE_SSE__
+            __m128i s = _mm_loadu_si128( reinterpret_cast<const __m128i*>( rnd.s ) );
+            const __m128i mask = _mm_set1_epi32( 0xffff );
+            for( ; i + 8 <= n; i += 8 ){
+                __m128i v[2];
+                for( int k = 0; k < 2; k ++ ){
+                    // xorshift on each lane
+                    s = _mm_xor_si128( s, _mm_slli_epi32( s, 13 ) );
+                    s = _mm_xor_si128( s, _mm_srli_epi32( s, 17 ) );
+                    s = _mm_xor_si128( s, _mm_slli_epi32( s, 5 ) );
+                    const __m128i b = _mm_castps_si128( _mm_loadu_ps( src + i + k * 4 ) );
+                    // arithmetic shift keeps the 16 bits exact through signed saturation of packs
+                    v[k] = _mm_srai_epi32( _mm_add_epi32( b, _mm_and_si128( s, mask ) ), 16 );
+                }
+                _mm_storeu_si128( reinterpret_cast<__m128i*>( dst + i ), _mm_packs_epi32( v[0], v[1] ) );
+            }
+            _mm_storeu_si128( reinterpret_cast<__m128i*>( rnd.s ), s );
+#endif
+            for( ; i < n; i ++ ) dst[i] = float_to_bf16( src[i], rnd.next() );
+        }else{
+            for( ; i < n; i ++ ) dst[i] = float_to_fp16( src[i], rnd.next() );
+        }
+    }
+
+    /*! \brief matrix of 16-bit float, row y starts at dptr + y * pitch */
+    struct HTensor2D{
+        /*! \brief number of element in x dimension */
+        int x_max;
+        /*! \brief number of element in y dimension */
+        int y_max;
+        /*! \brief number of elements allocated in x dimension */
+        size_t pitch;
+        /*! \brief pointer to data */
+        uint16_t *dptr;
+        HTensor2D( void ){
+            x_max = y_max = 0; pitch = 0; dptr = NULL;
+        }
+        inline void set_param( int y_max, int x_max ){
+            this->y_max = y_max; this->x_max = x_max;
+        }
+        inline uint16_t *operator[]( size_t idx ){
+            return dptr + idx * pitch;
+        }
+        inline const uint16_t *operator[]( size_t idx ) const{
+            return dptr + idx * pitch;
+        }
+        /*! \brief return rows start from y_start with range y_max */
+        inline HTensor2D sub_area( int y_start, int y_max ) const{
+            HTensor2D ts = *this;
+            ts.dptr = dptr + y_start * pitch;
+            ts.y_max = y_max;
+            return ts;
+        }
+    };
+    /*! \brief allocate space, rows are aligned to 16 bytes */
+    inline void alloc_space( HTensor2D &ts ){
+        size_t pitch;
+        ts.dptr = static_cast<uint16_t*>( apex_sse2::aligned_malloc_pitch( pitch, ts.x_max * sizeof(uint16_t), ts.y_max ) );
+        ts.pitch = pitch / sizeof(uint16_t);
+    }
+    inline void free_space( HTensor2D &ts ){
+        if( ts.dptr != NULL ) apex_sse2::aligned_free( ts.dptr );
+        ts.dptr = NULL;
+    }
+    /*! \brief copy rows, shape must be the same */
+    inline void copy( HTensor2D dst, const HTensor2D &src ){
+        for( int y = 0; y < src.y_max; y ++ ){
+            memcpy( dst[y], src[y], src.x_max * sizeof(uint16_t) );
+        }
+    }
+    /*! \brief save in the same layout as cpu_only::save_to_file of CTensor2D, with 16-bit elements */
+    inline void save_to_file( const HTensor2D &ts, FILE *fo ){
+        const int shape[2] = { ts.x_max, ts.y_max };
+        fwrite( shape, sizeof(int), 2, fo );
+        for( int y = 0; y < ts.y_max; y ++ ){
+            fwrite( ts[y], sizeof(uint16_t), ts.x_max, fo );
+        }
+    }
+    /*! \brief load from file, space shall be allocated with the same shape */
+    inline void load_from_file( HTensor2D &ts, FILE *fi ){
+        int shape[2];
+        apex_tensor::cpu_template::assert_true( fread( shape, sizeof(int), 2, fi ) == 2, "HTensor2D::load_from_file" );
+        apex_tensor::cpu_template::assert_true( shape[0] == ts.x_max && shape[1] == ts.y_max, "HTensor2D::load_from_file: shape mismatch" );
+        for( int y = 0; y < ts.y_max; y ++ ){
+            if( ts.x_max > 0 )
+                apex_tensor::cpu_template::assert_true( fread( ts[y], sizeof(uint16_t), ts.x_max, fi ) == (size_t)ts.x_max,
+                                                        "HTensor2D::load_from_file" );
+        }
+    }
+};
+#endif
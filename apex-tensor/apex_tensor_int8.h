@@ -0,0 +1,119 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _APEX_TENSOR_INT8_H_
+#define _APEX_TENSOR_INT8_H_
+
+/*!
+ * \file apex_tensor_int8.h
+ * \brief int8 matrix with a scale for each row, used for approximate dot products,
+ *   x[i] is approximated by scale * q[i], where scale = max|x| / 127
+ */
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include "apex_tensor.h"
+
+namespace apex_int8{
+    /*!
+     * \brief quantize a vector
+     * \param dst the quantized vector
+     * \param src the input
+     * \param n length of the vector
+     * \return scale of the quantized vector
+     */
+    inline float quantize( int8_t *dst, const float *src, int n ){
+        float amax = 0.0f;
+        for( int i = 0; i < n; i ++ ){
+            amax = std::max( amax, fabsf( src[i] ) );
+        }
+        if( amax == 0.0f ){
+            memset( dst, 0, n ); return 0.0f;
+        }
+        const float r = 127.0f / amax;
+        for( int i = 0; i < n; i ++ ){
+            dst[i] = static_cast<int8_t>( lrintf( src[i] * r ) );
+        }
+        return amax / 127.0f;
+    }
+    /*! \brief integer dot product of two int8 vectors, exact */
+    inline int32_t dot( const int8_t *a, const int8_t *b, int n ){
+        int i = 0;
+        int32_t sum = 0;
+#if __APEX_TENSOR_USE_SSE__
+        __m128i acc = _mm_setzero_si128();
+        for( ; i + 16 <= n; i += 16 ){
+            const __m128i x = _mm_loadu_si128( reinterpret_cast<const __m128i*>( a + i ) );
+            const __m128i y = _mm_loadu_si128( reinterpret_cast<const __m128i*>( b + i ) );
+            // sign extend to int16, then multiply and add adjacent pairs to int32
+            const __m128i xl = _mm_srai_epi16( _mm_unpacklo_epi8( x, x ), 8 );
+            const __m128i xh = _mm_srai_epi16( _mm_unpackhi_epi8( x, x ), 8 );
+            const __m128i yl = _mm_srai_epi16( _mm_unpacklo_epi8( y, y ), 8 );
+            const __m128i yh = _mm_srai_epi16( _mm_unpackhi_epi8( y, y ), 8 );
+            acc = _mm_add_epi32( acc, _mm_madd_epi16( xl, yl ) );
+            acc = _mm_add_epi32( acc, _mm_madd_epi16( xh, yh ) );
+        }
+        int32_t lane[4];
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( lane ), acc );
+        sum = lane[0] + lane[1] + lane[2] + lane[3];
+#endif
+        for( ; i < n; i ++ ){
+            sum += static_cast<int32_t>( a[i] ) * b[i];
+        }
+        return sum;
+    }
+
+    /*! \brief int8 matrix, row y starts at dptr + y * pitch and is scaled by scale[y] */
+    struct QTensor2D{
+        /*! \brief number of element in x dimension */
+        int x_max;
+        /*! \brief number of element in y dimension */
+        int y_max;
+        /*! \brief number of bytes allocated in x dimension */
+        size_t pitch;
+        /*! \brief pointer to data */
+        int8_t *dptr;
+        /*! \brief scale of each row */
+        float *scale;
+        QTensor2D( void ){
+            x_max = y_max = 0; pitch = 0; dptr = NULL; scale = NULL;
+        }
+        inline void set_param( int y_max, int x_max ){
+            this->y_max = y_max; this->x_max = x_max;
+        }
+        inline int8_t *operator[]( size_t idx ){
+            return dptr + idx * pitch;
+        }
+        inline const int8_t *operator[]( size_t idx ) const{
+            return dptr + idx * pitch;
+        }
+        /*! \brief quantize src into row y */
+        inline void set_row( size_t y, const float *src ){
+            scale[ y ] = quantize( (*this)[ y ], src, x_max );
+        }
+    };
+    /*! \brief allocate space, rows are aligned to 16 bytes */
+    inline void alloc_space( QTensor2D &ts ){
+        ts.dptr  = static_cast<int8_t*>( apex_sse2::aligned_malloc_pitch( ts.pitch, ts.x_max, ts.y_max ) );
+        ts.scale = static_cast<float*>( apex_sse2::aligned_malloc( ts.y_max * sizeof(float) ) );
+    }
+    inline void free_space( QTensor2D &ts ){
+        if( ts.dptr != NULL ) apex_sse2::aligned_free( ts.dptr );
+        if( ts.scale != NULL ) apex_sse2::aligned_free( ts.scale );
+        ts.dptr = NULL; ts.scale = NULL;
+    }
+};
+#endif
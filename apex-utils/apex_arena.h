@@ -0,0 +1,96 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _APEX_ARENA_H_
+#define _APEX_ARENA_H_
+
+/*!
+ * \file apex_arena.h
+ * \brief bump allocator, used to hold data of a buffer slot that is refilled again and again
+ */
+
+#include <cstdlib>
+#include <vector>
+#include "apex_utils.h"
+
+namespace apex_utils{
+    /*!
+     * \brief bump allocator: memory is carved from chunks and released all at once by reset,
+     *   chunks are merged on reset, so a steady workload is served from one chunk without any allocation
+     */
+    class MemoryArena{
+    private:
+        /*! \brief alignment of each allocation */
+        static const size_t kAlign = 16;
+        /*! \brief minimum size of a chunk */
+        static const size_t kMinChunk = 1 << 12;
+        /*! \brief allocated chunks, only the last one is carved */
+        std::vector<char*> chunk;
+        /*! \brief used bytes and capacity of last chunk */
+        size_t top, cap;
+        /*! \brief bytes carved since last reset */
+        size_t used;
+        inline void grow( size_t size ){
+            char *p = static_cast<char*>( malloc( size ) );
+            apex_utils::assert_true( p != NULL, "MemoryArena: out of memory" );
+            chunk.push_back( p );
+            top = 0; cap = size;
+        }
+    public:
+        MemoryArena( void ){ top = cap = used = 0; }
+        /*! \brief copy of an arena is empty, memory is never shared */
+        MemoryArena( const MemoryArena &src ){ top = cap = used = 0; }
+        inline MemoryArena &operator=( const MemoryArena &src ){
+            this->release(); return *this;
+        }
+        ~MemoryArena( void ){ this->release(); }
+        /*! \brief free all the memory held by the arena */
+        inline void release( void ){
+            for( size_t i = 0; i < chunk.size(); i ++ ) free( chunk[i] );
+            chunk.clear();
+            top = cap = used = 0;
+        }
+        /*!
+         * \brief release all allocations at once, memory is kept for later use
+         * \param reserve hint of bytes needed before next reset
+         */
+        inline void reset( size_t reserve = 0 ){
+            const size_t need = used > reserve ? used : reserve;
+            if( chunk.size() > 1 || need > cap ){
+                this->release();
+                if( need != 0 ) this->grow( need );
+            }
+            top = used = 0;
+        }
+        /*!
+         * \brief allocate space of n elements, the space is valid until next reset
+         * \tparam T type of element, must not need constructor
+         */
+        template<typename T>
+        inline T *alloc( size_t n ){
+            const size_t size = ( n * sizeof(T) + kAlign - 1 ) & ~( kAlign - 1 );
+            if( chunk.size() == 0 || top + size > cap ){
+                // geometric growth keeps number of chunks small before the merge
+                size_t csize = cap * 2 > kMinChunk ? cap * 2 : kMinChunk;
+                this->grow( size > csize ? size : csize );
+            }
+            T *p = reinterpret_cast<T*>( chunk.back() + top );
+            top += size; used += size;
+            return p;
+        }
+    };
+};
+#endif
@@ -0,0 +1,241 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _APEX_FRAME_FILE_H_
+#define _APEX_FRAME_FILE_H_
+
+/*!
+ * \file apex_frame_file.h
+ * \brief indexed block file container: a sequence of frames, optionally compressed,
+ *   with an index at the end, so frames can be read in any order and checked
+ *
+ * layout: magic, version, user header, frames [raw_size, comp_size, data],
+ *         index entry of each frame [offset(int64), num_row, checksum], 
+ *         number of frames(int64), offset of index(int64), magic
+ */
+
+#include <vector>
+#include "apex_utils.h"
+#include "apex_lz4.h"
+
+#ifdef _MSC_VER
+typedef long long int64_t;
+#else
+#include <inttypes.h>
+#endif
+
+namespace apex_utils{
+    /*! \brief magic number of frame file, negative so it never equals the first int of a raw buffer */
+    const int kFrameMagic = static_cast<int>( 0xF7A3E501U );
+    /*! \brief version of frame file format */
+    const int kFrameVersion = 1;
+
+    /*! \brief adler32 checksum of data */
+    inline unsigned adler32( const char *data, size_t n ){
+        const unsigned char *p = reinterpret_cast<const unsigned char*>( data );
+        unsigned a = 1, b = 0;
+        while( n != 0 ){
+            // largest number of steps before a and b may overflow
+            size_t k = n < 5552 ? n : 5552;
+            n -= k;
+            while( k -- ){
+                a += *p ++; b += a;
+            }
+            a %= 65521; b %= 65521;
+        }
+        return ( b << 16 ) | a;
+    }
+
+    /*! \brief index entry of a frame */
+    struct FrameIndex{
+        /*! \brief offset of frame in file */
+        int64_t offset;
+        /*! \brief number of rows in the frame, given by the writer */
+        int num_row;
+        /*! \brief checksum of uncompressed data */
+        unsigned checksum;
+    };
+
+    /*! \brief check whether the file is a frame file, file position is reset to beginning */
+    inline bool is_frame_file( FILE *fi ){
+        int magic = 0;
+        fseek( fi, 0, SEEK_SET );
+        const bool ret = fread( &magic, sizeof(int), 1, fi ) == 1 && magic == kFrameMagic;
+        fseek( fi, 0, SEEK_SET );
+        return ret;
+    }
+
+    /*! \brief writer of frame file, the file must be newly opened */
+    class FrameWriter{
+    private:
+        FILE *fo;
+        int compress;
+        int64_t pos;
+        std::vector<FrameIndex> index;
+        std::vector<char> cbuf;
+        inline void write_raw( const void *ptr, size_t size ){
+            fwrite( ptr, 1, size, fo ); pos += size;
+        }
+    public:
+        /*! \brief offset of user header */
+        static const int kHeaderOffset = sizeof(int) * 2;
+        /*!
+         * \brief constructor
+         * \param fo output file
+         * \param compress whether to compress the frames
+         */
+        FrameWriter( FILE *fo, int compress = 1 ):fo(fo), compress(compress){
+            pos = 0;
+            this->write_raw( &kFrameMagic, sizeof(int) );
+            this->write_raw( &kFrameVersion, sizeof(int) );
+        }
+        /*! \brief write header of user, must be called before any frame, it starts at kHeaderOffset */
+        inline void write_header( const void *ptr, size_t size ){
+            apex_utils::assert_true( index.size() == 0, "header must be written before frames" );
+            this->write_raw( ptr, size );
+        }
+        /*! 
+         * \brief write data as a frame, frames that can't be compressed are stored as they are 
+         * \param ptr start of data
+         * \param size size of data
+         * \param num_row number of rows in the data, kept in index
+         */
+        inline void write_frame( const void *ptr, size_t size, int num_row = 0 ){
+            int head[2];
+            head[0] = static_cast<int>( size );
+            head[1] = head[0];
+            if( compress != 0 ){
+                cbuf.resize( lz4_compress_bound( size ) );
+                head[1] = static_cast<int>( lz4_compress( static_cast<const char*>( ptr ), size, &cbuf[0] ) );
+            }
+            FrameIndex e;
+            e.offset = pos; e.num_row = num_row;
+            e.checksum = adler32( static_cast<const char*>( ptr ), size );
+            index.push_back( e );
+            if( head[1] >= head[0] ){
+                head[1] = head[0];
+                this->write_raw( head, sizeof(head) );
+                this->write_raw( ptr, size );
+            }else{
+                this->write_raw( head, sizeof(head) );
+                this->write_raw( &cbuf[0], head[1] );
+            }
+        }
+        /*! \brief number of bytes written */
+        inline int64_t tell( void ) const{
+            return pos;
+        }
+        /*! \brief write index, caller is responsible to close the file */
+        inline void close( void ){
+            const int64_t index_pos = pos, nframe = static_cast<int64_t>( index.size() );
+            if( index.size() != 0 ) this->write_raw( &index[0], sizeof(FrameIndex) * index.size() );
+            this->write_raw( &nframe, sizeof(int64_t) );
+            this->write_raw( &index_pos, sizeof(int64_t) );
+            this->write_raw( &kFrameMagic, sizeof(int) );
+        }
+    };
+
+    /*! \brief reader of frame file */
+    class FrameReader{
+    private:
+        FILE *fi;
+        std::vector<FrameIndex> index;
+        std::vector<char> cbuf;
+        size_t total_row;
+        /*! \brief offset of index, frames end before it */
+        int64_t index_pos;
+    public:
+        FrameReader( void ){ fi = NULL; total_row = 0; index_pos = 0; }
+        /*! \brief load and check index of the file, file position is set to the user header */
+        inline void open( FILE *fi ){
+            this->fi = fi;
+            int head[2];
+            fseek( fi, 0, SEEK_SET );
+            apex_utils::assert_true( fread( head, sizeof(int), 2, fi ) == 2 && head[0] == kFrameMagic, "invalid frame file" );
+            apex_utils::assert_true( head[1] <= kFrameVersion, "frame file is written by a newer version" );
+            int64_t tail[2]; int magic;
+            fseek( fi, -static_cast<long>( sizeof(tail) + sizeof(int) ), SEEK_END );
+            const size_t fsize = static_cast<size_t>( 
+#ifdef _MSC_VER
+                _ftelli64( fi )
+#else
+                ftello( fi )
+#endif
+                ) + sizeof(tail) + sizeof(int);
+            apex_utils::assert_true( fread( tail, sizeof(int64_t), 2, fi ) == 2 &&
+                                     fread( &magic, sizeof(int), 1, fi ) == 1 && magic == kFrameMagic, 
+                                     "frame file has no index, it may be truncated" );
+            index.resize( static_cast<size_t>( tail[0] ) );
+            apex_utils::assert_true( static_cast<size_t>( tail[1] ) + sizeof(FrameIndex) * index.size() + sizeof(tail) + sizeof(int) == fsize, 
+                                     "frame file index is corrupted" );
+            fseek_page( fi, 1, static_cast<size_t>( tail[1] ) );
+            if( index.size() != 0 ){
+                apex_utils::assert_true( fread( &index[0], sizeof(FrameIndex), index.size(), fi ) == index.size(), "invalid frame file" );
+            }
+            index_pos = tail[1];
+            total_row = 0;
+            for( size_t i = 0; i < index.size(); i ++ ){
+                // frames are stored in order, each one holds at least its [raw_size, comp_size] head
+                const int64_t end = i + 1 < index.size() ? index[i+1].offset : index_pos;
+                apex_utils::assert_true( index[i].offset >= FrameWriter::kHeaderOffset && 
+                                         index[i].offset + static_cast<int64_t>( sizeof(int) * 2 ) <= end, 
+                                         "frame file index is corrupted" );
+                total_row += index[i].num_row;
+            }
+            fseek( fi, FrameWriter::kHeaderOffset, SEEK_SET );
+        }
+        /*! \brief number of frames */
+        inline size_t num_frame( void ) const{
+            return index.size();
+        }
+        /*! \brief number of rows in frame idx */
+        inline size_t num_row( size_t idx ) const{
+            return static_cast<size_t>( index[ idx ].num_row );
+        }
+        /*! \brief number of rows in frames [begin,end) */
+        inline size_t num_row( size_t begin, size_t end ) const{
+            if( begin == 0 && end == index.size() ) return total_row;
+            size_t sum = 0;
+            for( size_t i = begin; i < end; i ++ ) sum += index[i].num_row;
+            return sum;
+        }
+        /*!
+         * \brief read and decompress a frame
+         * \param idx index of frame
+         * \param out output data, resized to size of the frame
+         */
+        inline void read_frame( size_t idx, std::vector<char> &out ){
+            int head[2];
+            fseek_page( fi, 1, static_cast<size_t>( index[ idx ].offset ) );
+            apex_utils::assert_true( fread( head, sizeof(int), 2, fi ) == 2, "invalid frame file" );
+            // check sizes before allocation: stored data lies within the frame, and LZ4 expands each byte at most 255 times
+            const int64_t span = ( idx + 1 < index.size() ? index[idx+1].offset : index_pos ) - index[ idx ].offset - static_cast<int64_t>( sizeof(head) );
+            apex_utils::assert_true( head[1] >= 0 && head[1] <= head[0] && head[1] <= span &&
+                                     static_cast<int64_t>( head[0] ) <= static_cast<int64_t>( head[1] ) * 255 + 16, "corrupted frame" );
+            out.resize( head[0] );
+            if( head[0] == 0 ) return;
+            if( head[1] == head[0] ){
+                apex_utils::assert_true( fread( &out[0], 1, head[0], fi ) == static_cast<size_t>( head[0] ), "invalid frame file" );
+            }else{
+                cbuf.resize( head[1] );
+                apex_utils::assert_true( fread( &cbuf[0], 1, head[1], fi ) == static_cast<size_t>( head[1] ), "invalid frame file" );
+                apex_utils::assert_true( lz4_decompress( &cbuf[0], head[1], &out[0], head[0] ), "corrupted frame" );
+            }
+            apex_utils::assert_true( adler32( &out[0], out.size() ) == index[ idx ].checksum, "frame checksum mismatch, file is corrupted" );
+        }
+    };
+};
+#endif
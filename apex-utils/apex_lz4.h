@@ -0,0 +1,161 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _APEX_LZ4_H_
+#define _APEX_LZ4_H_
+
+/*!
+ * \file apex_lz4.h
+ * \brief self contained fast block codec, output follows LZ4 block format
+ *   so it can be decoded by any LZ4 implementation
+ */
+
+#include <cstring>
+#include <vector>
+
+namespace apex_utils{
+    namespace lz4{
+        /*! \brief minimum length of a match */
+        const int kMinMatch = 4;
+        /*! \brief last match must start at least this number of bytes before end of block */
+        const int kMFLimit = 12;
+        /*! \brief last bytes of block are always literals */
+        const int kLastLiterals = 5;
+        /*! \brief log of size of hash table */
+        const int kHashLog = 16;
+        /*! \brief max distance of a match */
+        const int kMaxDistance = 65535;
+
+        inline unsigned read32( const unsigned char *p ){
+            unsigned v; memcpy( &v, p, 4 ); return v;
+        }
+        inline unsigned hash( unsigned v ){
+            return ( v * 2654435761U ) >> ( 32 - kHashLog );
+        }
+        inline unsigned char *write_length( unsigned char *op, size_t len ){
+            for( ; len >= 255; len -= 255 ) *op ++ = 255;
+            *op ++ = static_cast<unsigned char>( len );
+            return op;
+        }
+        // write a sequence of literals followed by a match, mlen = 0 means last literals
+        inline unsigned char *write_sequence( unsigned char *op, const unsigned char *lit, size_t nlit, size_t offset, size_t mlen ){
+            unsigned char *token = op ++;
+            *token = static_cast<unsigned char>( ( nlit < 15 ? nlit : 15 ) << 4 );
+            if( nlit >= 15 ) op = write_length( op, nlit - 15 );
+            memcpy( op, lit, nlit ); op += nlit;
+            if( mlen == 0 ) return op;
+            *op ++ = static_cast<unsigned char>( offset & 255 );
+            *op ++ = static_cast<unsigned char>( offset >> 8 );
+            mlen -= kMinMatch;
+            *token |= static_cast<unsigned char>( mlen < 15 ? mlen : 15 );
+            if( mlen >= 15 ) op = write_length( op, mlen - 15 );
+            return op;
+        }
+    };
+    /*! \brief max size of compressed data of n bytes */
+    inline size_t lz4_compress_bound( size_t n ){
+        return n + n / 255 + 16;
+    }
+    /*!
+     * \brief compress data
+     * \param src input data
+     * \param n size of input
+     * \param dst output buffer, with at least lz4_compress_bound(n) bytes
+     * \return size of compressed data
+     */
+    inline size_t lz4_compress( const char *src, size_t n, char *dst ){
+        using namespace lz4;
+        const unsigned char *base = reinterpret_cast<const unsigned char*>( src );
+        const unsigned char *ip = base, *anchor = base, *iend = base + n;
+        unsigned char *op = reinterpret_cast<unsigned char*>( dst );
+        if( n > static_cast<size_t>( kMFLimit ) ){
+            const unsigned char *mflimit = iend - kMFLimit;
+            const unsigned char *matchlimit = iend - kLastLiterals;
+            // position + 1 of last occurence of each hash, 0 means empty
+            std::vector<size_t> table( 1 << kHashLog, 0 );
+            // skip faster in incompressible data
+            unsigned nmiss = 0;
+            while( ip <= mflimit ){
+                const unsigned h = hash( read32( ip ) );
+                const unsigned char *ref = base + table[ h ] - 1;
+                const bool hit = table[ h ] != 0 && ip - ref <= kMaxDistance && read32( ref ) == read32( ip );
+                table[ h ] = static_cast<size_t>( ip - base ) + 1;
+                if( !hit ){
+                    ip += 1 + ( nmiss ++ >> 6 ); continue;
+                }
+                nmiss = 0;
+                // extend match backward and forward
+                while( ip > anchor && ref > base && ip[-1] == ref[-1] ){
+                    -- ip; -- ref;
+                }
+                size_t mlen = kMinMatch;
+                while( ip + mlen < matchlimit && ip[ mlen ] == ref[ mlen ] ) ++ mlen;
+                op = write_sequence( op, anchor, ip - anchor, ip - ref, mlen );
+                ip += mlen; anchor = ip;
+            }
+        }
+        op = write_sequence( op, anchor, iend - anchor, 0, 0 );
+        return op - reinterpret_cast<unsigned char*>( dst );
+    }
+    /*!
+     * \brief decompress data
+     * \param src compressed data
+     * \param csize size of compressed data
+     * \param dst output buffer
+     * \param n size of original data
+     * \return whether the data is valid and decompressed to exactly n bytes
+     */
+    inline bool lz4_decompress( const char *src, size_t csize, char *dst, size_t n ){
+        const unsigned char *ip = reinterpret_cast<const unsigned char*>( src ), *iend = ip + csize;
+        unsigned char *base = reinterpret_cast<unsigned char*>( dst ), *op = base, *oend = base + n;
+        while( ip < iend ){
+            const unsigned token = *ip ++;
+            size_t nlit = token >> 4;
+            if( nlit == 15 ){
+                unsigned b;
+                do{
+                    if( ip >= iend ) return false;
+                    b = *ip ++; nlit += b;
+                }while( b == 255 );
+            }
+            if( nlit > static_cast<size_t>( iend - ip ) || nlit > static_cast<size_t>( oend - op ) ) return false;
+            memcpy( op, ip, nlit ); ip += nlit; op += nlit;
+            if( ip == iend ) break;
+            if( iend - ip < 2 ) return false;
+            const size_t offset = ip[0] | ( ip[1] << 8 ); ip += 2;
+            if( offset == 0 || offset > static_cast<size_t>( op - base ) ) return false;
+            size_t mlen = token & 15;
+            if( mlen == 15 ){
+                unsigned b;
+                do{
+                    if( ip >= iend ) return false;
+                    b = *ip ++; mlen += b;
+                }while( b == 255 );
+            }
+            mlen += lz4::kMinMatch;
+            if( mlen > static_cast<size_t>( oend - op ) ) return false;
+            const unsigned char *ref = op - offset;
+            if( offset >= mlen ){
+                memcpy( op, ref, mlen ); op += mlen;
+            }else{
+                // overlapped copy
+                for( size_t i = 0; i < mlen; i ++ ) *op ++ = *ref ++;
+            }
+        }
+        return op == oend;
+    }
+};
+#endif
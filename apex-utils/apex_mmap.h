@@ -0,0 +1,106 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _APEX_MMAP_H_
+#define _APEX_MMAP_H_
+
+/*!
+ * \file apex_mmap.h
+ * \brief read only memory mapping of a file, pages are shared by all processes that map the same file
+ */
+
+#include <cstdio>
+#include "apex_utils.h"
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+extern "C"{
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+};
+#endif
+
+namespace apex_utils{
+    /*! \brief read only mapping of a whole file */
+    class MappedFile{
+    private:
+        const char *dptr;
+        size_t dsize;
+#ifdef _MSC_VER
+        HANDLE hfile, hmap;
+#endif
+        // mapping can't be copied
+        MappedFile( const MappedFile &src );
+        MappedFile &operator=( const MappedFile &src );
+    public:
+        MappedFile( void ){ dptr = NULL; dsize = 0; }
+        ~MappedFile( void ){ this->close(); }
+        /*! \brief map the file, exit with error if the file can't be mapped */
+        inline void open( const char *fname ){
+            this->close();
+#ifdef _MSC_VER
+            hfile = CreateFileA( fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+            if( hfile == INVALID_HANDLE_VALUE ){
+                fprintf( stderr, "can not open file \"%s\"\n", fname ); exit( -1 );
+            }
+            LARGE_INTEGER sz;
+            GetFileSizeEx( hfile, &sz );
+            dsize = static_cast<size_t>( sz.QuadPart );
+            hmap = CreateFileMappingA( hfile, NULL, PAGE_READONLY, 0, 0, NULL );
+            apex_utils::assert_true( hmap != NULL, "MappedFile: can not map file" );
+            dptr = static_cast<const char*>( MapViewOfFile( hmap, FILE_MAP_READ, 0, 0, 0 ) );
+            apex_utils::assert_true( dptr != NULL, "MappedFile: can not map file" );
+#else
+            int fd = ::open( fname, O_RDONLY );
+            if( fd < 0 ){
+                fprintf( stderr, "can not open file \"%s\"\n", fname ); exit( -1 );
+            }
+            struct stat st;
+            apex_utils::assert_true( fstat( fd, &st ) == 0, "MappedFile: can not stat file" );
+            dsize = static_cast<size_t>( st.st_size );
+            if( dsize != 0 ){
+                void *p = mmap( NULL, dsize, PROT_READ, MAP_SHARED, fd, 0 );
+                apex_utils::assert_true( p != MAP_FAILED, "MappedFile: can not map file" );
+                dptr = static_cast<const char*>( p );
+            }
+            ::close( fd );
+#endif
+        }
+        /*! \brief unmap the file */
+        inline void close( void ){
+            if( dptr == NULL ) return;
+#ifdef _MSC_VER
+            UnmapViewOfFile( dptr );
+            CloseHandle( hmap ); CloseHandle( hfile );
+#else
+            munmap( const_cast<char*>( dptr ), dsize );
+#endif
+            dptr = NULL; dsize = 0;
+        }
+        /*! \brief start of mapped data, NULL if nothing is mapped */
+        inline const char *data( void ) const{
+            return dptr;
+        }
+        /*! \brief size of mapped data */
+        inline size_t size( void ) const{
+            return dsize;
+        }
+    };
+};
+#endif
@@ -0,0 +1,229 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _APEX_ROW_CACHE_H_
+#define _APEX_ROW_CACHE_H_
+
+/*!
+ * \file apex_row_cache.h
+ * \brief float matrix kept in a file, rows are accessed through a LRU cache of row blocks in memory,
+ *   modified blocks are written back when they are evicted
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <vector>
+#include <algorithm>
+#include "apex_utils.h"
+
+namespace apex_utils{
+    /*! \brief out of core float matrix with LRU cache of row blocks */
+    class RowCache{
+    public:
+        /*! \brief counters of cache traffic */
+        struct Stat{
+            /*! \brief number of row access whose block is in memory */
+            size_t hit;
+            /*! \brief number of row access whose block is loaded */
+            size_t miss;
+            /*! \brief number of blocks evicted */
+            size_t evict;
+            /*! \brief number of modified blocks written back to file */
+            size_t write_back;
+            Stat( void ){ hit = miss = evict = write_back = 0; }
+        };
+    private:
+        // block in memory
+        struct Slot{
+            float *data;
+            size_t block;
+            bool dirty;
+            // position in lru list
+            std::list<int>::iterator pos;
+        };
+        FILE *fp;
+        char fname[ 256 ];
+        // whether the file is named by user and removed on close, an anonymous file is removed by the system
+        bool named;
+        size_t num_col, num_row, block_rows, block_bytes;
+        // maximum number of blocks in memory
+        size_t max_slot;
+        std::vector<Slot> slots;
+        // slot of each block, -1 if not in memory
+        std::vector<int> block_slot;
+        // whether the block has been written to file, blocks never written are 0
+        std::vector<bool> on_disk;
+        // slots in order of last use, most recent at front
+        std::list<int> lru;
+        Stat stat;
+        // rows can't be copied
+        RowCache( const RowCache &src );
+        RowCache &operator=( const RowCache &src );
+    public:
+        RowCache( void ){
+            fp = NULL; num_col = num_row = 0;
+        }
+        ~RowCache( void ){
+            this->close();
+        }
+        /*!
+         * \brief create the matrix, the file is created as scratch space and removed on close
+         * \param fname name of file to store the rows, it must not exist; "NULL" means an anonymous temporary file
+         * \param num_col number of columns
+         * \param block_rows number of rows in a block, rows of a block are loaded and evicted together
+         * \param cache_bytes memory used by the cache, at least one block is kept in memory
+         */
+        inline void open( const char *fname, size_t num_col, size_t block_rows, size_t cache_bytes ){
+            this->close();
+            strncpy( this->fname, fname, sizeof(this->fname) - 1 );
+            this->fname[ sizeof(this->fname) - 1 ] = '\0';
+            named = strcmp( fname, "NULL" ) != 0;
+            if( named ){
+                // never truncate a file of user
+                FILE *fo = fopen( fname, "rb" );
+                if( fo != NULL ){
+                    fclose( fo );
+                    char msg[ 512 ];
+                    sprintf( msg, "RowCache: file \"%.256s\" already exists, remove it or choose another file", fname );
+                    apex_utils::error( msg );
+                }
+                fp = apex_utils::fopen_check( fname, "w+b" );
+            }else{
+                fp = tmpfile();
+                apex_utils::assert_true( fp != NULL, "RowCache: can not create temporary file" );
+            }
+            this->num_col = num_col;
+            this->num_row = 0;
+            this->block_rows = block_rows;
+            this->block_bytes = num_col * block_rows * sizeof(float);
+            this->max_slot = std::max( cache_bytes / block_bytes, (size_t)1 );
+            stat = Stat();
+        }
+        /*! \brief remove the file and free the memory */
+        inline void close( void ){
+            if( fp == NULL ) return;
+            fclose( fp );
+            if( named ) std::remove( fname );
+            for( size_t i = 0; i < slots.size(); i ++ ){
+                free( slots[i].data );
+            }
+            slots.clear(); block_slot.clear(); on_disk.clear(); lru.clear();
+            fp = NULL;
+        }
+        /*! \brief whether the matrix is open */
+        inline bool is_open( void ) const{
+            return fp != NULL;
+        }
+        /*! \brief set number of rows, new rows are 0 */
+        inline void resize( size_t num_row ){
+            this->num_row = num_row;
+            const size_t nblock = ( num_row + block_rows - 1 ) / block_rows;
+            if( nblock > block_slot.size() ){
+                block_slot.resize( nblock, -1 );
+                on_disk.resize( nblock, false );
+            }
+        }
+        /*! \brief number of rows */
+        inline size_t size( void ) const{
+            return num_row;
+        }
+        /*! \brief copy row r to dst */
+        inline void read_row( size_t r, float *dst ){
+            memcpy( dst, this->row( r, false ), num_col * sizeof(float) );
+        }
+        /*! \brief copy src to row r */
+        inline void write_row( size_t r, const float *src ){
+            memcpy( this->row( r, true ), src, num_col * sizeof(float) );
+        }
+        /*!
+         * \brief get row r, the pointer is valid until next access of another row
+         * \param r row index
+         * \param dirty whether the row will be modified
+         */
+        inline float *row( size_t r, bool dirty ){
+            assert_true( r < num_row, "RowCache: row index exceed bound" );
+            const size_t b = r / block_rows;
+            int s = block_slot[ b ];
+            if( s >= 0 ){
+                stat.hit ++;
+                lru.splice( lru.begin(), lru, slots[ s ].pos );
+            }else{
+                stat.miss ++;
+                s = this->load_block( b );
+            }
+            slots[ s ].dirty = slots[ s ].dirty || dirty;
+            return slots[ s ].data + ( r % block_rows ) * num_col;
+        }
+        /*! \brief counters of cache traffic */
+        inline const Stat &get_stat( void ) const{
+            return stat;
+        }
+        /*! \brief bytes of a block */
+        inline size_t get_block_bytes( void ) const{
+            return block_bytes;
+        }
+        /*! \brief number of blocks in memory */
+        inline size_t num_resident( void ) const{
+            return slots.size();
+        }
+    private:
+        inline void write_block( Slot &s ){
+            apex_utils::fseek_page( fp, block_bytes, s.block );
+            assert_true( fwrite( s.data, 1, block_bytes, fp ) == block_bytes, "RowCache: fail to write back rows" );
+            on_disk[ s.block ] = true;
+            s.dirty = false;
+            stat.write_back ++;
+        }
+        // load block b into a slot, a new slot is allocated if cache is not full, otherwise least recently used one is evicted
+        inline int load_block( size_t b ){
+            int s = -1;
+            if( slots.size() < max_slot ){
+                float *p = static_cast<float*>( malloc( block_bytes ) );
+                if( p != NULL ){
+                    Slot e; e.data = p; e.dirty = false;
+                    slots.push_back( e );
+                    s = static_cast<int>( slots.size() ) - 1;
+                    lru.push_front( s );
+                    slots[ s ].pos = lru.begin();
+                }else{
+                    // memory is less than expected, keep the cache at current size
+                    assert_true( slots.size() != 0, "RowCache: can not allocate a single block" );
+                    max_slot = slots.size();
+                }
+            }
+            if( s < 0 ){
+                s = lru.back();
+                Slot &e = slots[ s ];
+                if( e.dirty ) this->write_block( e );
+                block_slot[ e.block ] = -1;
+                stat.evict ++;
+                lru.splice( lru.begin(), lru, e.pos );
+            }
+            Slot &e = slots[ s ];
+            e.block = b; e.dirty = false;
+            block_slot[ b ] = s;
+            if( on_disk[ b ] ){
+                apex_utils::fseek_page( fp, block_bytes, b );
+                assert_true( fread( e.data, 1, block_bytes, fp ) == block_bytes, "RowCache: fail to read rows" );
+            }else{
+                memset( e.data, 0, block_bytes );
+            }
+            return s;
+        }
+    };
+};
+#endif
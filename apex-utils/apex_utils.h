@@ -23,6 +23,7 @@
 
 #ifdef _MSC_VER
 #define fopen64 fopen
+#include <xmmintrin.h>
 #else
 
 // use 64 bit offset, either to include this header in the beginning, or 
@@ -41,6 +42,8 @@ extern "C"{
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <climits>
 #include <vector>
 
 namespace apex_utils{        
@@ -60,6 +63,24 @@ namespace apex_utils{
     inline void warning( const char *msg ){
         fprintf( stderr, "warning:%s\n",msg );
     }
+
+    /*! \brief hint the processor to load the cache line of p, it never faults, no-op if the compiler has no such intrinsic */
+    inline void prefetch( const void *p ){
+#if defined(__GNUC__)
+        __builtin_prefetch( p );
+#elif defined(_MSC_VER)
+        _mm_prefetch( static_cast<const char*>( p ), _MM_HINT_T0 );
+#endif
+    }
+    /*! \brief prefetch all cache lines that overlap [p, p+size), p needs not be aligned to cache line */
+    inline void prefetch( const void *p, size_t size ){
+        const char *ptr = static_cast<const char*>( p );
+        const char *end = ptr + size;
+        ptr -= reinterpret_cast<size_t>( ptr ) & 63;
+        for( ; ptr < end; ptr += 64 ){
+            prefetch( ptr );
+        }
+    }
     
     inline FILE *fopen_check( const char *fname , const char *flag ){
 		FILE *fp = fopen64( fname , flag );
@@ -121,6 +142,13 @@ namespace apex_utils{
     };
 };
 
+#include "apex_mmap.h"
+#ifdef _MSC_VER
+typedef long long int64_t;
+#else
+#include <inttypes.h>
+#endif
+
 namespace apex_utils{
     // simple feature array structure, can store feature text into main memory    
     namespace __sparse_feature_array{
@@ -134,9 +162,22 @@ namespace apex_utils{
         inline void load<unsigned>( FILE *fi, unsigned &index, unsigned &value ){
             apex_utils::assert_true( fscanf( fi,"%u:%u", &index, &value ) ==2 , "load sparse feature" );
         }
+        /*! \brief magic number of binary image of feature array */
+        const int kBinaryMagic = 0x41465342;
+        /*! \brief header of binary image, followed by row_ptr[num_row+1] and packed entries */
+        struct BinaryHeader{
+            int magic;
+            int version;
+            int entry_size;
+            int reserved;
+            int64_t num_row;
+            int64_t num_entry;
+        };
     };
 
     // storage of sparse feature
+    // it is loaded either from text, or by mapping a binary image written by save_binary, 
+    // mapped pages are shared by all processes that use the same image
     template<typename FValue = float>
     class SparseFeatureArray{      
     public:
@@ -156,26 +197,44 @@ namespace apex_utils{
         };
     private:
         unsigned num_row;
-        std::vector<unsigned>  row_ptr;
+        std::vector<int64_t>  row_ptr;
         std::vector<Entry> data;
+        // pointers to the data in use, either in the vectors or in the mapped image
+        const int64_t *ptr_row;
+        const Entry   *ptr_data;
+        MappedFile     image;
     public :
         SparseFeatureArray(){ clear(); }
         inline const Vector operator[]( unsigned idx )const{            
             Vector vec;
             if( idx < num_row ){
-                vec.num_elem = row_ptr[ idx + 1 ] - row_ptr[ idx ];
-                vec.ptr_elem = &data[ row_ptr[idx] ];
+                vec.num_elem = static_cast<int>( ptr_row[ idx + 1 ] - ptr_row[ idx ] );
+                vec.ptr_elem = ptr_data + ptr_row[ idx ];
             }else{
                 vec.num_elem = 0;
             }
             return vec;
         }
+        // prefetch the row index of idx, so a later operator[] of it doesn't stall
+        inline void prefetch( unsigned idx ) const{
+            if( idx < num_row ) apex_utils::prefetch( ptr_row + idx );
+        }
         inline void clear(){
             data.clear();
             row_ptr.clear();
+            image.close();
             num_row = 0;
+            ptr_row = NULL; ptr_data = NULL;
         }
+        /*! \brief number of rows */
+        inline unsigned size( void ) const{
+            return num_row;
+        }
+        // load from file, binary image is mapped, otherwise the file is parsed as text
         inline void load( const char *fname ){            
+            if( is_binary( fname ) ){
+                this->load_binary( fname ); return;
+            }
             this->clear();
             row_ptr.push_back( 0 );
 
@@ -192,6 +251,61 @@ namespace apex_utils{
                 }
             } 
             fclose( fi );
+            ptr_row = &row_ptr[0];
+            if( data.size() != 0 ) ptr_data = &data[0];
+        }
+        // map the binary image written by save_binary
+        inline void load_binary( const char *fname ){
+            using namespace __sparse_feature_array;
+            this->clear();
+            image.open( fname );
+            BinaryHeader h;
+            apex_utils::assert_true( image.size() >= sizeof(h), "invalid binary feature file" );
+            memcpy( &h, image.data(), sizeof(h) );
+            apex_utils::assert_true( h.magic == kBinaryMagic, "invalid binary feature file" );
+            apex_utils::assert_true( h.version == 1 && h.entry_size == static_cast<int>( sizeof(Entry) ), 
+                                     "binary feature file is written by another version or another value type" );
+            // sizes are bounded by the image first, so the size check below can't overflow
+            apex_utils::assert_true( h.num_row >= 0 && h.num_row < static_cast<int64_t>( UINT_MAX ) && 
+                                     h.num_row <= static_cast<int64_t>( image.size() / sizeof(int64_t) ) &&
+                                     h.num_entry >= 0 && h.num_entry <= static_cast<int64_t>( image.size() / sizeof(Entry) ) &&
+                                     image.size() == sizeof(h) + sizeof(int64_t) * ( h.num_row + 1 ) + sizeof(Entry) * h.num_entry,
+                                     "binary feature file is truncated" );
+            num_row  = static_cast<unsigned>( h.num_row );
+            ptr_row  = reinterpret_cast<const int64_t*>( image.data() + sizeof(h) );
+            ptr_data = reinterpret_cast<const Entry*>( ptr_row + num_row + 1 );
+            // every row must lie in the entries, so operator[] never reads out of the image
+            apex_utils::assert_true( ptr_row[0] == 0 && ptr_row[ num_row ] == h.num_entry, "binary feature file is corrupted" );
+            for( unsigned i = 0; i < num_row; i ++ ){
+                apex_utils::assert_true( ptr_row[i] <= ptr_row[i+1] && ptr_row[i+1] - ptr_row[i] <= INT_MAX, "binary feature file is corrupted" );
+            }
+        }
+        // save the binary image, that can be mapped by load
+        inline void save_binary( const char *fname ) const{
+            using namespace __sparse_feature_array;
+            BinaryHeader h;
+            h.magic = kBinaryMagic; h.version = 1; 
+            h.entry_size = static_cast<int>( sizeof(Entry) ); h.reserved = 0;
+            h.num_row = num_row; 
+            h.num_entry = num_row == 0 ? 0 : ptr_row[ num_row ];
+            FILE *fo = apex_utils::fopen_check( fname, "wb" );
+            fwrite( &h, sizeof(h), 1, fo );
+            const int64_t zero = 0;
+            if( num_row == 0 ){
+                fwrite( &zero, sizeof(int64_t), 1, fo );
+            }else{
+                fwrite( ptr_row, sizeof(int64_t), num_row + 1, fo );
+            }
+            if( h.num_entry != 0 ) fwrite( ptr_data, sizeof(Entry), static_cast<size_t>( h.num_entry ), fo );
+            fclose( fo );
+        }
+        // whether the file is a binary image
+        inline static bool is_binary( const char *fname ){
+            FILE *fi = apex_utils::fopen_check( fname, "rb" );
+            int magic = 0;
+            const bool ret = fread( &magic, sizeof(int), 1, fi ) == 1 && magic == __sparse_feature_array::kBinaryMagic;
+            fclose( fi );
+            return ret;
         }
     };
 };
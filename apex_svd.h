@@ -75,7 +75,12 @@ namespace apex_svd{
          *   this function is called after every round, reserved for solver to do post processing
          */
         virtual void finish_round( void ){}
-        /*! 
+        /*!
+         * \brief tell the trainer that a prediction pass over the evaluation data is finished
+         *   this function is called after every evaluation pass, reserved for solver that caches predictions of evaluation data
+         */
+        virtual void finish_eval( void ){}
+        /*!
          * \brief update model using feature vector, random order input
          * \param feature input feature
          * \sa SVDFeatureCSR
@@ -87,6 +92,12 @@ namespace apex_svd{
          * \sa SVDFeatureCSR
          */
         virtual float predict( const SVDFeatureCSR::Elem &feature ){ apex_utils::error("not implemented 1"); return 0.0f; }
+        /*! 
+         * \brief hint that the feature will be updated soon, so the trainer can prefetch the model rows it touches,
+         *        the hint has no effect on the result
+         * \param feature input feature
+         */
+        virtual void prefetch( const SVDFeatureCSR::Elem &feature ){}
     public:
         // SVD++ user-wise style update, for user grouped input
         /*! 
@@ -23,9 +23,14 @@
 #include <cstring>
 #include <cstdlib>
 #include <climits>
+#include <string>
 #include <algorithm>
+#ifndef _MSC_VER
+#include <glob.h>
+#endif
 #include "apex_svd_data.h"
 #include "apex-utils/apex_utils.h"
+#include "apex-utils/apex_frame_file.h"
 
 namespace apex_svd{
     // basic loader for three column format
@@ -36,6 +41,7 @@ namespace apex_svd{
         char name_data[ 256 ];
         unsigned index[ 2 ];
         float    value[ 2 ];
+        FeatureHasher hasher;
     public:
         SVDBasicLoader(){
             fi = NULL;
@@ -49,12 +55,21 @@ namespace apex_svd{
         virtual void set_param( const char *name, const char *val ){
             if( !strcmp( name, "scale_score" ) ) scale_score = (float)atof( val );
             if( !strcmp( name, "data_in" ) )     strcpy( name_data, val );
+            hasher.set_param( name, val );
         }
         virtual void init( void ){
             fi = apex_utils::fopen_check( name_data, "r" );
         }
         virtual bool next( SVDFeatureCSR::Elem &e ){
-            if( fscanf( fi,"%d%d%f%*[^\n]\n", &index[0], &index[1], &e.label ) != 3 ) return false;
+            if( hasher.enabled() ){
+                unsigned long long raw[ 2 ];
+                if( fscanf( fi,"%llu%llu%f%*[^\n]\n", &raw[0], &raw[1], &e.label ) != 3 ) return false;
+                value[ 0 ] = value[ 1 ] = 1.0f;
+                index[ 0 ] = hasher.map( 1, raw[0], value[0] );
+                index[ 1 ] = hasher.map( 2, raw[1], value[1] );
+            }else{
+                if( fscanf( fi,"%d%d%f%*[^\n]\n", &index[0], &index[1], &e.label ) != 3 ) return false;
+            }
             e.label /= scale_score;
             e.num_global = 0; e.num_ufactor = 1; e.num_ifactor = 1;
             e.set_space( &index[0], &value[0] );
@@ -74,6 +89,7 @@ namespace apex_svd{
         char name_data[ 256 ];
         std::vector<unsigned> index;
         std::vector<float>    value;
+        FeatureHasher hasher;
     public:
         SVDFeatureCSRLoader(){
             fi = NULL;
@@ -86,12 +102,14 @@ namespace apex_svd{
         virtual void set_param( const char *name, const char *val ){
             if( !strcmp( name, "scale_score" ) ) scale_score = (float)atof( val );
             if( !strcmp( name, "data_in" ) )     strcpy( name_data, val );
+            hasher.set_param( name, val );
         }
         virtual void init( void ){
             fi = apex_utils::fopen_check( name_data, "r" );
         }
         virtual bool next( SVDFeatureCSR::Elem &e ){
             if( fscanf( fi,"%f%d%d%d", &e.label, &e.num_global, &e.num_ufactor, &e.num_ifactor ) != 4 ) return false;
+            if( hasher.enabled() ) return this->next_hashed( e );
             e.label /= scale_score;
             int n = e.total_num();
             index.resize( static_cast<size_t>(n) );
@@ -106,6 +124,26 @@ namespace apex_svd{
             }   
             return true;
         }
+    private:
+        // load features of a line whose counts are read, raw ids are hashed into tables
+        inline bool next_hashed( SVDFeatureCSR::Elem &e ){
+            e.label /= scale_score;
+            const int n = e.total_num();
+            index.resize( static_cast<size_t>(n) + 1 );
+            value.resize( static_cast<size_t>(n) + 1 );
+            e.set_space( &index[0], &value[0] );
+            for( int i = 0; i < n; i ++ ){
+                unsigned long long raw;
+                if( fscanf( fi, "%llu:%f", &raw, &e.value_global[i] ) != 2 ){
+                    fprintf( stderr, "error loading line=%d\n", i );
+                    apex_utils::error("error"); 
+                }
+                const int k = i < e.num_global ? 0 : ( i < e.num_global + e.num_ufactor ? 1 : 2 );
+                e.index_global[i] = hasher.map( k, raw, e.value_global[i] );
+            }
+            return true;
+        }
+    public:
         virtual void before_first( void ){
             fseek( fi, 0, SEEK_SET );
         }
@@ -128,12 +166,20 @@ namespace apex_svd{
     public:
         SVDFeatureCSRLoader loader;
     public:
-        static inline void create_buffer( const char *name_buf, IDataIterator<SVDFeatureCSR::Elem> *loader, int batch_size ){
+        static inline void append( std::vector<char> &blob, const void *ptr, size_t size ){
+            blob.insert( blob.end(), static_cast<const char*>( ptr ), static_cast<const char*>( ptr ) + size );
+        }
+        static inline void create_buffer( const char *name_buf, IDataIterator<SVDFeatureCSR::Elem> *loader, int batch_size, int compress = 0 ){
             Param param;
             std::vector<SVDFeatureCSR::Elem> data;
+            std::vector<char> blob;
+            // rows of a batch are copied into arena, released at once after the batch is written
+            apex_utils::MemoryArena arena;
 
             FILE *fo = apex_utils::fopen_check( name_buf, "wb" );
-            fwrite( &param, sizeof(Param) , 1, fo );
+            // each batch is a frame, with row count and checksum in the index
+            apex_utils::FrameWriter writer( fo, compress );
+            writer.write_header( &param, sizeof(Param) );
             param.batch_size    = batch_size;   
             param.max_batch_num = 0;
             param.num_batch     = 0;
@@ -144,51 +190,53 @@ namespace apex_svd{
                 int num_val = 0;
                 int num_row = 0;
                 for( int i = 0; i < param.batch_size && loader->next(e); i ++ ){
-                    data.push_back( e.clone() );                    
+                    data.push_back( e.clone( arena ) );
                     num_val += e.total_num();
                     num_row ++ ;
                 } 
                 if( num_row == 0 ) break;
 
-                fwrite( &num_row, sizeof(int), 1, fo );
-                fwrite( &num_val, sizeof(int), 1, fo );                
+                blob.clear();
+                append( blob, &num_row, sizeof(int) );
+                append( blob, &num_val, sizeof(int) );
                 if( num_val > param.max_batch_num ) param.max_batch_num = num_val;
 
                 // row_ptr
                 int row_ptr = 0;
-                fwrite( &row_ptr, sizeof(int), 1, fo );
+                append( blob, &row_ptr, sizeof(int) );
                 for( int j = 0; j < num_row; j ++ ){
                     row_ptr += data[j].num_global;
-                    fwrite( &row_ptr, sizeof(int), 1, fo );  
+                    append( blob, &row_ptr, sizeof(int) );
                     row_ptr += data[j].num_ufactor;
-                    fwrite( &row_ptr, sizeof(int), 1, fo );  
+                    append( blob, &row_ptr, sizeof(int) );
                     row_ptr += data[j].num_ifactor;
-                    fwrite( &row_ptr, sizeof(int), 1, fo );  
+                    append( blob, &row_ptr, sizeof(int) );
                 }
                 // row label
                 for( int j = 0; j < num_row; j ++ ){
-                    fwrite( &data[j].label, sizeof(float), 1, fo );  
+                    append( blob, &data[j].label, sizeof(float) );
                 }
                 // feat index
                 for( int j = 0; j < num_row; j ++ ){
-                    fwrite( data[j].index_global , sizeof(int), data[j].num_global , fo );  
-                    fwrite( data[j].index_ufactor, sizeof(int), data[j].num_ufactor, fo );  
-                    fwrite( data[j].index_ifactor, sizeof(int), data[j].num_ifactor, fo );  
+                    append( blob, data[j].index_global , sizeof(int) * data[j].num_global );
+                    append( blob, data[j].index_ufactor, sizeof(int) * data[j].num_ufactor );
+                    append( blob, data[j].index_ifactor, sizeof(int) * data[j].num_ifactor );
                 }
                 // feat value
                 for( int j = 0; j < num_row; j ++ ){
-                    fwrite( data[j].value_global , sizeof(int), data[j].num_global , fo );  
-                    fwrite( data[j].value_ufactor, sizeof(int), data[j].num_ufactor, fo );  
-                    fwrite( data[j].value_ifactor, sizeof(int), data[j].num_ifactor, fo );  
+                    append( blob, data[j].value_global , sizeof(int) * data[j].num_global );
+                    append( blob, data[j].value_ufactor, sizeof(int) * data[j].num_ufactor );
+                    append( blob, data[j].value_ifactor, sizeof(int) * data[j].num_ifactor );
                 }
+                writer.write_frame( &blob[0], blob.size(), num_row );
                 param.num_batch ++;
                                 
-                for( size_t i = 0; i < data.size(); i ++ )
-                    data[i].free_space();
                 data.clear();
+                arena.reset();
             }
-                        
-            fseek( fo, 0, SEEK_SET );
+            
+            writer.close();
+            fseek( fo, apex_utils::FrameWriter::kHeaderOffset, SEEK_SET );
             fwrite( &param, sizeof(Param) , 1, fo );
             
             fclose( fo );            
@@ -198,18 +246,28 @@ namespace apex_svd{
             if( silent == 0 ) printf("start creating new buffer \'%s\' ...\n", name_buf );
                        
             loader.init();
-            create_buffer( name_buf, &loader, param.batch_size );
+            create_buffer( name_buf, &loader, param.batch_size, compress );
             
             if( silent == 0 ) printf("Buffer created in %s\n", name_buf );
         }
     private:
         int index;
+        // whether to compress the buffer when creating it
+        int compress;
+        // read only part of the batches: [ part*n/npart, (part+1)*n/npart )
+        int part, npart, begin, end;
+        // reader of frames, false for buffers without index
+        bool is_frame;
+        apex_utils::FrameReader reader;
+        std::vector<char> blob;
     public:
         Param param;        
     public:
         SVDFeatureCSRFactory(){
             strcpy( name_buf, "svdfeature_buf" );
             silent = 0;
+            compress = 0;
+            part = 0; npart = 1;
         }
 
         inline void set_param( const char *name, const char *val ){
@@ -217,11 +275,19 @@ namespace apex_svd{
             if( !strcmp( name, "data_in" ) )          strcpy( name_train, val );
             if( !strcmp( name, "feature_batch" ) )    param.batch_size = atoi( val );
             if( !strcmp( name, "silent" ) )           silent = atoi( val );
+            if( !strcmp( name, "buffer_compress" ) )  compress = atoi( val );
+            if( !strcmp( name, "buffer_part" ) )      part = atoi( val );
+            if( !strcmp( name, "buffer_npart" ) )     npart = atoi( val );
             loader.set_param( name, val );
         }
         
         inline int get_data_size() const{
-            return param.num_batch;
+            return end - begin;
+        }
+        // number of rows, exact if the buffer has index
+        inline size_t num_row() const{
+            if( is_frame ) return reader.num_row( begin, end );
+            return static_cast<size_t>( end - begin ) * param.batch_size;
         }
 
         inline bool init( int st ){ 
@@ -231,15 +297,30 @@ namespace apex_svd{
                 this->create_buffer();
                 fi = apex_utils::fopen_check( name_buf, "rb" );
             }
+            is_frame = apex_utils::is_frame_file( fi );
+            if( is_frame ){
+                reader.open( fi );
+            }
             apex_utils::assert_true( fread( &param, sizeof(Param), 1, fi ) > 0,"Buffer Factory");
-            if( silent == 0 ) printf("SVDFeatureCSRFactory: num_batch=%d\n", param.num_batch );
-            this->index = 0;
+            apex_utils::assert_true( npart > 0 && part >= 0 && part < npart, "invalid buffer_part" );
+            apex_utils::assert_true( npart == 1 || is_frame, "reading part of buffer requires buffer with index, recreate the buffer" );
+            apex_utils::assert_true( !is_frame || reader.num_frame() == static_cast<size_t>( param.num_batch ), "buffer index does not match header" );
+            begin = static_cast<int>( static_cast<long long>( param.num_batch ) * part / npart );
+            end   = static_cast<int>( static_cast<long long>( param.num_batch ) * ( part + 1 ) / npart );
+            if( silent == 0 ) printf("SVDFeatureCSRFactory: num_batch=%d\n", end - begin );
+            this->index = begin;
             return true;
         }
         
         inline bool load_next( SVDFeatureCSR &val ){        
-            if( index < param.num_batch ) {
-                val.load_from_file( fi ); 
+            if( index < end ) {
+                if( is_frame ){
+                    // decompression is done in the loading thread
+                    reader.read_frame( index, blob );
+                    val.load_from_memory( &blob[0], blob.size() );
+                }else{
+                    val.load_from_file( fi ); 
+                }
                 ++ index;
                 return true;
             }else{
@@ -264,8 +345,8 @@ namespace apex_svd{
         }    
         
         inline void before_first(){
-            this->index = 0; 
-            fseek( fi, sizeof(Param), SEEK_SET );
+            this->index = begin; 
+            if( !is_frame ) fseek( fi, sizeof(Param), SEEK_SET );
         }        
     };
 };
@@ -294,7 +375,7 @@ namespace apex_svd{
             itr.init();
         }
         virtual size_t get_data_size( void ){
-            return static_cast<size_t>( itr.get_factory().get_data_size() ) * itr.factory.param.batch_size;
+            return itr.get_factory().num_row();
         }
         virtual void before_first( void ){
             idx = -1; itr.before_first();
@@ -358,6 +439,8 @@ namespace apex_svd{
         // do buffer creation with only fi, a bit duplicate code for correctness
         float olabel;
         std::vector<Elem> og, ou, oi;
+        // features of current line, kept as members so their space is reused across lines
+        std::vector<Elem> vg, vu, vi;
         inline bool next_onlyfi( SVDPlusBlock &e ){
             if( ou.size() == 0 ){
                 int ng, nu, ni;
@@ -411,17 +494,16 @@ namespace apex_svd{
             int ng, nu, ni;
             while( fscanf( fi, "%f%d%d%d", 
                            &olabel, &ng, &nu, &ni ) == 4 ){
-                std::vector<Elem> vg, vu, vi;
                 this->load( vg, ng ); 
                 this->load( vu, nu ); 
                 this->load( vi, ni ); 
                 apex_utils::assert_true( vu.size() != 0, "need at least one user feature in feature file" );
                 if( vu[0].index != uid ){
-                    og = vg; ou = vu; oi = vi; break;
+                    og.swap( vg ); ou.swap( vu ); oi.swap( vi ); break;
                 } 
                 if( row_label.size() >= static_cast<size_t>( block_max_line ) ){
                     this->nline_remain = 1;
-                    og = vg; ou = vu; oi = vi; break;
+                    og.swap( vg ); ou.swap( vu ); oi.swap( vi ); break;
                 }
                 row_label.push_back( olabel / scale_score );
                 row_ptr.push_back( row_ptr.back() + ng );
@@ -517,7 +599,6 @@ namespace apex_svd{
                 row_ptr[ i*3 + 1 ] = (num_elem += ng);                
                 row_ptr[ i*3 + 2 ] = (num_elem += nu);
                 row_ptr[ i*3 + 3 ] = (num_elem += ni);
-                std::vector<Elem> vg, vu, vi;
                 this->load( vg, ng ); this->add( vg );
                 this->load( vu, nu ); this->add( vu );
                 this->load( vi, ni ); this->add( vi );
@@ -699,6 +780,46 @@ namespace apex_svd{
             return itr.next( elem );
         }
     };    
+
+    // buffer slot, the copy of data in the slot is held by the arena of the slot
+    template<typename DType>
+    struct ArenaSlot{
+        DType data;
+        apex_utils::MemoryArena arena;
+    };
+
+    // apdater for iterator that buffers ArenaSlot
+    template<typename FactoryType, typename DType>
+    class ArenaSlotIteratorAdapter: public IDataIterator<DType>{
+    public :
+        apex_utils::ThreadBufferIterator<ArenaSlot<DType>,FactoryType> itr;
+        ArenaSlotIteratorAdapter(){
+            itr.set_param( "buffer_size", "100" );
+        }
+        virtual ~ArenaSlotIteratorAdapter(){
+            itr.destroy();
+        }
+        virtual void set_param( const char *name, const char *val ){
+            itr.set_param( name, val );
+        }
+        virtual void init( void ){
+            itr.init();
+        }
+        virtual size_t get_data_size( void ){
+            return static_cast<size_t>( itr.get_factory().get_data_size() );
+        }
+        virtual void before_first( void ){
+            itr.before_first();
+        }
+        virtual bool next( DType &elem ){
+            if( !itr.next( slot ) ) return false;
+            elem = slot.data;
+            return true;
+        }
+    private:
+        // holds the slot taken from buffer, its arena is always empty
+        ArenaSlot<DType> slot;
+    };
 };
 
 namespace apex_svd{
@@ -721,25 +842,26 @@ namespace apex_svd{
             return true;
         }
         
-        inline bool load_next( SVDFeatureCSR::Elem &val ){        
+        inline bool load_next( ArenaSlot<SVDFeatureCSR::Elem> &val ){        
             SVDFeatureCSR::Elem e;
             if( itr_data->next(e) ){
-                if( val.index_global != NULL ) val.free_space();
-                val = e.clone();
+                // the slot is recycled, release its old data at once
+                val.arena.reset();
+                val.data = e.clone( val.arena );
                 return true;
             }else{
                 return false;
             }            
         }            
 
-        inline SVDFeatureCSR::Elem create(){
-            SVDFeatureCSR::Elem e;
-            e.index_global = NULL;
+        inline ArenaSlot<SVDFeatureCSR::Elem> create(){
+            ArenaSlot<SVDFeatureCSR::Elem> e;
+            e.data.index_global = NULL;
             return e;
         }
 
-        inline void free_space( SVDFeatureCSR::Elem &val ){        
-            if( val.index_global != NULL ) val.free_space();
+        inline void free_space( ArenaSlot<SVDFeatureCSR::Elem> &val ){        
+            val.arena.release();
         }                
 
         inline void destroy(){
@@ -770,25 +892,26 @@ namespace apex_svd{
             return true;
         }
         
-        inline bool load_next( SVDPlusBlock &val ){        
+        inline bool load_next( ArenaSlot<SVDPlusBlock> &val ){        
             SVDPlusBlock e;
             if( itr_data->next(e) ){
-                if( val.index_ufeedback != NULL ) val.free_space();
-                val = e.clone();
+                // the slot is recycled, release its old data at once
+                val.arena.reset();
+                val.data = e.clone( val.arena );
                 return true;
             }else{
                 return false;
             }            
         }            
 
-        inline SVDPlusBlock create(){
-            SVDPlusBlock e;
-            e.index_ufeedback = NULL;
+        inline ArenaSlot<SVDPlusBlock> create(){
+            ArenaSlot<SVDPlusBlock> e;
+            e.data.index_ufeedback = NULL;
             return e;
         }
 
-        inline void free_space( SVDPlusBlock &val ){        
-            if( val.index_ufeedback != NULL ) val.free_space();
+        inline void free_space( ArenaSlot<SVDPlusBlock> &val ){        
+            val.arena.release();
         }                
 
         inline void destroy(){
@@ -805,6 +928,7 @@ namespace apex_svd{
 #include <ctime>
 #include <algorithm>
 #include "apex-tensor/apex_random.h"
+#include "apex-utils/apex_thread.h"
 
 namespace apex_svd{
     // pairwise sample generator
@@ -818,16 +942,105 @@ namespace apex_svd{
         float rank_sample_gap;        
         int   seed_sampler_bytime;
         float pos_sample_lowerb, neg_sample_upperb;
+        // number of negative samples drawn for each positive sample, when sampling from alias table
+        int   rank_neg_num;
+        // negative items are drawn with weight popularity^rank_neg_pow
+        float rank_neg_pow;
+        // number of worker threads used to generate pairs, 0 means generate in caller thread
+        int   rank_sample_nthread;
+        // number of blocks each worker thread handles in one batch
+        int   rank_sample_batch;
+        // seed of the sampler streams
+        uint32_t rank_sample_seed;
         IDataIterator<SVDPlusBlock> *itr_data;
     private:
-        std::vector<float>    row_label;
-        std::vector<int>      row_ptr;
-        std::vector<unsigned> findex;
-        std::vector<float>    fvalue;
-        std::vector<SVDFeatureCSR::Elem> pos, neg;
-        inline unsigned merge( unsigned *index1, unsigned *index2,
+        // alias table, sample an item in O(1) with given weight
+        struct AliasTable{
+            std::vector<float>    prob;
+            std::vector<unsigned> alias;
+            std::vector<unsigned> item;
+            inline bool empty( void ) const{
+                return item.size() == 0;
+            }
+            inline void init( const std::vector<double> &weight ){
+                item.clear(); prob.clear(); alias.clear();
+                std::vector<double> w;
+                double sum = 0.0;
+                for( size_t i = 0; i < weight.size(); i ++ ){
+                    if( weight[i] <= 0.0 ) continue;
+                    item.push_back( static_cast<unsigned>( i ) );
+                    w.push_back( weight[i] ); sum += weight[i];
+                }
+                const size_t n = item.size();
+                prob.resize( n, 1.0f ); alias.resize( n, 0 );
+                std::vector<unsigned> small, large;
+                for( size_t i = 0; i < n; i ++ ){
+                    w[i] = w[i] * n / sum;
+                    if( w[i] < 1.0 ) small.push_back( static_cast<unsigned>( i ) );
+                    else large.push_back( static_cast<unsigned>( i ) );
+                }
+                while( small.size() != 0 && large.size() != 0 ){
+                    unsigned s = small.back(); small.pop_back();
+                    unsigned l = large.back(); large.pop_back();
+                    prob[ s ] = static_cast<float>( w[s] ); alias[ s ] = l;
+                    w[ l ] = ( w[l] + w[s] ) - 1.0;
+                    if( w[l] < 1.0 ) small.push_back( l );
+                    else large.push_back( l );
+                }
+                // remaining ones are numerically 1
+                for( size_t i = 0; i < small.size(); i ++ ) prob[ small[i] ] = 1.0f;
+                for( size_t i = 0; i < large.size(); i ++ ) prob[ large[i] ] = 1.0f;
+            }
+            inline unsigned sample( apex_random::RandomStream &rnd ) const{
+                unsigned k = rnd.next_uint32( static_cast<uint32_t>( item.size() ) );
+                if( rnd.next_double() < prob[k] ) return item[ k ];
+                return item[ alias[k] ];
+            }
+        };
+        // generated pairs of one block, each worker thread holds its own buffer
+        struct PairBuffer{
+            std::vector<float>    row_label;
+            std::vector<int>      row_ptr;
+            std::vector<unsigned> findex;
+            std::vector<float>    fvalue;
+            std::vector<SVDFeatureCSR::Elem> pos, neg;
+            // items of positive samples in current block
+            std::vector<unsigned> pitem;
+            apex_random::RandomStream rnd;
+            // input block and output block, used in threaded mode
+            SVDPlusBlock src, dst;
+            bool has_src;
+            // holds space of src, reset when the buffer is refilled
+            apex_utils::MemoryArena arena;
+            PairBuffer( void ){ has_src = false; }
+            inline void clear( void ){
+                row_label.resize( 0 ); 
+                row_ptr.resize( 0 ); row_ptr.push_back( 0 );
+                findex.resize( 0 ) ; fvalue.resize( 0 ); 
+            }
+            inline void free_src( void ){
+                arena.reset();
+                has_src = false;
+            }
+            // set data of block to generated pairs
+            inline void set_data( SVDPlusBlock &e ){
+                e.data.num_row   = static_cast<int>( row_label.size() );
+                e.data.num_val   = static_cast<int>( findex.size() ); 
+                e.data.row_ptr   = &row_ptr[0];
+                if( e.data.num_row != 0 ){
+                    e.data.row_label = &row_label[0];
+                    e.data.feat_index= &findex[0];
+                    e.data.feat_value= &fvalue[0];
+                }
+            }
+        };
+    private:
+        inline unsigned merge( PairBuffer &b,
+                               unsigned *index1, unsigned *index2,
                                float    *value1, float    *value2,
                                unsigned num1   , unsigned num2 ){
+            std::vector<unsigned> &findex = b.findex;
+            std::vector<float>    &fvalue = b.fvalue;
             unsigned num = 0, i = 0, j = 0;
             while( i < num1 && j < num2 ){
                 if( index1[i] < index2[j] ){
@@ -859,71 +1072,72 @@ namespace apex_svd{
             return num;
         }
 
-        inline void genpair_pointwise( SVDFeatureCSR::Elem p, float label ){
+        inline void genpair_pointwise( PairBuffer &b, SVDFeatureCSR::Elem p, float label ){
             for( int i = 0; i < p.num_global; i ++ ){
-                findex.push_back( p.index_global[i] );
-                fvalue.push_back( p.value_global[i] );
+                b.findex.push_back( p.index_global[i] );
+                b.fvalue.push_back( p.value_global[i] );
             }
-            row_ptr.push_back( row_ptr.back() + p.num_global );
+            b.row_ptr.push_back( b.row_ptr.back() + p.num_global );
             int nufactor = 0;
             for( int i = 0; i < p.num_ufactor; i ++ ){
                 if( p.value_ufactor[i] > 1e-6f || p.value_ufactor[i] < -1e-6f ){
-                    findex.push_back( p.index_ufactor[i] );
-                    fvalue.push_back( p.value_ufactor[i] );
+                    b.findex.push_back( p.index_ufactor[i] );
+                    b.fvalue.push_back( p.value_ufactor[i] );
                     nufactor ++;
                 }
                 
             }
-            row_ptr.push_back( row_ptr.back() + nufactor );
+            b.row_ptr.push_back( b.row_ptr.back() + nufactor );
             for( int i = 0; i < p.num_ifactor; i ++ ){
-                findex.push_back( p.index_ifactor[i] );
-                fvalue.push_back( p.value_ifactor[i] );
+                b.findex.push_back( p.index_ifactor[i] );
+                b.fvalue.push_back( p.value_ifactor[i] );
             }
-            row_ptr.push_back( row_ptr.back() + p.num_ifactor );
-            row_label.push_back( label ); 
+            b.row_ptr.push_back( b.row_ptr.back() + p.num_ifactor );
+            b.row_label.push_back( label ); 
         }
 
-        inline void genpair( SVDFeatureCSR::Elem p, SVDFeatureCSR::Elem n ){
+        inline void genpair( PairBuffer &b, SVDFeatureCSR::Elem p, SVDFeatureCSR::Elem n ){
             if( rank_sample_pointwise != 0 ){
-                this->genpair_pointwise( p, 1.0f );
-                this->genpair_pointwise( n, 0.0f );
+                this->genpair_pointwise( b, p, 1.0f );
+                this->genpair_pointwise( b, n, 0.0f );
                 return;
             }
-            row_ptr.push_back( row_ptr.back() + 
-                               merge( p.index_global, n.index_global,
-                                      p.value_global, n.value_global,
-                                      p.num_global  , n.num_global ) );
+            b.row_ptr.push_back( b.row_ptr.back() + 
+                                 merge( b, p.index_global, n.index_global,
+                                        p.value_global, n.value_global,
+                                        p.num_global  , n.num_global ) );
             int nufactor = 0;
             for( int i = 0; i < p.num_ufactor; i ++ ){
                 if( p.value_ufactor[i] > 1e-6f || p.value_ufactor[i] < -1e-6f ){
-                    findex.push_back( p.index_ufactor[i] );
-                    fvalue.push_back( p.value_ufactor[i] );
+                    b.findex.push_back( p.index_ufactor[i] );
+                    b.fvalue.push_back( p.value_ufactor[i] );
                     nufactor ++;
                 }
                 
             }
-            row_ptr.push_back( row_ptr.back() + nufactor );
-            row_ptr.push_back( row_ptr.back() + 
-                               merge( p.index_ifactor, n.index_ifactor,
-                                      p.value_ifactor, n.value_ifactor,
-                                      p.num_ifactor  , n.num_ifactor ) );            
+            b.row_ptr.push_back( b.row_ptr.back() + nufactor );
+            b.row_ptr.push_back( b.row_ptr.back() + 
+                                 merge( b, p.index_ifactor, n.index_ifactor,
+                                        p.value_ifactor, n.value_ifactor,
+                                        p.num_ifactor  , n.num_ifactor ) );            
             if( rank_sample_method / 10 == 0 ){
-                row_label.push_back( 1.0f );
+                b.row_label.push_back( 1.0f );
             }else{
-                row_label.push_back( p.label - n.label ); 
+                b.row_label.push_back( p.label - n.label ); 
             }
         }
     private:
         inline static bool cmp_rate( const SVDFeatureCSR::Elem &a, const SVDFeatureCSR::Elem &b ){
             return a.label < b.label;
         }
-        inline void sample_cmp( SVDPlusBlock &e ){
+        inline void sample_cmp( PairBuffer &b, const SVDPlusBlock &e ){
+            std::vector<SVDFeatureCSR::Elem> &pos = b.pos, &neg = b.neg;
             pos.resize( 0 ); neg.resize( 0 );
             for( int i = 0; i < e.data.num_row; i ++ ){
                 SVDFeatureCSR::Elem el = e.data[i];
                 pos.push_back( el ); neg.push_back( el );
             }
-            apex_random::shuffle( neg );
+            apex_random::shuffle( neg, b.rnd );
             std::sort( pos.begin(), pos.end(), cmp_rate );
             for( size_t i = 0; i < neg.size(); i ++ ){
                 SVDFeatureCSR::Elem el = neg[i];
@@ -933,17 +1147,18 @@ namespace apex_svd{
                 size_t right = std::lower_bound( pos.begin(), pos.end(), el, cmp_rate ) - pos.begin();
                 uint32_t rng = static_cast<uint32_t>( left + pos.size() - right );
                 if( rng > 0 ){
-                    size_t idx = apex_random::next_uint32( rng );
+                    size_t idx = b.rnd.next_uint32( rng );
                     if( idx < left ){
-                        genpair( neg[i], pos[ idx ] );
+                        genpair( b, neg[i], pos[ idx ] );
                     }else{
-                        genpair( pos[ right+idx-left ], neg[i] );
+                        genpair( b, pos[ right+idx-left ], neg[i] );
                     }
                 }                 
             }
         } 
         // sampling using postive vs negative sample method
-        inline void sample_posneg( SVDPlusBlock &e ){
+        inline void sample_posneg( PairBuffer &b, const SVDPlusBlock &e ){
+            std::vector<SVDFeatureCSR::Elem> &pos = b.pos, &neg = b.neg;
             // generate positive and negative samples
             pos.resize( 0 ); neg.resize( 0 );
             for( int i = 0; i < e.data.num_row; i ++ ){
@@ -952,15 +1167,172 @@ namespace apex_svd{
                 if( el.label - neg_sample_upperb <  1e-6f ) neg.push_back( el );  
             } 
             if( pos.size() > 0 && neg.size() > 0 ){
-                apex_random::shuffle( neg );
-                apex_random::shuffle( pos );
+                apex_random::shuffle( neg, b.rnd );
+                apex_random::shuffle( pos, b.rnd );
                 size_t snum = neg.size();
                 if( sample_num > 0 ) {
                     snum = (size_t) sample_num;
                 }
                 if( snum > (unsigned)sample_max ) snum = sample_max;
                 for( size_t i = 0; i < snum; i ++ )
-                    genpair( pos[ i % pos.size() ] , neg[ i % neg.size() ] );
+                    genpair( b, pos[ i % pos.size() ] , neg[ i % neg.size() ] );
+            }
+        }
+        // sampling negative items from popularity weighted alias table, 
+        // the item of a sample is given by its first item feature, only positive samples are needed in input
+        // a sampled negative has only one item feature with value 1, and no global feature
+        inline void sample_alias( PairBuffer &b, const SVDPlusBlock &e ){
+            std::vector<SVDFeatureCSR::Elem> &pos = b.pos;
+            pos.resize( 0 ); b.pitem.resize( 0 );
+            for( int i = 0; i < e.data.num_row; i ++ ){
+                SVDFeatureCSR::Elem el = e.data[i];
+                if( el.num_ifactor == 0 ) continue;
+                if( el.label - pos_sample_lowerb > -1e-6f ){
+                    pos.push_back( el ); b.pitem.push_back( el.index_ifactor[0] );
+                }
+            }
+            if( pos.size() == 0 ) return;
+            std::sort( b.pitem.begin(), b.pitem.end() );
+            apex_random::shuffle( pos, b.rnd );
+            size_t snum = pos.size() * rank_neg_num;
+            if( sample_num > 0 ) snum = (size_t) sample_num;
+            if( snum > (unsigned)sample_max ) snum = sample_max;
+            for( size_t i = 0; i < snum; i ++ ){
+                unsigned item = 0; bool ok = false;
+                // reject items that are positive for current user
+                for( int k = 0; k < 10 && !ok; k ++ ){
+                    item = neg_table.sample( b.rnd );
+                    ok = !std::binary_search( b.pitem.begin(), b.pitem.end(), item );
+                }
+                if( !ok ) continue;
+                float one = 1.0f;
+                SVDFeatureCSR::Elem n = pos[ i % pos.size() ];
+                n.label = 0.0f;
+                n.num_global = 0;
+                n.num_ifactor = 1;
+                n.index_ifactor = &item; n.value_ifactor = &one;
+                genpair( b, pos[ i % pos.size() ], n );
+            }
+        }
+        // generate pairs of one block, the random stream is decided by the pass and index of the block
+        inline void gen_block( PairBuffer &b, const SVDPlusBlock &e, size_t bidx ){
+            b.clear();
+            b.rnd.seed( ( static_cast<uint64_t>( rank_sample_seed ) << 32 ) | npass, bidx );
+            switch( this->rank_sample_method ){
+            case 0: this->sample_posneg( b, e ); break;
+            case 1: this->sample_cmp( b, e );    break;
+            case 2: this->sample_alias( b, e );  break;
+            default:apex_utils::error("unkown rank sample method\n");
+            }            
+        }
+    private:
+        // build alias table from popularity of positive items in the data
+        inline void init_neg_table( void ){
+            std::vector<double> cnt;
+            SVDPlusBlock e;
+            itr_data->before_first();
+            while( itr_data->next( e ) ){
+                for( int i = 0; i < e.data.num_row; i ++ ){
+                    SVDFeatureCSR::Elem el = e.data[i];
+                    if( el.num_ifactor == 0 || el.label - pos_sample_lowerb <= -1e-6f ) continue;
+                    unsigned item = el.index_ifactor[0];
+                    if( item >= cnt.size() ) cnt.resize( item + 1, 0.0 );
+                    cnt[ item ] += 1.0;
+                }
+            }
+            itr_data->before_first();
+            for( size_t i = 0; i < cnt.size(); i ++ ){
+                if( cnt[i] > 0.0 ) cnt[i] = pow( cnt[i], (double)rank_neg_pow );
+            }
+            neg_table.init( cnt );
+            apex_utils::assert_true( !neg_table.empty(), "PairwiseRankGenerator: no positive item to build negative sampler" );
+        }
+    private:
+        AliasTable neg_table;
+        // index of current pass and current block in the pass
+        uint32_t npass;
+        size_t   bidx;
+        // buffer used in caller thread
+        PairBuffer buf;
+    private:
+        // threaded generation: two batches, workers fill one batch while the other is consumed
+        bool destroy_signal;
+        int  batch_cur, batch_pending, batch_top, batch_end;
+        std::vector<PairBuffer> batch[2];
+        size_t batch_bidx[2];
+        int    batch_size[2];
+        std::vector<apex_thread::Thread>    workers;
+        std::vector<apex_thread::Semaphore> job_start;
+        apex_thread::Semaphore job_end;
+        struct WorkerEntry{
+            PairwiseRankGenerator *self;
+            int tid;
+        };
+        std::vector<WorkerEntry> worker_entry;
+        inline void run_worker( int tid ){
+            while( true ){
+                job_start[ tid ].wait();
+                if( destroy_signal ) break;
+                std::vector<PairBuffer> &bt = batch[ batch_pending ];
+                for( int i = tid; i < batch_size[ batch_pending ]; i += rank_sample_nthread ){
+                    PairBuffer &b = bt[ i ];
+                    this->gen_block( b, b.src, batch_bidx[ batch_pending ] + i );
+                    b.dst = b.src;
+                    b.set_data( b.dst );
+                }
+                job_end.post();
+            }
+        }
+        inline static APEX_THREAD_PREFIX worker_entry_func( void *p ){
+            WorkerEntry *w = static_cast<WorkerEntry*>( p );
+            w->self->run_worker( w->tid );
+            apex_thread::thread_exit( NULL );
+            return NULL;
+        }
+        // read next batch of input and start the workers on it
+        inline void launch_batch( int bid ){
+            std::vector<PairBuffer> &bt = batch[ bid ];
+            int n = 0;
+            SVDPlusBlock e;
+            for( ; n < static_cast<int>( bt.size() ); n ++ ){
+                bt[n].free_src();
+                if( !itr_data->next( e ) ) break;
+                bt[n].src = e.clone( bt[n].arena ); bt[n].has_src = true;
+            }
+            batch_size[ bid ] = n; batch_bidx[ bid ] = bidx; bidx += n;
+            batch_pending = bid;
+            for( int i = 0; i < rank_sample_nthread; i ++ ) job_start[i].post();
+        }
+        inline void wait_batch( void ){
+            if( batch_pending < 0 ) return;
+            for( int i = 0; i < rank_sample_nthread; i ++ ) job_end.wait();
+            batch_cur = batch_pending; batch_pending = -1;
+            batch_top = 0; batch_end = batch_size[ batch_cur ];
+        }
+        inline void start_workers( void ){
+            destroy_signal = false;
+            batch_pending = -1; batch_cur = 0; batch_top = batch_end = 0;
+            for( int i = 0; i < 2; i ++ ) batch[i].resize( rank_sample_nthread * rank_sample_batch );
+            job_end.init( 0 );
+            job_start.resize( rank_sample_nthread );
+            workers.resize( rank_sample_nthread );
+            worker_entry.resize( rank_sample_nthread );
+            for( int i = 0; i < rank_sample_nthread; i ++ ){
+                job_start[i].init( 0 );
+                worker_entry[i].self = this; worker_entry[i].tid = i;
+                workers[i].start( worker_entry_func, &worker_entry[i] );
+            }
+        }
+        inline void stop_workers( void ){
+            this->wait_batch();
+            destroy_signal = true;
+            for( int i = 0; i < rank_sample_nthread; i ++ ) job_start[i].post();
+            for( int i = 0; i < rank_sample_nthread; i ++ ){
+                workers[i].join(); job_start[i].destroy();
+            }
+            job_end.destroy();
+            for( int k = 0; k < 2; k ++ ){
+                for( size_t i = 0; i < batch[k].size(); i ++ ) batch[k][i].free_src();
             }
         }
     public :
@@ -974,8 +1346,15 @@ namespace apex_svd{
             this->pos_sample_lowerb = 0.8f;
             this->neg_sample_upperb = 1e-6f;
             this->rank_sample_pointwise = 0;
+            this->rank_neg_num = 1;
+            this->rank_neg_pow = 1.0f;
+            this->rank_sample_nthread = 0;
+            this->rank_sample_batch = 16;
+            this->rank_sample_seed = 0;
+            this->npass = 0; this->bidx = 0;
         }
         ~PairwiseRankGenerator( void ){
+            if( rank_sample_nthread > 0 ) this->stop_workers();
             delete itr_data;
         }
         virtual void set_param( const char *name, const char *val ){
@@ -987,36 +1366,46 @@ namespace apex_svd{
             if( !strcmp( name, "rank_sample_method" ))  rank_sample_method = atoi( val );
             if( !strcmp( name, "rank_sample_gap" )) rank_sample_gap = (float)atof( val );
             if( !strcmp( name, "rank_sample_pointwise" ))  rank_sample_pointwise = atoi( val );
+            if( !strcmp( name, "rank_neg_num" ))    rank_neg_num = atoi( val );
+            if( !strcmp( name, "rank_neg_pow" ))    rank_neg_pow = (float)atof( val );
+            if( !strcmp( name, "rank_sample_nthread" )) rank_sample_nthread = atoi( val );
+            if( !strcmp( name, "rank_sample_batch" ))   rank_sample_batch = atoi( val );
+            if( !strcmp( name, "seed" ))                rank_sample_seed = (uint32_t)atoi( val );
             itr_data->set_param( name, val );
         }
         virtual void init( void ){
             itr_data->init();
             if( this->seed_sampler_bytime != 0 ){
-                apex_random::seed( static_cast<uint32_t>(time(NULL)) );
+                rank_sample_seed = static_cast<uint32_t>(time(NULL));
             }
             apex_utils::assert_true( rank_sample_gap > 0.0f, "must set rank_sample_gap to a value bigger than 0" ); 
+            apex_utils::assert_true( rank_sample_nthread >= 0 && rank_sample_batch > 0, "invalid rank_sample_nthread or rank_sample_batch" );
+            if( rank_sample_method == 2 ) this->init_neg_table();
+            if( rank_sample_nthread > 0 ) this->start_workers();
         }
         virtual void before_first( void ){
+            if( rank_sample_nthread > 0 ){
+                this->wait_batch();
+                batch_top = batch_end = 0;
+            }
             itr_data->before_first();
+            npass ++; bidx = 0;
         }
         virtual bool next( SVDPlusBlock &e ){
-            if( !itr_data->next( e ) ) return false;            
-            row_label.resize( 0 ); 
-            row_ptr.resize( 0 ); row_ptr.push_back( 0 );
-            findex.resize( 0 ) ; fvalue.resize( 0 ); 
-            switch( this->rank_sample_method ){
-            case 0: this->sample_posneg( e ); break;
-            case 1: this->sample_cmp( e );    break;
-            default:apex_utils::error("unkown rank sample method\n");
-            }            
-            e.data.num_row   = static_cast<int>( row_label.size() );
-            e.data.num_val   = static_cast<int>( findex.size() ); 
-            e.data.row_ptr   = &row_ptr[0];
-            if( e.data.num_row != 0 ){
-                e.data.row_label = &row_label[0];
-                e.data.feat_index= &findex[0];
-                e.data.feat_value= &fvalue[0];
+            if( rank_sample_nthread == 0 ){
+                if( !itr_data->next( e ) ) return false;            
+                this->gen_block( buf, e, bidx ++ );
+                buf.set_data( e );
+                return true;
             }
+            if( batch_top == batch_end ){
+                // the first batch of a pass is not launched yet
+                if( batch_pending < 0 ) this->launch_batch( 0 );
+                this->wait_batch();
+                if( batch_end == 0 ) return false;
+                this->launch_batch( !batch_cur );
+            }
+            e = batch[ batch_cur ][ batch_top ++ ].dst;
             return true;
         }       
         virtual size_t get_data_size( void ){ 
@@ -1218,29 +1607,67 @@ namespace apex_svd{
         FILE *fi;
         int  nblock, idx;
         char name_buf[ 256 ];
+        // whether to permute the read order of pages in each pass
+        int  shuffle_page;
+        uint32_t npass;
+        std::vector<int> order;
+        // read only part of the pages: [ part*n/npart, (part+1)*n/npart )
+        int  part, npart, begin;
+        // reader of frames, when the pages are compressed
+        bool is_frame;
+        apex_utils::FrameReader reader;
+        std::vector<char> blob;
     public:
         // data provider
         SVDFeatureCSRPageFileFactory( void ){
             strcpy( name_buf, "svdfeature_buf" );
             this->fi = NULL;
+            this->shuffle_page = 0;
+            this->npass = 0;
+            this->part = 0; this->npart = 1;
+            this->is_frame = false;
         }
         inline void set_param( const char *name, const char *val ){
             if( !strcmp( name, "buffer_feature" ) ) strcpy( name_buf  , val );
+            if( !strcmp( name, "shuffle_page" ) )   shuffle_page = atoi( val );
+            if( !strcmp( name, "buffer_part" ) )    part = atoi( val );
+            if( !strcmp( name, "buffer_npart" ) )   npart = atoi( val );
         }        
         inline size_t get_data_size() const{            
+            // rows are only counted in the index of frame file
+            if( is_frame ) return reader.num_row( begin, begin + nblock );
             return 0;
         }
         inline bool init( int st ){ 
             fi = apex_utils::fopen_check( name_buf, "rb" );
-            fseek( fi, 0, SEEK_END );
-            size_t sz = ftell( fi );
-            apex_utils::assert_true( sz % (SVDFeatureCSRPage::psize*sizeof(int)) == 0, "file must have exact blocks" );
-            nblock = sz / (SVDFeatureCSRPage::psize*sizeof(int));
+            is_frame = apex_utils::is_frame_file( fi );
+            if( is_frame ){
+                // one frame for each page
+                reader.open( fi );
+                nblock = static_cast<int>( reader.num_frame() );
+            }else{
+                fseek( fi, 0, SEEK_END );
+                size_t sz = ftell( fi );
+                apex_utils::assert_true( sz % (SVDFeatureCSRPage::psize*sizeof(int)) == 0, "file must have exact blocks" );
+                nblock = sz / (SVDFeatureCSRPage::psize*sizeof(int));
+            }
+            apex_utils::assert_true( npart > 0 && part >= 0 && part < npart, "invalid buffer_part" );
+            begin  = static_cast<int>( static_cast<long long>( nblock ) * part / npart );
+            nblock = static_cast<int>( static_cast<long long>( nblock ) * ( part + 1 ) / npart ) - begin;
             this->before_first();
             return true;
         }        
         inline bool load_next( SVDFeatureCSRPage &val ){
             if( idx >= nblock ) return false;
+            if( is_frame ){
+                reader.read_frame( begin + ( shuffle_page != 0 ? order[ idx ] : idx ), blob );
+                val.load_from_memory( &blob[0], blob.size() );
+                idx ++;
+                return true;
+            }
+            if( shuffle_page != 0 ){
+                apex_utils::fseek_page( fi, SVDFeatureCSRPage::psize * sizeof(int), begin + order[ idx ] );
+            }
             val.load_from_file( fi );
             idx ++;
             return true;
@@ -1258,7 +1685,14 @@ namespace apex_svd{
         }            
         inline void before_first(){
             idx = 0;
-            fseek( fi, 0, SEEK_SET );
+            if( !is_frame ) apex_utils::fseek_page( fi, SVDFeatureCSRPage::psize * sizeof(int), begin );
+            if( shuffle_page != 0 ){
+                // page order of each pass is decided by seed and the pass number
+                apex_random::RandomStream rnd = apex_random::task_stream( 11, npass ++ );
+                order.resize( nblock );
+                for( int i = 0; i < nblock; i ++ ) order[i] = i;
+                if( nblock != 0 ) apex_random::shuffle( order, rnd );
+            }
         }
     };
 
@@ -1267,28 +1701,82 @@ namespace apex_svd{
     private:
         int idx; 
         SVDFeatureCSRPage dt;
+    private:
+        // number of pages in the sliding shuffle window, 0 means no shuffle
+        int shuffle_window;
+        uint32_t npass;
+        // slot of page to be refilled in next call, -1 means none
+        int  refill_slot;
+        bool need_fill;
+        apex_random::RandomStream rnd;
+        std::vector<SVDFeatureCSRPage> wpage;
+        // number of rows left in each page of window
+        std::vector<int> wleft;
+        // rows left in window, (slot, row)
+        std::vector< std::pair<int,int> > pool;
+        // load next nonempty page into the slot
+        inline void fill_slot( int s ){
+            wleft[ s ] = 0;
+            while( wleft[ s ] == 0 ){
+                if( !itr.next( dt ) ) return;
+                wpage[ s ].copy_from( dt );
+                wleft[ s ] = dt.num_row();
+            }
+            for( int r = 0; r < wleft[ s ]; r ++ ){
+                pool.push_back( std::make_pair( s, r ) );
+            }
+        }
+        // draw a random row from the window, a page is replaced by next page once all its rows are drawn
+        inline bool next_window( SVDFeatureCSR::Elem &elem ){
+            if( need_fill ){
+                pool.resize( 0 );
+                for( int s = 0; s < shuffle_window; s ++ ) this->fill_slot( s );
+                need_fill = false;
+            }
+            // refill is delayed until here, so the last returned row stays valid
+            if( refill_slot >= 0 ){
+                this->fill_slot( refill_slot ); refill_slot = -1;
+            }
+            if( pool.size() == 0 ) return false;
+            size_t k = rnd.next_uint32( static_cast<uint32_t>( pool.size() ) );
+            std::pair<int,int> e = pool[ k ];
+            pool[ k ] = pool.back(); pool.pop_back();
+            elem = wpage[ e.first ][ e.second ];
+            if( -- wleft[ e.first ] == 0 ) refill_slot = e.first;
+            return true;
+        }
     public :
         apex_utils::ThreadBufferIterator<SVDFeatureCSRPage,FactoryType> itr;
         SVDCSRPageThreadIterator(){
             idx = -1;
+            shuffle_window = 0; npass = 0;
             itr.set_param( "buffer_size", "2" );
         }
         virtual ~SVDCSRPageThreadIterator(){
             itr.destroy();
+            for( size_t i = 0; i < wpage.size(); i ++ ) wpage[i].free_space();
         }
         virtual void set_param( const char *name, const char *val ){
+            if( !strcmp( name, "shuffle_window" ) ) shuffle_window = atoi( val );
             itr.set_param( name, val );
         }
         virtual void init( void ){
             itr.init();
+            if( shuffle_window > 0 ){
+                wpage.resize( shuffle_window ); wleft.resize( shuffle_window );
+                for( int i = 0; i < shuffle_window; i ++ ) wpage[i].alloc_space();
+                this->reset_window();
+            }
         }
         virtual size_t get_data_size( void ){
             return static_cast<size_t>( itr.get_factory().get_data_size() );
         }
         virtual void before_first( void ){
             idx = -1; itr.before_first();
+            if( shuffle_window > 0 ) this->reset_window();
         }
         virtual bool next( SVDFeatureCSR::Elem &elem ){
+            if( shuffle_window > 0 ) return this->next_window( elem );
             if( idx == -1 || idx == dt.num_row() ){
                 if( !itr.next( dt ) ) return false;
                 idx = 0;
@@ -1296,12 +1784,389 @@ namespace apex_svd{
             elem = dt[ idx ++ ];
             return true;
         }
+    private:
+        inline void reset_window( void ){
+            need_fill = true; refill_slot = -1;
+            rnd = apex_random::task_stream( 12, npass ++ );
+        }
     };        
 };
 
 
 namespace apex_svd{
-    IDataIterator<SVDFeatureCSR::Elem> *create_csr_iterator( int dtype ){
+    // expand comma separated list of files, each item can be a glob pattern
+    inline void expand_file_list( const char *val, std::vector<std::string> &flist ){
+        flist.clear();
+        std::string s( val );
+        size_t pos = 0;
+        while( pos <= s.length() ){
+            size_t next = s.find( ',', pos );
+            if( next == std::string::npos ) next = s.length();
+            std::string item = s.substr( pos, next - pos );
+            pos = next + 1;
+            if( item.length() == 0 ) continue;
+#ifndef _MSC_VER
+            if( item.find_first_of( "*?[" ) != std::string::npos ){
+                glob_t g;
+                apex_utils::assert_true( glob( item.c_str(), 0, NULL, &g ) == 0, "no file matches the shard pattern" );
+                for( size_t i = 0; i < g.gl_pathc; i ++ ) flist.push_back( g.gl_pathv[i] );
+                globfree( &g );
+                continue;
+            }
+#endif
+            flist.push_back( item );
+        }
+    }
+    // size of file in bytes, 0 if it does not exist
+    inline size_t file_size( const char *fname ){
+        FILE *fp = fopen64( fname, "rb" );
+        if( fp == NULL ) return 0;
+#ifdef _MSC_VER
+        fseek( fp, 0, SEEK_END );
+        size_t sz = static_cast<size_t>( ftell( fp ) );
+#else
+        fseeko( fp, 0, SEEK_END );
+        size_t sz = static_cast<size_t>( ftello( fp ) );
+#endif
+        fclose( fp );
+        return sz;
+    }
+
+    // growable array of POD type, storage is aligned to cache line
+    template<typename T>
+    class AlignedArray{
+    private:
+        T *dptr;
+        size_t n, cap;
+    public:
+        AlignedArray( void ){ dptr = NULL; n = cap = 0; }
+        ~AlignedArray( void ){ this->free_space(); }
+        inline void free_space( void ){
+            if( dptr != NULL ){
+#ifdef _MSC_VER
+                _aligned_free( dptr );
+#else
+                free( dptr );
+#endif
+            }
+            dptr = NULL; n = cap = 0;
+        }
+        inline void append( const T *src, size_t k ){
+            if( n + k > cap ){
+                size_t ncap = cap < 1024 ? 1024 : cap * 2;
+                while( ncap < n + k ) ncap *= 2;
+                void *p = NULL;
+#ifdef _MSC_VER
+                p = _aligned_malloc( ncap * sizeof(T), 64 );
+#else
+                if( posix_memalign( &p, 64, ncap * sizeof(T) ) != 0 ) p = NULL;
+#endif
+                apex_utils::assert_true( p != NULL, "AlignedArray: out of memory" );
+                if( n != 0 ) memcpy( p, dptr, n * sizeof(T) );
+                const size_t nold = n;
+                this->free_space();
+                dptr = static_cast<T*>( p ); n = nold; cap = ncap;
+            }
+            if( k != 0 ) memcpy( dptr + n, src, k * sizeof(T) );
+            n += k;
+        }
+        inline void push_back( const T &v ){
+            this->append( &v, 1 );
+        }
+        inline T *data( void ) const{
+            return dptr;
+        }
+        inline size_t size( void ) const{
+            return n;
+        }
+        inline size_t bytes( void ) const{
+            return cap * sizeof(T);
+        }
+    };
+
+    // rows of a shard kept in memory, packed in CSR format
+    struct CSRCache{
+        // offsets are size_t, a shard can hold more than INT_MAX entries when cache_mem has no limit
+        AlignedArray<size_t>   row_ptr;
+        AlignedArray<float>    row_label;
+        AlignedArray<unsigned> feat_index;
+        AlignedArray<float>    feat_value;
+        CSRCache( void ){
+            size_t zero = 0;
+            row_ptr.push_back( zero );
+        }
+        inline size_t bytes( void ) const{
+            return row_ptr.bytes() + row_label.bytes() + feat_index.bytes() + feat_value.bytes();
+        }
+        inline size_t num_row( void ) const{
+            return row_label.size();
+        }
+        inline bool push_back( const SVDFeatureCSR::Elem &e ){
+            size_t nptr[3];
+            nptr[0] = feat_index.size() + e.num_global;
+            nptr[1] = nptr[0] + e.num_ufactor;
+            nptr[2] = nptr[1] + e.num_ifactor;
+            row_ptr.append( nptr, 3 );
+            row_label.push_back( e.label );
+            feat_index.append( e.index_global, e.num_global );
+            feat_index.append( e.index_ufactor, e.num_ufactor );
+            feat_index.append( e.index_ifactor, e.num_ifactor );
+            feat_value.append( e.value_global, e.num_global );
+            feat_value.append( e.value_ufactor, e.num_ufactor );
+            feat_value.append( e.value_ifactor, e.num_ifactor );
+            return true;
+        }
+        // user grouped blocks are not cached
+        inline bool push_back( const SVDPlusBlock &e ){
+            return false;
+        }
+        inline void get( size_t r, SVDFeatureCSR::Elem &e ) const{
+            const size_t *p = row_ptr.data() + r * 3;
+            e.label = row_label.data()[ r ];
+            e.num_global  = static_cast<int>( p[1] - p[0] );
+            e.num_ufactor = static_cast<int>( p[2] - p[1] );
+            e.num_ifactor = static_cast<int>( p[3] - p[2] );
+            e.set_space( feat_index.data() + p[0], feat_value.data() + p[0] );
+        }
+        inline void get( size_t r, SVDPlusBlock &e ) const{
+            apex_utils::error("CSRCache: can not get SVDPlusBlock");
+        }
+    };
+
+    /*!
+     * \brief iterator over input split into shards, data_in/buffer_feature/feedback_in can be
+     *   comma separated lists or glob patterns, every shard is read by its own iterator(with its own thread),
+     *   shard_nreader shards are opened ahead at the same time, the output is in shard order,
+     *   or interleaved row by row among opened shards when shard_interleave=1,
+     *   buffers with index can be further split into shard_split parts, each read by its own iterator,
+     *   with cache_data=1, each shard is kept in memory in the first pass if it fits into the budget
+     *   cache_mem(in MB, 0 means no limit), later passes read the cached shards from memory
+     */
+    template<typename DType>
+    class ShardIterator: public IDataIterator<DType>{
+    private:
+        typedef IDataIterator<DType> *(*Creator)( int dtype );
+        Creator create;
+        int dtype;
+        int shard_interleave;
+        int shard_nreader;
+        int shard_split;
+        // whether the iterator supports buffer_part
+        bool can_split;
+        // all parameters, replayed to iterator of each shard
+        std::vector< std::pair<std::string,std::string> > params;
+        // parameters that are split into shards, and value for each shard
+        std::vector<std::string> shard_key;
+        std::vector< std::vector<std::string> > shard_val;
+        size_t nshard, next_shard, cur;
+        // iterator of each shard, NULL if not opened
+        std::vector< IDataIterator<DType>* > reader;
+        // shards being read
+        std::vector<size_t> active;
+        // number of elements read from each shard in current pass, and in last complete pass
+        std::vector<size_t> nread, shard_count;
+        std::vector<size_t> shard_bytes;
+        // in memory cache
+        int cache_data;
+        double cache_mem;
+        // cache of each shard, complete after its first full pass
+        std::vector<CSRCache*> cache;
+        // state of cache: 0 not tried, 1 caching, 2 complete, -1 does not fit
+        std::vector<int> cache_state;
+        // total bytes of all caches
+        size_t cache_bytes;
+    private:
+        inline void drop_cache( size_t k, int state ){
+            cache_bytes -= cache[k]->bytes();
+            delete cache[k]; cache[k] = NULL;
+            cache_state[k] = state;
+        }
+        inline void open( size_t k ){
+            nread[k] = 0;
+            active.push_back( k );
+            if( cache_state[k] == 2 ) return;
+            if( cache_data != 0 && cache_state[k] == 0 ){
+                cache[k] = new CSRCache(); cache_state[k] = 1;
+                cache_bytes += cache[k]->bytes();
+            }
+            if( reader[k] == NULL ){
+                reader[k] = create( dtype );
+                for( size_t i = 0; i < params.size(); i ++ ){
+                    const char *val = params[i].second.c_str();
+                    for( size_t j = 0; j < shard_key.size(); j ++ ){
+                        if( shard_key[j] == params[i].first ) val = shard_val[j][k].c_str();
+                    }
+                    reader[k]->set_param( params[i].first.c_str(), val );
+                }
+                reader[k]->init();
+            }else{
+                reader[k]->before_first();
+            }
+        }
+        // close shards when they can't be kept open all together, or when they are cached
+        inline void close( size_t k ){
+            // cache of a shard that is not completely read is useless
+            if( cache_state[k] == 1 ) this->drop_cache( k, 0 );
+            if( ( nshard > static_cast<size_t>( shard_nreader ) || cache_state[k] == 2 ) && reader[k] != NULL ){
+                delete reader[k]; reader[k] = NULL;
+            }
+        }
+        inline bool next( size_t k, DType &e ){
+            if( cache_state[k] == 2 ){
+                if( nread[k] >= cache[k]->num_row() ) return false;
+                cache[k]->get( nread[k], e );
+                return true;
+            }
+            if( !reader[k]->next( e ) ) return false;
+            if( cache_state[k] == 1 ){
+                const size_t nbytes = cache[k]->bytes();
+                if( !cache[k]->push_back( e ) ){
+                    this->drop_cache( k, -1 );
+                }else{
+                    cache_bytes += cache[k]->bytes() - nbytes;
+                    if( cache_mem > 0.0 && cache_bytes > cache_mem * ( 1 << 20 ) ) this->drop_cache( k, -1 );
+                }
+            }
+            return true;
+        }
+    public:
+        ShardIterator( Creator create, int dtype, bool can_split = false )
+            :create(create), dtype(dtype), can_split(can_split){
+            shard_interleave = 0;
+            shard_nreader = 2;
+            shard_split = 1;
+            nshard = 0;
+            cache_data = 0;
+            cache_mem = 0.0;
+            cache_bytes = 0;
+        }
+        virtual ~ShardIterator( void ){
+            for( size_t k = 0; k < reader.size(); k ++ ){
+                if( reader[k] != NULL ) delete reader[k];
+                if( cache[k] != NULL ) delete cache[k];
+            }
+        }
+        virtual void set_param( const char *name, const char *val ){
+            if( !strcmp( name, "shard_interleave" ) ) shard_interleave = atoi( val );
+            if( !strcmp( name, "shard_nreader" ) )    shard_nreader = atoi( val );
+            if( !strcmp( name, "shard_split" ) )      shard_split = atoi( val );
+            if( !strcmp( name, "cache_data" ) )       cache_data = atoi( val );
+            if( !strcmp( name, "cache_mem" ) )        cache_mem = atof( val );
+            params.push_back( std::make_pair( std::string( name ), std::string( val ) ) );
+        }
+        virtual void init( void ){
+            apex_utils::assert_true( shard_nreader > 0, "shard_nreader must be positive" );
+            // take the last setting of each parameter that is a list of shards
+            const char *keys[] = { "buffer_feature", "data_in", "feedback_in" };
+            nshard = 1;
+            for( int i = 0; i < 3; i ++ ){
+                for( size_t j = params.size(); j != 0; j -- ){
+                    if( params[j-1].first != keys[i] ) continue;
+                    std::vector<std::string> flist;
+                    expand_file_list( params[j-1].second.c_str(), flist );
+                    if( flist.size() > 1 || params[j-1].second.find_first_of( ",*?[" ) != std::string::npos ){
+                        apex_utils::assert_true( flist.size() != 0, "empty shard list" );
+                        apex_utils::assert_true( shard_key.size() == 0 || flist.size() == nshard, "shard lists must have the same length" );
+                        nshard = flist.size();
+                        shard_key.push_back( keys[i] );
+                        shard_val.push_back( flist );
+                    }
+                    break;
+                }
+            }
+            shard_bytes.resize( nshard, 0 );
+            if( shard_val.size() != 0 ){
+                for( size_t k = 0; k < nshard; k ++ ){
+                    shard_bytes[k] = file_size( shard_val[0][k].c_str() );
+                }
+            }else{
+                for( int i = 0; i < 2 && shard_bytes[0] == 0; i ++ ){
+                    for( size_t j = params.size(); j != 0; j -- ){
+                        if( params[j-1].first != keys[i] ) continue;
+                        shard_bytes[0] = file_size( params[j-1].second.c_str() ); break;
+                    }
+                }
+            }
+            if( shard_split > 1 ){
+                // part j of a file is read by shard k * shard_split + j
+                apex_utils::assert_true( can_split, "shard_split is only supported by binary buffer and binary page input" );
+                const size_t nsplit = static_cast<size_t>( shard_split );
+                std::vector<size_t> bytes;
+                for( size_t j = 0; j < shard_val.size(); j ++ ){
+                    std::vector<std::string> flist;
+                    for( size_t k = 0; k < nshard * nsplit; k ++ ) flist.push_back( shard_val[j][ k / nsplit ] );
+                    shard_val[j] = flist;
+                }
+                std::vector<std::string> plist;
+                for( size_t k = 0; k < nshard * nsplit; k ++ ){
+                    char sval[ 32 ];
+                    sprintf( sval, "%d", static_cast<int>( k % nsplit ) );
+                    plist.push_back( sval );
+                    bytes.push_back( shard_bytes[ k / nsplit ] / nsplit );
+                }
+                char sval[ 32 ];
+                sprintf( sval, "%d", shard_split );
+                params.push_back( std::make_pair( std::string( "buffer_npart" ), std::string( sval ) ) );
+                params.push_back( std::make_pair( std::string( "buffer_part" ), std::string( "0" ) ) );
+                shard_key.push_back( "buffer_part" );
+                shard_val.push_back( plist );
+                shard_bytes = bytes;
+                nshard *= nsplit;
+            }
+            reader.resize( nshard, NULL );
+            nread.resize( nshard, 0 );
+            shard_count.resize( nshard, 0 );
+            cache.resize( nshard, NULL );
+            cache_state.resize( nshard, 0 );
+            this->before_first();
+        }
+        virtual void before_first( void ){
+            for( size_t i = 0; i < active.size(); i ++ ) this->close( active[i] );
+            active.clear();
+            cur = 0; next_shard = 0;
+            while( next_shard < nshard && active.size() < static_cast<size_t>( shard_nreader ) ){
+                this->open( next_shard ++ );
+            }
+        }
+        virtual bool next( DType &e ){
+            while( active.size() != 0 ){
+                if( cur >= active.size() ) cur = 0;
+                const size_t k = active[ cur ];
+                if( this->next( k, e ) ){
+                    nread[k] ++;
+                    if( shard_interleave != 0 ) cur ++;
+                    return true;
+                }
+                // shard finished, open the next one
+                shard_count[k] = nread[k];
+                if( cache_state[k] == 1 ) cache_state[k] = 2;
+                active.erase( active.begin() + cur );
+                this->close( k );
+                if( next_shard < nshard ) this->open( next_shard ++ );
+            }
+            return false;
+        }
+        virtual size_t get_data_size( void ){
+            // shards not yet counted are estimated by the file size
+            size_t sum = 0;
+            double kbytes = 0.0, krows = 0.0, ubytes = 0.0;
+            for( size_t k = 0; k < nshard; k ++ ){
+                size_t n = shard_count[k];
+                if( n == 0 && reader[k] != NULL ) n = reader[k]->get_data_size();
+                if( n != 0 ){
+                    sum += n; krows += n; kbytes += shard_bytes[k];
+                }else{
+                    ubytes += shard_bytes[k];
+                }
+            }
+            if( kbytes > 0.0 ) sum += static_cast<size_t>( ubytes * krows / kbytes );
+            return sum;
+        }
+    };
+};
+
+namespace apex_svd{
+    inline IDataIterator<SVDFeatureCSR::Elem> *create_csr_shard( int dtype ){
         switch( dtype ){
         case input_type::BINARY_BUFFER: return new SVDCSRThreadIterator<SVDFeatureCSRFactory>();
         case input_type::TEXT_FEATURE : return create_slavethread_iter( new SVDFeatureCSRLoader() );
@@ -1310,6 +2175,26 @@ namespace apex_svd{
         default: apex_utils::error("unknown iterator type"); return NULL;
         }
     }
+    inline IDataIterator<SVDPlusBlock> *create_plus_shard( int dtype ){
+        switch( dtype ){
+        case input_type::BINARY_BUFFER: return 
+                new IteratorAdapter< apex_utils::ThreadBufferIterator<SVDPlusBlock,SVDPlusBlockFactory>, 
+                                     SVDPlusBlock>();
+        case input_type::TEXT_FEATURE : return create_slavethread_iter( new SVDPlusBlockLoader() );
+        default: apex_utils::error("unknown iterator type"); return NULL;
+        }
+    }
+    IDataIterator<SVDFeatureCSR::Elem> *create_csr_iterator( int dtype ){
+        switch( dtype ){
+        case input_type::BINARY_BUFFER: 
+        case input_type::TEXT_FEATURE : 
+        case input_type::TEXT_BASIC   : 
+        case input_type::BINARY_PAGE  : 
+            return new ShardIterator<SVDFeatureCSR::Elem>( create_csr_shard, dtype, 
+                                                           dtype == input_type::BINARY_BUFFER || dtype == input_type::BINARY_PAGE );
+        default: apex_utils::error("unknown iterator type"); return NULL;
+        }
+    }
     IDataIterator<SVDPlusBlock> *create_plus_iterator( int dtype ){
         // create filter block iterator, for filtering parts of input
         if( dtype >= 200 && dtype < 300 ){
@@ -1323,10 +2208,8 @@ namespace apex_svd{
                                             create_plus_iterator( dright ) );
         }
         switch( dtype ){
-        case input_type::BINARY_BUFFER: return 
-                new IteratorAdapter< apex_utils::ThreadBufferIterator<SVDPlusBlock,SVDPlusBlockFactory>, 
-                                     SVDPlusBlock>();
-        case input_type::TEXT_FEATURE : return create_slavethread_iter( new SVDPlusBlockLoader() );
+        case input_type::BINARY_BUFFER: 
+        case input_type::TEXT_FEATURE : return new ShardIterator<SVDPlusBlock>( create_plus_shard, dtype );
         case input_type::BINARY_BUFFER_RANK:
         case input_type::TEXT_FEATURE_RANK : 
             return new PairwiseRankGenerator( create_plus_iterator( dtype&1 ) );
@@ -1337,8 +2220,7 @@ namespace apex_svd{
 
 namespace apex_svd{
     IDataIterator<SVDFeatureCSR::Elem> *create_slavethread_iter( IDataIterator<SVDFeatureCSR::Elem> *slave_iter ){
-        //typedef IteratorAdapter< apex_utils::ThreadBufferIterator<SVDFeatureCSR::Elem,SVDFeatureCSRBuffer>, 
-        //SVDFeatureCSR::Elem> itr_master;
+        //typedef ArenaSlotIteratorAdapter<SVDFeatureCSRBuffer,SVDFeatureCSR::Elem> itr_master;
         typedef SVDCSRPageThreadIterator<SVDFeatureCSRPageFactory> itr_master;
         itr_master *itr = new itr_master();
         ((itr->itr).factory).itr_data = slave_iter;
@@ -1346,8 +2228,7 @@ namespace apex_svd{
     }
 
     IDataIterator<SVDPlusBlock> *create_slavethread_iter( IDataIterator<SVDPlusBlock> *slave_iter ){
-        typedef IteratorAdapter< apex_utils::ThreadBufferIterator<SVDPlusBlock,SVDPlusBlockBuffer>, 
-                                 SVDPlusBlock> itr_master;
+        typedef ArenaSlotIteratorAdapter<SVDPlusBlockBuffer,SVDPlusBlock> itr_master;
         itr_master *itr = new itr_master();
         ((itr->itr).factory).itr_data = slave_iter;
         return itr;
@@ -1355,8 +2236,8 @@ namespace apex_svd{
 };
 
 namespace apex_svd{
-    void create_binary_buffer( const char *name_buf, IDataIterator<SVDFeatureCSR::Elem> *data_iter, int batch_size ){
-        SVDFeatureCSRFactory::create_buffer( name_buf, data_iter, batch_size );
+    void create_binary_buffer( const char *name_buf, IDataIterator<SVDFeatureCSR::Elem> *data_iter, int batch_size, int compress ){
+        SVDFeatureCSRFactory::create_buffer( name_buf, data_iter, batch_size, compress );
     } 
     void create_binary_buffer( const char *name_buf, IDataIterator<SVDPlusBlock> *data_iter ){
         SVDPlusBlockFactory::create_buffer( name_buf, data_iter );
@@ -23,7 +23,10 @@
 #define _APEX_SVD_DATA_H_
 #include <vector>
 #include <cstring>
+#include <cstdlib>
+#include <climits>
 #include "apex-utils/apex_utils.h"
+#include "apex-utils/apex_arena.h"
 
 namespace apex_svd{
     /*! 
@@ -96,14 +99,29 @@ namespace apex_svd{
             inline Elem clone( void ) const{
                 Elem val = *this;
                 val.alloc_space();
-                memcpy( val.index_global , index_global, sizeof(unsigned)*num_global );
-                memcpy( val.value_global , value_global, sizeof(float)*num_global );
-                memcpy( val.index_ufactor, index_ufactor, sizeof(unsigned)*num_ufactor );
-                memcpy( val.value_ufactor, value_ufactor, sizeof(float)*num_ufactor );
-                memcpy( val.index_ifactor, index_ifactor, sizeof(unsigned)*num_ifactor );
-                memcpy( val.value_ifactor, value_ifactor, sizeof(float)*num_ifactor );
+                val.copy_data( *this );
                 return val;
             }
+            /*! 
+             * \brief clone another copy of data, with space carved from arena
+             * \param arena arena that holds the space, the copy is valid until arena is reset
+             * \return the cloned element
+             */
+            inline Elem clone( apex_utils::MemoryArena &arena ) const{
+                Elem val = *this;
+                val.set_space( arena.alloc<unsigned>( total_num() ), arena.alloc<float>( total_num() ) );
+                val.copy_data( *this );
+                return val;
+            }
+        private:
+            inline void copy_data( const Elem &src ){
+                memcpy( index_global , src.index_global, sizeof(unsigned)*num_global );
+                memcpy( value_global , src.value_global, sizeof(float)*num_global );
+                memcpy( index_ufactor, src.index_ufactor, sizeof(unsigned)*num_ufactor );
+                memcpy( value_ufactor, src.value_ufactor, sizeof(float)*num_ufactor );
+                memcpy( index_ifactor, src.index_ifactor, sizeof(unsigned)*num_ifactor );
+                memcpy( value_ifactor, src.value_ifactor, sizeof(float)*num_ifactor );
+            }
         };        
         // note: features is stored in order, global, ufactor, ifactor 
         /*! \brief number of rows in the sparse matrix */
@@ -184,6 +202,16 @@ namespace apex_svd{
             feat_index = new unsigned[ num_val ];
             feat_value = new float   [ num_val ];
         }
+        /*! 
+         * \brief carve space for given parameters from arena, num_row, num_val must be set before allocation
+         * \param arena arena that holds the space, there is no need to free it
+         */
+        inline void alloc_space( apex_utils::MemoryArena &arena ){
+            row_ptr    = arena.alloc<int>( num_row*3 + 1 );
+            row_label  = arena.alloc<float>( num_row );
+            feat_index = arena.alloc<unsigned>( num_val );
+            feat_value = arena.alloc<float>( num_val );
+        }
         /*! 
          * \brief free space of the CSR matrix
          */        
@@ -228,6 +256,167 @@ namespace apex_svd{
                 apex_utils::assert_true( fread( feat_value, sizeof(float), num_val, fi ) > 0, "CSR load from file");
             }           
         }
+        /*! 
+         * \brief load data from memory, in the same layout as save_to_file
+         * \param buf start of the data
+         * \param size size of the data in bytes
+         */        
+        inline void load_from_memory( const char *buf, size_t size ) {
+            apex_utils::assert_true( size >= sizeof(int) * 2, "CSR load from memory" );
+            memcpy( this, buf, sizeof(int) * 2 );
+            const size_t nrow = static_cast<size_t>( num_row ), nval = static_cast<size_t>( num_val );
+            apex_utils::assert_true( size == sizeof(int) * ( 3 + nrow * 4 + nval * 2 ), "CSR load from memory" );
+            buf += sizeof(int) * 2;
+            memcpy( row_ptr, buf, sizeof(int) * ( nrow*3 + 1 ) ); buf += sizeof(int) * ( nrow*3 + 1 );
+            memcpy( row_label, buf, sizeof(float) * nrow );        buf += sizeof(float) * nrow;
+            memcpy( feat_index, buf, sizeof(unsigned) * nval );    buf += sizeof(unsigned) * nval;
+            memcpy( feat_value, buf, sizeof(float) * nval );
+        }
+    };
+
+    /*!
+     * \brief renumbering of global, user and item feature ids, created by tools/remap_feature_buffer,
+     *   frequent ids get small new ids, so their rows sit together in the model
+     */
+    struct FeatureRemap{
+        /*! \brief new id of each old id, for global, user and item feature, empty map keeps the ids */
+        std::vector<unsigned> id_map[3];
+        /*! \brief whether there is nothing to remap */
+        inline bool empty( void ) const{
+            return id_map[0].size() == 0 && id_map[1].size() == 0 && id_map[2].size() == 0;
+        }
+        /*!
+         * \brief translate the old ids of src, the result uses space of this object and is valid until next call,
+         *   features whose old id is not in a nonempty map, or whose new id is not below bound are dropped
+         * \param src element in old ids
+         * \param bound bound of new ids for global, user and item feature
+         * \param fields bit k set means field k is translated, otherwise it is copied as it is
+         * \return element in new ids
+         */
+        inline SVDFeatureCSR::Elem map( const SVDFeatureCSR::Elem &src, const unsigned bound[3], int fields = 7 ){
+            const int      num[3] = { src.num_global, src.num_ufactor, src.num_ifactor };
+            const unsigned *sidx[3] = { src.index_global, src.index_ufactor, src.index_ifactor };
+            const float    *sval[3] = { src.value_global, src.value_ufactor, src.value_ifactor };
+            index.resize( src.total_num() + 1 );
+            value.resize( src.total_num() + 1 );
+            int cnt[3], top = 0;
+            for( int k = 0; k < 3; k ++ ){
+                cnt[k] = 0;
+                const bool keep = ( fields >> k & 1 ) == 0;
+                for( int i = 0; i < num[k]; i ++ ){
+                    unsigned fid = sidx[k][i];
+                    if( !keep ){
+                        if( id_map[k].size() != 0 ){
+                            if( fid >= id_map[k].size() ) continue;
+                            fid = id_map[k][ fid ];
+                        }
+                        if( fid >= bound[k] ) continue;
+                    }
+                    index[ top ] = fid; value[ top ] = sval[k][i];
+                    top ++; cnt[k] ++;
+                }
+            }
+            SVDFeatureCSR::Elem e;
+            e.label = src.label;
+            e.num_global = cnt[0]; e.num_ufactor = cnt[1]; e.num_ifactor = cnt[2];
+            e.set_space( &index[0], &value[0] );
+            return e;
+        }
+        /*! \brief save the maps to file */
+        inline void save( FILE *fo ) const{
+            for( int k = 0; k < 3; k ++ ){
+                const unsigned n = static_cast<unsigned>( id_map[k].size() );
+                fwrite( &n, sizeof(unsigned), 1, fo );
+                if( n != 0 ) fwrite( &id_map[k][0], sizeof(unsigned), n, fo );
+            }
+        }
+        /*! \brief load the maps from file */
+        inline void load( FILE *fi ){
+            for( int k = 0; k < 3; k ++ ){
+                unsigned n;
+                apex_utils::assert_true( fread( &n, sizeof(unsigned), 1, fi ) == 1, "FeatureRemap: invalid remap file" );
+                id_map[k].resize( n );
+                if( n != 0 ){
+                    apex_utils::assert_true( fread( &id_map[k][0], sizeof(unsigned), n, fi ) == n, "FeatureRemap: invalid remap file" );
+                }
+            }
+        }
+    private:
+        // space of the translated element
+        std::vector<unsigned> index;
+        std::vector<float>    value;
+    };
+
+    /*!
+     * \brief hashing trick for text input: raw 64 bit feature ids are hashed into tables of fixed size while parsing,
+     *   so no dictionary of ids is needed and the size of model is set by configure, ids that collide share a row
+     */
+    struct FeatureHasher{
+        /*! \brief table size of global, user and item feature, 0 means the ids are used as they are */
+        unsigned size[3];
+        /*! \brief seed of global, user and item feature */
+        unsigned long long seed[3];
+        /*! \brief whether to flip sign of the value by the hash, so that collisions cancel out in expectation */
+        int sign;
+        /*! \brief constructor */
+        FeatureHasher( void ){
+            size[0] = size[1] = size[2] = 0;
+            seed[0] = seed[1] = seed[2] = 0;
+            sign = 0;
+        }
+        /*!
+         * \brief parse size of a hash table, the size is also the number of rows in model, so it must fit in int
+         * \param val value of hash_global/hash_user/hash_item
+         * \return the size
+         */
+        inline static unsigned parse_size( const char *val ){
+            char *end;
+            const unsigned long long n = strtoull( val, &end, 10 );
+            if( end == val || *end != '\0' || val[0] == '-' || n > static_cast<unsigned long long>( INT_MAX ) ){
+                apex_utils::error( "hash_global/hash_user/hash_item must be an integer in [0,INT_MAX]" );
+            }
+            return static_cast<unsigned>( n );
+        }
+        /*!
+         * \brief set parameters
+         * \param name name of the parameter
+         * \param val  value of the parameter
+         */
+        inline void set_param( const char *name, const char *val ){
+            if( !strcmp( name, "hash_global" ) )      size[0] = parse_size( val );
+            if( !strcmp( name, "hash_user" ) )        size[1] = parse_size( val );
+            if( !strcmp( name, "hash_item" ) )        size[2] = parse_size( val );
+            if( !strcmp( name, "hash_seed" ) )        seed[0] = seed[1] = seed[2] = strtoull( val, NULL, 10 );
+            if( !strcmp( name, "hash_seed_global" ) ) seed[0] = strtoull( val, NULL, 10 );
+            if( !strcmp( name, "hash_seed_user" ) )   seed[1] = strtoull( val, NULL, 10 );
+            if( !strcmp( name, "hash_seed_item" ) )   seed[2] = strtoull( val, NULL, 10 );
+            if( !strcmp( name, "hash_sign" ) )        sign = atoi( val );
+        }
+        /*! \brief whether any field is hashed */
+        inline bool enabled( void ) const{
+            return size[0] != 0 || size[1] != 0 || size[2] != 0;
+        }
+        /*!
+         * \brief map a raw feature id into the table of its field
+         * \param k field of the feature, 0:global, 1:user, 2:item
+         * \param raw raw feature id
+         * \param value value of the feature, its sign is flipped by the hash if hash_sign is set
+         * \return index of the feature in the table
+         */
+        inline unsigned map( int k, unsigned long long raw, float &value ) const{
+            if( size[k] == 0 ){
+                apex_utils::assert_true( raw <= 0xFFFFFFFFULL, "feature id exceed 32 bit, use hash_global/hash_user/hash_item" );
+                return static_cast<unsigned>( raw );
+            }
+            // splitmix64 finalizer
+            unsigned long long h = raw + ( seed[k] + 1 ) * 0x9E3779B97F4A7C15ULL;
+            h = ( h ^ ( h >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+            h = ( h ^ ( h >> 27 ) ) * 0x94D049BB133111EBULL;
+            h = h ^ ( h >> 31 );
+            if( sign != 0 && ( h >> 63 ) != 0 ) value = -value;
+            // low 32 bits scaled into [0,size)
+            return static_cast<unsigned>( ( ( h & 0xFFFFFFFFULL ) * size[k] ) >> 32 );
+        }
     };
 };
 
@@ -265,6 +454,38 @@ namespace apex_svd{
         inline void save_to_file( FILE *fo ){
             fwrite( dptr, sizeof(int), psize, fo );
         }
+        /*!
+         * \brief size in bytes of the used part of the page, head and tail
+         */
+        inline size_t used_size( void ) const{
+            const int space_head = ( dptr[ 0 ] << 2 ) + 1;
+            return sizeof(int) * ( space_head + 1 + ( dptr[ space_head ] << 1 ) );
+        }
+        /*!
+         * \brief save the used part of the page to memory
+         * \param buf output buffer, with used_size() bytes
+         */
+        inline void save_to_memory( char *buf ) const{
+            const int space_head = ( dptr[ 0 ] << 2 ) + 1;
+            const int nval = dptr[ space_head ];
+            memcpy( buf, dptr, sizeof(int) * ( space_head + 1 ) );
+            memcpy( buf + sizeof(int) * ( space_head + 1 ), dptr + psize - (nval<<1), sizeof(int) * (nval<<1) );
+        }
+        /*!
+         * \brief load page from memory saved by save_to_memory
+         * \param buf start of the data
+         * \param size size of the data in bytes
+         */
+        inline void load_from_memory( const char *buf, size_t size ){
+            apex_utils::assert_true( size >= sizeof(int) * 2, "load CSR page" );
+            memcpy( dptr, buf, sizeof(int) );
+            const int space_head = ( dptr[ 0 ] << 2 ) + 1;
+            apex_utils::assert_true( space_head < psize && size >= sizeof(int) * ( space_head + 1 ), "load CSR page" );
+            memcpy( dptr, buf, sizeof(int) * ( space_head + 1 ) );
+            const int nval = dptr[ space_head ];
+            apex_utils::assert_true( size == this->used_size(), "load CSR page" );
+            memcpy( dptr + psize - (nval<<1), buf + sizeof(int) * ( space_head + 1 ), sizeof(int) * (nval<<1) );
+        }
         /*!\brief allocate space for the data */
         inline void alloc_space( void ){
             if( dptr == NULL ){
@@ -314,6 +535,16 @@ namespace apex_svd{
             }
             return true;
         }
+        /*!
+         * \brief copy the content of another page, space must be allocated
+         * \param src the page to copy from
+         */
+        inline void copy_from( const SVDFeatureCSRPage &src ){
+            const int space_head = ( src.dptr[ 0 ] << 2 ) + 1;
+            const int nval = src.dptr[ space_head ];
+            memcpy( dptr, src.dptr, sizeof(int) * ( space_head + 1 ) );
+            memcpy( dptr + psize - (nval<<1), src.dptr + psize - (nval<<1), sizeof(int) * (nval<<1) );
+        }
         /*!\brief set number of row to 0 */
         inline void clear( void ){
             dptr[ 0 ] = dptr[ 1 ] = 0;
@@ -403,6 +634,16 @@ namespace apex_svd{
             value_ufeedback = new float   [ num_ufeedback ];
             data.alloc_space();
         }
+        /*! 
+         * \brief carve space with given parameters from arena
+         * \param arena arena that holds the space, there is no need to free it
+         * \sa alloc_space
+         */
+        inline void alloc_space( apex_utils::MemoryArena &arena ){
+            index_ufeedback = arena.alloc<unsigned>( num_ufeedback );
+            value_ufeedback = arena.alloc<float>( num_ufeedback );
+            data.alloc_space( arena );
+        }
         /*! 
          * \brief free space of the storge
          * \sa alloc_space
@@ -455,14 +696,29 @@ namespace apex_svd{
         inline SVDPlusBlock clone( void ) const{
             SVDPlusBlock val = *this;
             val.alloc_space();
-            memcpy( val.index_ufeedback, index_ufeedback, sizeof(unsigned)*num_ufeedback );
-            memcpy( val.value_ufeedback, value_ufeedback, sizeof(float)*num_ufeedback );
-            memcpy( val.data.row_ptr   , data.row_ptr  , sizeof(int)*(data.num_row*3+1) );
-            memcpy( val.data.row_label , data.row_label, sizeof(float)*data.num_row );
-            memcpy( val.data.feat_index, data.feat_index, sizeof(unsigned)*data.num_val );
-            memcpy( val.data.feat_value, data.feat_value, sizeof(float)*data.num_val );
+            val.copy_data( *this );
             return val;
         }
+        /*! 
+         * \brief clone another copy of the storage block, with space carved from arena
+         * \param arena arena that holds the space, the copy is valid until arena is reset
+         * \return a cloned copy of the storage block
+         */        
+        inline SVDPlusBlock clone( apex_utils::MemoryArena &arena ) const{
+            SVDPlusBlock val = *this;
+            val.alloc_space( arena );
+            val.copy_data( *this );
+            return val;
+        }
+    private:
+        inline void copy_data( const SVDPlusBlock &src ){
+            memcpy( index_ufeedback, src.index_ufeedback, sizeof(unsigned)*num_ufeedback );
+            memcpy( value_ufeedback, src.value_ufeedback, sizeof(float)*num_ufeedback );
+            memcpy( data.row_ptr   , src.data.row_ptr  , sizeof(int)*(data.num_row*3+1) );
+            memcpy( data.row_label , src.data.row_label, sizeof(float)*data.num_row );
+            memcpy( data.feat_index, src.data.feat_index, sizeof(unsigned)*data.num_val );
+            memcpy( data.feat_value, src.data.feat_value, sizeof(float)*data.num_val );
+        }
     };    
     /*! 
      * \brief interface for data iterator
@@ -559,8 +815,9 @@ namespace apex_svd{
      * \param data_iter data iterator that provide the data input
      * \param batch_size how many elements to be stored in a block, 
      *    not a too important parameter, simply use the default value
+     * \param compress whether to compress each block, the buffer is then stored as frame file
      */
-    void create_binary_buffer( const char *name_buf, IDataIterator<SVDFeatureCSR::Elem> *data_iter, int batch_size = 1000 );
+    void create_binary_buffer( const char *name_buf, IDataIterator<SVDFeatureCSR::Elem> *data_iter, int batch_size = 1000, int compress = 0 );
     /*! 
      * \brief create user grouped format binary buffer file with the data provided by data_iter
      * \param name_buf name of the binary buffer file
@@ -26,8 +26,16 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <algorithm>
 #include "apex-utils/apex_utils.h"
+#include "apex_svd_data.h"
 #include "apex-tensor/apex_tensor.h"
+#include "apex-tensor/apex_random.h"
+#include "apex-tensor/apex_tensor_half.h"
+#include "apex-utils/apex_thread.h"
+#include "apex-utils/apex_row_cache.h"
 #include <fstream>
 
 /*! \brief namespace for matrix data structures and operations */
@@ -82,6 +90,75 @@ namespace apex_svd{
         inline float sqr( float z ){
             return z * z;
         }        
+        /*! \brief sigmoid function 1/(1+exp(-x)) */
+        inline float sigmoid( float x ){
+            return 1.0f / ( 1.0f + expf( -x ) );
+        }
+        /*! 
+         * \brief fast approximation of exp, input is clamped to [-87,88] so the result is always a normal float,
+         *    relative error is below 3e-7 (a few ulp) in that range
+         * \param x the input
+         * \return exp(x)
+         */
+        inline float fast_exp( float x ){
+            x = x < -87.0f ? -87.0f : x;
+            x = x >  88.0f ?  88.0f : x;
+            // exp(x) = 2^n * exp(f), n = round(x/ln2), |f| <= ln2/2
+            const float t = x * 1.44269504f;
+            const int   n = static_cast<int>( t + ( t < 0.0f ? -0.5f : 0.5f ) );
+            const float fn = static_cast<float>( n );
+            // ln2 is split in two parts so f is exact
+            const float f = ( x - fn * 0.693359375f ) + fn * 2.12194440e-4f;
+            // taylor series to 6th order, truncation error below 1.2e-7 for |f| <= ln2/2
+            float p = 1.0f/720.0f;
+            p = p * f + 1.0f/120.0f;
+            p = p * f + 1.0f/24.0f;
+            p = p * f + 1.0f/6.0f;
+            p = p * f + 0.5f;
+            p = p * f + 1.0f;
+            p = p * f + 1.0f;
+            // 2^n by building the exponent bits
+            const int bits = ( n + 127 ) << 23;
+            float scale;
+            memcpy( &scale, &bits, sizeof(float) );
+            return p * scale;
+        }
+#if __APEX_TENSOR_USE_SSE__
+        /*! \brief fast_exp of four floats, same algorithm and error bound as the scalar version */
+        inline __m128 fast_exp( __m128 x ){
+            x = _mm_min_ps( _mm_max_ps( x, _mm_set1_ps( -87.0f ) ), _mm_set1_ps( 88.0f ) );
+            const __m128i n  = _mm_cvtps_epi32( _mm_mul_ps( x, _mm_set1_ps( 1.44269504f ) ) );
+            const __m128  fn = _mm_cvtepi32_ps( n );
+            const __m128  f  = _mm_add_ps( _mm_sub_ps( x, _mm_mul_ps( fn, _mm_set1_ps( 0.693359375f ) ) ), 
+                                           _mm_mul_ps( fn, _mm_set1_ps( 2.12194440e-4f ) ) );
+            __m128 p = _mm_set1_ps( 1.0f/720.0f );
+            p = _mm_add_ps( _mm_mul_ps( p, f ), _mm_set1_ps( 1.0f/120.0f ) );
+            p = _mm_add_ps( _mm_mul_ps( p, f ), _mm_set1_ps( 1.0f/24.0f ) );
+            p = _mm_add_ps( _mm_mul_ps( p, f ), _mm_set1_ps( 1.0f/6.0f ) );
+            p = _mm_add_ps( _mm_mul_ps( p, f ), _mm_set1_ps( 0.5f ) );
+            p = _mm_add_ps( _mm_mul_ps( p, f ), _mm_set1_ps( 1.0f ) );
+            p = _mm_add_ps( _mm_mul_ps( p, f ), _mm_set1_ps( 1.0f ) );
+            const __m128i bits = _mm_slli_epi32( _mm_add_epi32( n, _mm_set1_epi32( 127 ) ), 23 );
+            return _mm_mul_ps( p, _mm_castsi128_ps( bits ) );
+        }
+#endif
+        /*! 
+         * \brief p[i] = sigmoid( p[i] ) for a batch of predictions, using fast_exp, 
+         *    about 3 times faster than calling sigmoid on each of them
+         */
+        inline void sigmoid( float *p, size_t n ){
+            size_t i = 0;
+#if __APEX_TENSOR_USE_SSE__
+            const __m128 one = _mm_set1_ps( 1.0f );
+            for( ; i + 4 <= n; i += 4 ){
+                const __m128 x = _mm_sub_ps( _mm_setzero_ps(), _mm_loadu_ps( p + i ) );
+                _mm_storeu_ps( p + i, _mm_div_ps( one, _mm_add_ps( one, fast_exp( x ) ) ) );
+            }
+#endif
+            for( ; i < n; i ++ ){
+                p[i] = 1.0f / ( 1.0f + fast_exp( -p[i] ) );
+            }
+        }
         /*! 
          * \brief calculate the gradient of smoothed hinge loss for given prediction when label=1 
          * \param z the prediction
@@ -102,25 +179,88 @@ namespace apex_svd{
             if( z < 0.0f ) return  0.5f - z;
             return 0.5f * sqr( 1.0f - z );            
         }
+        /*! 
+         * \brief activation function and gradient of each active type, 
+         *    solvers can instantiate their loops with it to avoid switch on type for every sample
+         * \tparam type type of loss and activation function
+         */
+        template<int type>
+        struct ActiveFunc;
+        template<>
+        struct ActiveFunc<LINEAR>{
+            inline static float map_active( float sum ){ return sum; }
+            inline static float cal_grad( float r, float pred ){ return r - pred; }
+        };
+        template<>
+        struct ActiveFunc<SIGMOID_L2>{
+            inline static float map_active( float sum ){ return sigmoid( sum ); }
+            inline static float cal_grad( float r, float pred ){ return ( r - pred ) * pred * ( 1 - pred ); }
+        };
+        template<>
+        struct ActiveFunc<SIGMOID_LIKELIHOOD>{
+            inline static float map_active( float sum ){ return sigmoid( sum ); }
+            inline static float cal_grad( float r, float pred ){ return r - pred; }
+        };
+        template<>
+        struct ActiveFunc<SIGMOID_RANK>{
+            inline static float map_active( float sum ){ return sum; }
+            inline static float cal_grad( float r, float pred ){ return r - sigmoid( pred ); }
+        };
+        template<>
+        struct ActiveFunc<SIGMOID_QSGRAD>: public ActiveFunc<SIGMOID_RANK>{};
+        template<>
+        struct ActiveFunc<HINGE_SMOOTH>{
+            inline static float map_active( float sum ){ return sum; }
+            inline static float cal_grad( float r, float pred ){ 
+                if( r > 0.5f ) return smooth_hinge_grad( pred-0.5f );
+                else return - smooth_hinge_grad( 0.5f - pred );
+            }
+        };
+        template<>
+        struct ActiveFunc<HINGE_L2>{
+            inline static float map_active( float sum ){ return sum; }
+            inline static float cal_grad( float r, float pred ){ 
+                if( r > 0.5f ){
+                    if( pred > 1.0f ) return 0.0f;
+                    else return r - pred;
+                }else{
+                    if( pred < 0.0f ) return 0.0f;
+                    else return r - pred;
+                }
+            }
+        };
         /*! 
          * \brief map the input by the activation function
          *    can be used by the solver for calculation
          * \param sum the input data
          * \param type type of loss and activation function
          * \return the output mapped from input by the activation function
+         * \sa ActiveFunc
          */
         inline float map_active( float sum, int type ){
             switch( type ){
-            case LINEAR: return sum;
-            case SIGMOID_L2:
-            case SIGMOID_LIKELIHOOD      : return 1.0f/(1.0f+expf(-sum ));
-            case SIGMOID_RANK : return sum;
-            case HINGE_SMOOTH : return sum;
-            case HINGE_L2     : return sum;
-            case SIGMOID_QSGRAD: return sum;
+            case LINEAR            : return ActiveFunc<LINEAR>::map_active( sum );
+            case SIGMOID_L2        : return ActiveFunc<SIGMOID_L2>::map_active( sum );
+            case SIGMOID_LIKELIHOOD: return ActiveFunc<SIGMOID_LIKELIHOOD>::map_active( sum );
+            case SIGMOID_RANK      : return ActiveFunc<SIGMOID_RANK>::map_active( sum );
+            case HINGE_SMOOTH      : return ActiveFunc<HINGE_SMOOTH>::map_active( sum );
+            case HINGE_L2          : return ActiveFunc<HINGE_L2>::map_active( sum );
+            case SIGMOID_QSGRAD    : return ActiveFunc<SIGMOID_QSGRAD>::map_active( sum );
             default:apex_utils::error("unkown active type"); return 0.0f;
             }                
         } 
+        /*! 
+         * \brief map a batch of inputs by the activation function, sigmoid is done by fast_exp
+         * \param p the input data, replaced by the output
+         * \param n number of inputs
+         * \param type type of loss and activation function
+         */
+        inline void map_active( float *p, size_t n, int type ){
+            if( type == SIGMOID_L2 || type == SIGMOID_LIKELIHOOD ){
+                sigmoid( p, n ); return;
+            }
+            for( size_t i = 0; i < n; i ++ ) p[i] = map_active( p[i], type );
+        }
         /*! 
          * \brief calculate the gradiant of obj to maximize given the prediction and true label
          *    can be used by the solver during training calculation
@@ -128,29 +268,17 @@ namespace apex_svd{
          * \param pred predicted value 
          * \param type type of activation function and loss
          * \return gradient value 
+         * \sa ActiveFunc
          */        
         inline float cal_grad( float r, float pred, int type ){
             switch( type ){
-            case LINEAR: return r - pred;
-            case SIGMOID_L2: return ( r - pred ) * pred * ( 1 - pred ); 
-            case SIGMOID_LIKELIHOOD: return r - pred;
-            case SIGMOID_QSGRAD    : 
-            case SIGMOID_RANK      : return r - 1.0f/(1.0f+expf(-pred));
-            case HINGE_SMOOTH : 
-                {
-                    if( r > 0.5f ) return smooth_hinge_grad( pred-0.5f );
-                    else return - smooth_hinge_grad( 0.5f - pred );
-                }
-            case HINGE_L2:
-                {
-                    if( r > 0.5f ){
-                        if( pred > 1.0f ) return 0.0f;
-                        else return r - pred;
-                    }else{
-                        if( pred < 0.0f ) return 0.0f;
-                        else return r - pred;
-                    }
-                }
+            case LINEAR            : return ActiveFunc<LINEAR>::cal_grad( r, pred );
+            case SIGMOID_L2        : return ActiveFunc<SIGMOID_L2>::cal_grad( r, pred );
+            case SIGMOID_LIKELIHOOD: return ActiveFunc<SIGMOID_LIKELIHOOD>::cal_grad( r, pred );
+            case SIGMOID_QSGRAD    : return ActiveFunc<SIGMOID_QSGRAD>::cal_grad( r, pred );
+            case SIGMOID_RANK      : return ActiveFunc<SIGMOID_RANK>::cal_grad( r, pred );
+            case HINGE_SMOOTH      : return ActiveFunc<HINGE_SMOOTH>::cal_grad( r, pred );
+            case HINGE_L2          : return ActiveFunc<HINGE_L2>::cal_grad( r, pred );
             default:apex_utils::error("unkown active type"); return 0.0f;
             }                
         }
@@ -166,7 +294,7 @@ namespace apex_svd{
             case active_type::LINEAR: 
             case active_type::SIGMOID_L2: return 0.5 * sqr( r- pred );
             case active_type::SIGMOID_QSGRAD:
-            case active_type::SIGMOID_RANK: pred = 1.0f / (1.0f+expf( - pred ));
+            case active_type::SIGMOID_RANK: pred = sigmoid( pred );
             case active_type::SIGMOID_LIKELIHOOD: return - r * logf( pred ) - (1.0f-r)*logf( pred );
             case active_type::HINGE_SMOOTH : {
                 pred -= 0.5f;
@@ -202,7 +330,7 @@ namespace apex_svd{
             case LINEAR: return - 1.0f;
             case SIGMOID_LIKELIHOOD: return - pred * ( 1.0f - pred );
             case SIGMOID_RANK      : {
-                pred = 1.0f/(1.0f+expf(-pred));
+                pred = sigmoid( pred );
                 return - pred * ( 1.0f - pred );
             }
             case HINGE_SMOOTH  :
@@ -330,8 +458,11 @@ namespace apex_svd{
         float wd_ufeedback;
         /*! \brief weight decay for user feedback bias, for regularization */
         float wd_ufeedback_bias;       
+        /*! \brief model rows of the sample prefetch_distance rows ahead in a block are prefetched, 0 means no prefetch */
+        int prefetch_distance;
         /*! \brief constructor, set the default values */
         SVDTrainParam( void ){
+            prefetch_distance = 0;
             learning_rate = 0.01f;
             reg_method = 0;           
             wd_user = wd_item = 0.0f;           
@@ -365,6 +496,7 @@ namespace apex_svd{
             if( !strcmp("scale_lr_ufeedback" , name ) )   scale_lr_ufeedback = (float)atof( val );
             if( !strcmp("wd_ufeedback" , name ) )         wd_ufeedback = (float)atof( val );
             if( !strcmp("wd_ufeedback_bias" , name ) )    wd_ufeedback_bias = (float)atof( val );
+            if( !strcmp("prefetch_distance" , name ) )    prefetch_distance = atoi( val );
         }        
     };
     /*! 
@@ -430,8 +562,18 @@ namespace apex_svd{
         /*! \brief whether to only allow nonnegative item factors */
         int item_nonnegative;
 
+        /*! \brief whether feature id remapping follows the model data, see FeatureRemap */
+        int remap_flag;
+
+        /*! 
+         * \brief storage of user/item latent factors, 0: float, 1: fp16, 2: bf16, see apex_half::half_type,
+         *    16-bit storage halves the memory of the model, it is only supported for random order input
+         *    without common latent space
+         */
+        int factor_storage;
+
         /*! \brief reserved fields */
-        int reserved[247];
+        int reserved[245];
         /*! \brief constructor, set the default values */
         SVDModelParam( void ){
             num_user = num_item = num_global = num_factor = 0;
@@ -446,6 +588,8 @@ namespace apex_svd{
             item_nonnegative = 0;
             common_feedback_space = 0;
             extend_flag = 0;
+            remap_flag = 0;
+            factor_storage = 0;
             memset( reserved, 0, sizeof(reserved) );
         }
         /*! 
@@ -458,6 +602,10 @@ namespace apex_svd{
             if( !strcmp("num_item"  , name ) )    num_item     = atoi( val );
             if( !strcmp("num_uiset"  , name ) )   num_user = num_item = atoi( val );
             if( !strcmp("num_global", name ) )    num_global   = atoi( val );       
+            // size of hash tables of the input is also the size of the model
+            if( !strcmp("hash_global", name ) )   num_global   = static_cast<int>( FeatureHasher::parse_size( val ) );
+            if( !strcmp("hash_user"  , name ) )   num_user     = static_cast<int>( FeatureHasher::parse_size( val ) );
+            if( !strcmp("hash_item"  , name ) )   num_item     = static_cast<int>( FeatureHasher::parse_size( val ) );
             if( !strcmp("num_factor" , name ) )   num_factor   = atoi( val );       
             if( !strcmp("u_init_sigma", name ) )  u_init_sigma = (float)atof( val );
             if( !strcmp("i_init_sigma", name ) )  i_init_sigma = (float)atof( val );
@@ -473,8 +621,89 @@ namespace apex_svd{
             if( !strcmp("common_feedback_space", name ) )  common_feedback_space = atoi( val );
             if( !strcmp("user_nonnegative", name ) )  user_nonnegative = atoi( val );
             if( !strcmp("item_nonnegative", name ) )  item_nonnegative = atoi( val );
+            if( !strcmp("factor_storage", name ) )    factor_storage = atoi( val );
         }                
     };
+    /*! 
+     * \brief parallel random initializer of latent factor matrix,
+     *   row r of a matrix is drawn from the stream keyed by (seed, tag, r),
+     *   so the result is the same for any number of threads, 
+     *   each thread also first touches the rows it initializes
+     */
+    class FactorInitializer{
+    private:
+        struct Task{
+            apex_tensor::CTensor2D W;
+            int   row_begin, row_end;
+            // row y is drawn as row y + key_offset of the whole matrix
+            int   key_offset;
+            // number of rows that are randomly initialized, remaining rows are set to 0
+            int   num_rand;
+            int   nonnegative;
+            float sigma;
+            uint32_t tag;
+            inline void run( void ){
+                for( int y = row_begin; y < row_end; y ++ ){
+                    apex_tensor::CTensor1D w = W[ y ];
+                    if( y + key_offset >= num_rand ){
+                        w = 0.0f; continue;
+                    }
+                    apex_random::RandomStream rnd = apex_random::task_stream( tag, static_cast<uint64_t>( y + key_offset ) );
+                    for( int x = 0; x < w.x_max; x ++ ){
+                        float v = static_cast<float>( rnd.sample_normal() ) * sigma;
+                        w[ x ] = nonnegative ? fabsf( v ) : v;
+                    }
+                }
+            }
+        };
+        inline static APEX_THREAD_PREFIX task_entry( void *p ){
+            static_cast<Task*>( p )->run();
+            apex_thread::thread_exit( NULL );
+            return NULL;
+        }
+    public:
+        /*!
+         * \brief initialize W with N(0,sigma^2) 
+         * \param W matrix to be initialized
+         * \param num_rand number of first rows to be randomly initialized, the remaining rows are set to 0, 0 means all rows
+         * \param sigma standard variance
+         * \param nonnegative whether take absolute value
+         * \param tag tag of the matrix, different matrix shall use different tag
+         * \param nthread number of threads used
+         * \param row_begin only rows from row_begin are initialized, used when the matrix grows
+         * \param key_offset W holds rows from key_offset of the whole matrix, used to initialize a matrix block by block
+         */
+        inline static void init( apex_tensor::CTensor2D W, int num_rand, float sigma, int nonnegative, uint32_t tag, int nthread, 
+                                 int row_begin = 0, int key_offset = 0 ){
+            if( num_rand == 0 ) num_rand = INT_MAX;
+            const int nrow = W.y_max - row_begin;
+            if( nrow <= 0 ) return;
+            if( nthread > nrow ) nthread = nrow;
+            if( nthread < 1 ) nthread = 1;
+            std::vector<Task> tasks( nthread );
+            for( int i = 0; i < nthread; i ++ ){
+                tasks[i].W = W;
+                tasks[i].row_begin = row_begin + static_cast<int>( static_cast<long long>( nrow ) * i / nthread );
+                tasks[i].row_end   = row_begin + static_cast<int>( static_cast<long long>( nrow ) * (i+1) / nthread );
+                tasks[i].key_offset = key_offset;
+                tasks[i].num_rand  = num_rand;
+                tasks[i].sigma     = sigma;
+                tasks[i].nonnegative = nonnegative;
+                tasks[i].tag       = tag;
+            }
+            if( nthread == 1 ){
+                tasks[0].run(); return;
+            }
+            std::vector<apex_thread::Thread> threads( nthread );
+            for( int i = 0; i < nthread; i ++ ){
+                threads[i].start( task_entry, &tasks[i] );
+            }
+            for( int i = 0; i < nthread; i ++ ){
+                threads[i].join();
+            }
+        }
+    };
+
     /*! 
      * \brief default model for SVDFeature
      */    
@@ -499,22 +728,91 @@ namespace apex_svd{
         apex_tensor::CTensor2D W_item;
         /*! \brief global bias */
         apex_tensor::CTensor1D g_bias;
+        /*! \brief space of global bias, g_bias is its head */
+        apex_tensor::CTensor1D g_space;
         /*! \brief user feedback bias */
         apex_tensor::CTensor1D ufeedback_bias;
         /*! \brief user feedback latent factor */
         apex_tensor::CTensor2D W_ufeedback;        
+        /*! 
+         * \brief 16-bit user/item latent factor, used when param.factor_storage != 0, 
+         *    W_uiset, W_user and W_item then only keep the shape and have no space
+         */
+        apex_half::HTensor2D H_uiset, H_user, H_item;
+        /*! \brief id remapping of the input, saved only when param.remap_flag is set */
+        FeatureRemap remap;
+        /*! \brief number of threads used in rand_init, not saved in model file */
+        int rand_init_nthread;
+        /*! \brief number of rows reserved for user, item and global feature, not less than num_*, not saved in model file */
+        int cap_user, cap_item, cap_global;
+        /*! 
+         * \brief memory in MB used to cache user latent factors, can be fractional, 0 means all of them are in memory,
+         *    otherwise W_user has no space, the rows are kept in file page_user_file and accessed through P_user, 
+         *    not saved in model file
+         */
+        float page_user_mb;
+        /*! \brief number of user rows loaded and evicted together, not saved in model file */
+        int page_block_rows;
+        /*! 
+         * \brief file that keeps user latent factors when page_user_mb > 0, removed when model is freed,
+         *    an existing file is never overwritten, "NULL" means an anonymous temporary file
+         */
+        char page_user_file[ 256 ];
+        /*! \brief user latent factor kept in file, used when page_user_mb > 0 */
+        mutable apex_utils::RowCache P_user;
         /*! \brief constructor */
         SVDModel( void ){
             space_allocated = 0;
+            rand_init_nthread = 1;
+            cap_user = cap_item = cap_global = 0;
+            page_user_mb = 0.0f;
+            page_block_rows = 256;
+            strcpy( page_user_file, "NULL" );
         }
-        /*! \brief allocated space for a given model parameter */
-        inline void alloc_space( void ){
+        /*! \brief whether latent factors are stored in 16 bits */
+        inline bool half_factor( void ) const{
+            return param.factor_storage != apex_half::half_type::FP32;
+        }
+        /*! \brief whether user latent factors are kept in file */
+        inline bool paged_user( void ) const{
+            return page_user_mb > 0.0f;
+        }
+    private:
+        // allocate user/item space with reserved rows, views are set for current number of rows
+        // number of user feedback rows in front of user rows
+        inline int ufeedback_rows( void ) const{
+            return ( param.common_feedback_space == 0 && mtype.format_type == svd_type::USER_GROUP_FORMAT ) ? param.num_ufeedback : 0; 
+        }
+        inline void alloc_uiset( void ){
+            if( this->half_factor() ){
+                apex_utils::assert_true( param.factor_storage == apex_half::half_type::FP16 || 
+                                         param.factor_storage == apex_half::half_type::BF16, "unknown factor_storage" );
+                apex_utils::assert_true( param.common_latent_space == 0 && mtype.format_type != svd_type::USER_GROUP_FORMAT, 
+                                         "16-bit factor_storage only supports random order input without common latent space" );
+                ui_bias.set_param( cap_user + cap_item );
+                H_uiset.set_param( cap_user + cap_item, param.num_factor );
+                apex_tensor::tensor::alloc_space( ui_bias );
+                apex_half::alloc_space( H_uiset );
+                this->set_uiset_view();
+                return;
+            }
+            if( this->paged_user() ){
+                apex_utils::assert_true( param.common_latent_space == 0 && mtype.format_type != svd_type::USER_GROUP_FORMAT, 
+                                         "page_user_mb only supports random order input without common latent space" );
+                // only item rows are in memory
+                ui_bias.set_param( cap_user + cap_item );
+                W_uiset.set_param( cap_item, param.num_factor );
+                apex_tensor::tensor::alloc_space( ui_bias );
+                apex_tensor::tensor::alloc_space( W_uiset );
+                this->set_uiset_view();
+                return;
+            }
             {// allocate space for user/item factor
-                const int ustart = ( param.common_feedback_space == 0 && mtype.format_type == svd_type::USER_GROUP_FORMAT ) ? param.num_ufeedback : 0; 
+                const int ustart = this->ufeedback_rows();
 
                 if( param.common_latent_space == 0 ){ 
-                    ui_bias.set_param( ustart + param.num_user + param.num_item );
-                    W_uiset.set_param( ustart + param.num_user + param.num_item, param.num_factor );
+                    ui_bias.set_param( ustart + cap_user + cap_item );
+                    W_uiset.set_param( ustart + cap_user + cap_item, param.num_factor );
                 }else{
                     apex_utils::assert_true( param.num_user == param.num_item, 
                                              "num_user and num_item must be the same to use common latent space" );
@@ -525,23 +823,40 @@ namespace apex_svd{
                                 
                 apex_tensor::tensor::alloc_space( ui_bias );
                 apex_tensor::tensor::alloc_space( W_uiset );
-
-
-                if( param.common_latent_space == 0 ){                         
-                    u_bias = ui_bias.sub_area( ustart, param.num_user );
-                    W_user = W_uiset.sub_area( ustart, 0, param.num_user, param.num_factor );
-                    i_bias = ui_bias.sub_area( param.num_user + ustart, param.num_item );
-                    W_item = W_uiset.sub_area( param.num_user + ustart, 0, param.num_item, param.num_factor );
-                }else{
-                    W_user = W_uiset.sub_area( ustart, 0, param.num_user, param.num_factor ); 
-                    u_bias = ui_bias.sub_area( ustart, param.num_user ); 
-                    W_item = W_user;
-                    i_bias = u_bias;
-                }
             }
-            {
-                g_bias.set_param( param.num_global );
-                apex_tensor::tensor::alloc_space( g_bias );            
+            this->set_uiset_view();
+        }
+        // point the user/item/feedback views into the user/item space
+        inline void set_uiset_view( void ){
+            if( this->half_factor() ){
+                u_bias = ui_bias.sub_area( 0, param.num_user );
+                i_bias = ui_bias.sub_area( cap_user, param.num_item );
+                H_user = H_uiset.sub_area( 0, param.num_user );
+                H_item = H_uiset.sub_area( cap_user, param.num_item );
+                W_user.set_param( param.num_user, param.num_factor );
+                W_item.set_param( param.num_item, param.num_factor );
+                W_user.elem = W_item.elem = NULL;
+                return;
+            }
+            if( this->paged_user() ){
+                u_bias = ui_bias.sub_area( 0, param.num_user );
+                i_bias = ui_bias.sub_area( cap_user, param.num_item );
+                W_item = W_uiset.sub_area( 0, 0, param.num_item, param.num_factor );
+                W_user.set_param( param.num_user, param.num_factor );
+                W_user.elem = NULL;
+                return;
+            }
+            const int ustart = this->ufeedback_rows();
+            if( param.common_latent_space == 0 ){                         
+                u_bias = ui_bias.sub_area( ustart, param.num_user );
+                W_user = W_uiset.sub_area( ustart, 0, param.num_user, param.num_factor );
+                i_bias = ui_bias.sub_area( cap_user + ustart, param.num_item );
+                W_item = W_uiset.sub_area( cap_user + ustart, 0, param.num_item, param.num_factor );
+            }else{
+                W_user = W_uiset.sub_area( ustart, 0, param.num_user, param.num_factor ); 
+                u_bias = ui_bias.sub_area( ustart, param.num_user ); 
+                W_item = W_user;
+                i_bias = u_bias;
             }
             if( mtype.format_type == svd_type::USER_GROUP_FORMAT ){
                 if( param.common_feedback_space == 0 ){
@@ -552,28 +867,218 @@ namespace apex_svd{
                     W_ufeedback = W_user;
                 }
             }
+        }
+        inline void alloc_global( void ){
+            g_space.set_param( cap_global );
+            apex_tensor::tensor::alloc_space( g_space );
+            g_bias = g_space.sub_area( 0, param.num_global );
+        }
+        // initialize rows [row_begin,num_row) of 16-bit rows H, or of rows in file P when H is NULL, block by block,
+        // same values as FactorInitializer gives to float rows before rounding
+        inline void init_rows( apex_half::HTensor2D *H, apex_utils::RowCache *P, int num_row, 
+                               int num_rand, float sigma, int nonnegative, uint32_t tag, int row_begin ){
+            if( row_begin >= num_row ) return;
+            apex_tensor::CTensor2D tmp( std::min( num_row - row_begin, 1 << 16 ), param.num_factor );
+            apex_tensor::tensor::alloc_space( tmp );
+            for( int y = row_begin; y < num_row; y += tmp.y_max ){
+                apex_tensor::CTensor2D blk = tmp.sub_area( 0, 0, std::min( tmp.y_max, num_row - y ), param.num_factor );
+                FactorInitializer::init( blk, num_rand, sigma, nonnegative, tag, rand_init_nthread, 0, y );
+                for( int i = 0; i < blk.y_max; i ++ ){
+                    if( H != NULL ){
+                        apex_half::encode( (*H)[ y + i ], blk[ i ].elem, param.num_factor, param.factor_storage );
+                    }else{
+                        P->write_row( y + i, blk[ i ].elem );
+                    }
+                }
+            }
+            apex_tensor::tensor::free_space( tmp );
+        }
+        // open the file of user rows
+        inline void open_page( void ){
+            apex_utils::assert_true( !this->half_factor(), "page_user_mb can not be used with 16-bit factor_storage" );
+            P_user.open( page_user_file, param.num_factor, page_block_rows, static_cast<size_t>( page_user_mb * ( 1 << 20 ) ) );
+            P_user.resize( cap_user );
+        }
+        // load user rows into file, same format as W_user
+        inline void load_paged( FILE *fi ){
+            int shape[2];
+            apex_utils::assert_true( fread( shape, sizeof(int), 2, fi ) == 2, "load paged user factor" );
+            apex_utils::assert_true( shape[0] == param.num_factor && shape[1] == param.num_user, "paged user factor: shape mismatch" );
+            std::vector<float> tmp( param.num_factor );
+            for( int y = 0; y < param.num_user; y ++ ){
+                if( param.num_factor == 0 ) break;
+                apex_utils::assert_true( fread( &tmp[0], sizeof(float), param.num_factor, fi ) == (size_t)param.num_factor, 
+                                         "load paged user factor" );
+                P_user.write_row( y, &tmp[0] );
+            }
+        }
+        // save user rows in file, same format as W_user
+        inline void save_paged( FILE *fo ) const{
+            const int shape[2] = { param.num_factor, param.num_user };
+            fwrite( shape, sizeof(int), 2, fo );
+            std::vector<float> tmp( param.num_factor );
+            for( int y = 0; y < param.num_user; y ++ ){
+                if( param.num_factor == 0 ) break;
+                P_user.read_row( y, &tmp[0] );
+                fwrite( &tmp[0], sizeof(float), param.num_factor, fo );
+            }
+        }
+    public:
+        /*! \brief allocated space for a given model parameter */
+        inline void alloc_space( void ){
+            cap_user = param.num_user; cap_item = param.num_item; cap_global = param.num_global;
+            if( this->paged_user() ) this->open_page();
+            this->alloc_uiset();
+            this->alloc_global();
             space_allocated = 1; 
         }
+        // rows to reserve to hold need rows, the reserved rows are doubled but kept within limit
+        inline static int reserve_rows( int need, int cap, long long limit ){
+            if( need <= cap ) return cap;
+            apex_utils::assert_true( need <= limit, "model can not grow beyond INT_MAX rows of feedback, user and item" );
+            return static_cast<int>( std::min( std::max( static_cast<long long>( need ), static_cast<long long>( cap ) * 2 ), limit ) );
+        }
+        /*!
+         * \brief grow the model to hold at least num_user users, num_item items and num_global global features,
+         *   rows are reserved geometrically, so the rows move only when the reserved rows run out,
+         *   new rows are initialized in the same way as rand_init initializes a model of the grown size
+         */
+        inline void grow( int num_user, int num_item, int num_global ){
+            apex_utils::assert_true( space_allocated != 0 && param.common_latent_space == 0, 
+                                     "model can only grow after allocation and without common latent space" );
+            const int nu = std::max( num_user, param.num_user );
+            const int ni = std::max( num_item, param.num_item );
+            const int ng = std::max( num_global, param.num_global );
+            int ncap_user = cap_user, ncap_item = cap_item;
+            if( nu > cap_user || ni > cap_item ){
+                // feedback, user and item rows are in one table indexed by int
+                const long long ustart = this->ufeedback_rows();
+                ncap_user = reserve_rows( nu, cap_user, INT_MAX - ustart - std::max( ni, cap_item ) );
+                ncap_item = reserve_rows( ni, cap_item, INT_MAX - ustart - ncap_user );
+            }
+            if( ( nu > cap_user || ni > cap_item ) && this->half_factor() ){
+                apex_tensor::CTensor1D o_ui_bias = ui_bias, o_u_bias = u_bias, o_i_bias = i_bias;
+                apex_half::HTensor2D o_H_uiset = H_uiset, o_H_user = H_user, o_H_item = H_item;
+                cap_user = ncap_user; cap_item = ncap_item;
+                this->alloc_uiset();
+                apex_tensor::tensor::copy( u_bias, o_u_bias );
+                apex_tensor::tensor::copy( i_bias, o_i_bias );
+                apex_half::copy( H_user, o_H_user );
+                apex_half::copy( H_item, o_H_item );
+                apex_tensor::tensor::free_space( o_ui_bias );
+                apex_half::free_space( o_H_uiset );
+            }
+            if( ( nu > cap_user || ni > cap_item ) && !this->half_factor() ){
+                apex_tensor::CTensor1D o_ui_bias = ui_bias, o_u_bias = u_bias, o_i_bias = i_bias;
+                apex_tensor::CTensor2D o_W_uiset = W_uiset, o_W_user = W_user, o_W_item = W_item;
+                cap_user = ncap_user; cap_item = ncap_item;
+                this->alloc_uiset();
+                // user feedback rows in front of user rows are kept
+                const int ustart = this->ufeedback_rows();
+                if( ustart != 0 ){
+                    apex_tensor::CTensor1D fb = ui_bias.sub_area( 0, ustart );
+                    apex_tensor::CTensor2D Wfb = W_uiset.sub_area( 0, 0, ustart, param.num_factor );
+                    apex_tensor::tensor::copy( fb, o_ui_bias.sub_area( 0, ustart ) );
+                    apex_tensor::tensor::copy( Wfb, o_W_uiset.sub_area( 0, 0, ustart, param.num_factor ) );
+                }
+                apex_tensor::tensor::copy( u_bias, o_u_bias );
+                if( this->paged_user() ){
+                    P_user.resize( cap_user );
+                }else{
+                    apex_tensor::tensor::copy( W_user, o_W_user );
+                }
+                apex_tensor::tensor::copy( i_bias, o_i_bias );
+                apex_tensor::tensor::copy( W_item, o_W_item );
+                apex_tensor::tensor::free_space( o_ui_bias );
+                apex_tensor::tensor::free_space( o_W_uiset );
+            }
+            if( ng > cap_global ){
+                apex_tensor::CTensor1D o_g_space = g_space, o_g_bias = g_bias;
+                cap_global = reserve_rows( ng, cap_global, INT_MAX );
+                this->alloc_global();
+                apex_tensor::tensor::copy( g_bias, o_g_bias );
+                apex_tensor::tensor::free_space( o_g_space );
+            }
+            const int ou = param.num_user, oi = param.num_item, og = param.num_global;
+            param.num_user = nu; param.num_item = ni; param.num_global = ng;
+            this->set_uiset_view();
+            g_bias = g_space.sub_area( 0, ng );
+            // initialize new rows, same as rand_init
+            u_bias.sub_area( ou, nu - ou ) = 0.0f;
+            i_bias.sub_area( oi, ni - oi ) = 0.0f;
+            g_bias.sub_area( og, ng - og ) = 0.0f;
+            if( this->half_factor() ){
+                this->init_rows( &H_user, NULL, nu, param.num_randinit_ufactor, param.u_init_sigma, param.user_nonnegative, 1, ou );
+                this->init_rows( &H_item, NULL, ni, param.num_randinit_ifactor, param.i_init_sigma, param.item_nonnegative, 2, oi );
+                return;
+            }
+            if( this->paged_user() ){
+                this->init_rows( NULL, &P_user, nu, param.num_randinit_ufactor, param.u_init_sigma, param.user_nonnegative, 1, ou );
+                FactorInitializer::init( W_item, param.num_randinit_ifactor, param.i_init_sigma, 
+                                         param.item_nonnegative, 2, rand_init_nthread, oi );
+                return;
+            }
+            FactorInitializer::init( W_user, param.num_randinit_ufactor, param.u_init_sigma, 
+                                     param.user_nonnegative, 1, rand_init_nthread, ou );
+            FactorInitializer::init( W_item, param.num_randinit_ifactor, param.i_init_sigma, 
+                                     param.item_nonnegative, 2, rand_init_nthread, oi );
+        }
         /*! \brief free space of the model */
         inline void free_space( void ){           
             if( space_allocated == 0 ) return;
             apex_tensor::tensor::free_space( ui_bias );
-            apex_tensor::tensor::free_space( W_uiset );            
-            apex_tensor::tensor::free_space( g_bias );
+            if( this->half_factor() ){
+                apex_half::free_space( H_uiset );
+            }else{
+                apex_tensor::tensor::free_space( W_uiset );            
+            }
+            P_user.close();
+            apex_tensor::tensor::free_space( g_space );
 
             space_allocated = 0;
         }
+        /*! \brief convert 16-bit latent factors to float, for solvers that only work on float factors */
+        inline void to_float( void ){
+            if( !this->half_factor() ) return;
+            apex_tensor::CTensor1D o_ui_bias = ui_bias;
+            apex_half::HTensor2D o_H_uiset = H_uiset, o_H_user = H_user, o_H_item = H_item;
+            const int type = param.factor_storage;
+            param.factor_storage = apex_half::half_type::FP32;
+            this->alloc_uiset();
+            apex_tensor::tensor::copy( ui_bias, o_ui_bias );
+            for( int i = 0; i < param.num_user; i ++ ){
+                apex_half::decode( W_user[ i ].elem, o_H_user[ i ], param.num_factor, type );
+            }
+            for( int i = 0; i < param.num_item; i ++ ){
+                apex_half::decode( W_item[ i ].elem, o_H_item[ i ], param.num_factor, type );
+            }
+            apex_tensor::tensor::free_space( o_ui_bias );
+            apex_half::free_space( o_H_uiset );
+        }
         /*! 
          * \brief load the model from binary file, no space allocation is needed before loading
          * \param fi pointer to input file
          */
         inline void load_from_file( FILE *fi ){            
-            if( fread( &param, sizeof(SVDModelParam) , 1 , fi ) == 0 ){
+            SVDModelParam p;
+            if( fread( &p, sizeof(SVDModelParam) , 1 , fi ) == 0 ){
                 printf("error loading CF SVD model\n"); exit( -1 );
             }
+            // space is freed according to the setting it was allocated with
             if( space_allocated != 0 ) this->free_space();
+            param = p;
             this->alloc_space();
-            {// handle for common latent space, a bit complex for compatible issue
+            if( this->half_factor() ){
+                apex_tensor::cpu_only::load_from_file( u_bias, fi, true );
+                apex_half::load_from_file( H_user, fi );
+                apex_tensor::cpu_only::load_from_file( i_bias, fi, true );
+                apex_half::load_from_file( H_item, fi );
+            }else if( this->paged_user() ){
+                apex_tensor::cpu_only::load_from_file( u_bias, fi, true );
+                this->load_paged( fi );
+                apex_tensor::cpu_only::load_from_file( i_bias, fi, true );
+                apex_tensor::cpu_only::load_from_file( W_item, fi, true );
+            }else{// handle for common latent space, a bit complex for compatible issue
                 if( param.common_latent_space == 0 ){
                     apex_tensor::cpu_only::load_from_file( u_bias, fi, true );
                     apex_tensor::cpu_only::load_from_file( W_user, fi, true );
@@ -629,6 +1134,9 @@ namespace apex_svd{
                     apex_tensor::cpu_only::load_from_file( W_ufeedback, fi, true );
                 }
             }
+            if( param.remap_flag != 0 ){
+                remap.load( fi );
+            }
             space_allocated = 1;
         }
         /*! 
@@ -637,7 +1145,17 @@ namespace apex_svd{
          */
         inline void save_to_file( FILE *fo ) const{
             fwrite( &param, sizeof(SVDModelParam) , 1 , fo );
-            {// handle for common user/item latent space, make it compatible with previous format
+            if( this->half_factor() ){
+                apex_tensor::cpu_only::save_to_file( u_bias, fo );
+                apex_half::save_to_file( H_user, fo );
+                apex_tensor::cpu_only::save_to_file( i_bias, fo );
+                apex_half::save_to_file( H_item, fo );
+            }else if( this->paged_user() ){
+                apex_tensor::cpu_only::save_to_file( u_bias, fo );
+                this->save_paged( fo );
+                apex_tensor::cpu_only::save_to_file( i_bias, fo );
+                apex_tensor::cpu_only::save_to_file( W_item, fo );
+            }else{// handle for common user/item latent space, make it compatible with previous format
                 if( param.common_latent_space == 0 ){
                     apex_tensor::cpu_only::save_to_file( u_bias, fo );
                     apex_tensor::cpu_only::save_to_file( W_user, fo );
@@ -657,6 +1175,9 @@ namespace apex_svd{
                     apex_tensor::cpu_only::save_to_file( W_ufeedback, fo );
                 }
             }
+            if( param.remap_flag != 0 ){
+                remap.save( fo );
+            }
         }        
         /*! 
          * \brief random initialize the model parameters, 
@@ -666,41 +1187,27 @@ namespace apex_svd{
             ui_bias = 0.0f;
             g_bias  = 0.0f;
             param.base_score = active_type::calc_base_score( param.base_score, mtype.active_type );
-            {// initialize ufactor
-                apex_tensor::CTensor2D W_uinit;
-                if( param.num_randinit_ufactor != 0 ){ 
-                    W_uinit = W_user.sub_area( 0, 0, param.num_randinit_ufactor, W_user.x_max );
-                }else{
-                    W_uinit = W_user;
-                }
-                apex_tensor::tensor::sample_gaussian( W_uinit, param.u_init_sigma );
-                // fix for non negative weight
-                if( param.user_nonnegative ){
-                    for( int y = 0; y < W_user.y_max; y ++ )
-                        for( int x = 0; x < W_user.x_max; x ++ )
-                            W_user[ y ][ x ] = fabsf( W_user[y][x] );
-                }            
-            }                
+            if( this->half_factor() ){
+                this->init_rows( &H_user, NULL, param.num_user, param.num_randinit_ufactor, param.u_init_sigma, param.user_nonnegative, 1, 0 );
+                this->init_rows( &H_item, NULL, param.num_item, param.num_randinit_ifactor, param.i_init_sigma, param.item_nonnegative, 2, 0 );
+                return;
+            }
+            // initialize ufactor
+            if( this->paged_user() ){
+                this->init_rows( NULL, &P_user, param.num_user, param.num_randinit_ufactor, param.u_init_sigma, param.user_nonnegative, 1, 0 );
+            }else{
+                FactorInitializer::init( W_user, param.num_randinit_ufactor, param.u_init_sigma, 
+                                         param.user_nonnegative, 1, rand_init_nthread );
+            }
             // only need to initialize once in common latent space
             if( param.common_latent_space == 0 ){
                 // initialize ifactor
-                apex_tensor::CTensor2D W_iinit;
-                if( param.num_randinit_ifactor != 0 ){ 
-                    W_iinit = W_item.sub_area( 0, 0, param.num_randinit_ifactor, W_item.x_max );
-                }else{
-                    W_iinit = W_item;
-                }
-                apex_tensor::tensor::sample_gaussian( W_iinit, param.i_init_sigma );
-                // fix for non negative weight
-                if( param.item_nonnegative ){
-                    for( int y = 0; y < W_iinit.y_max; y ++ )
-                        for( int x = 0; x < W_iinit.x_max; x ++ )
-                            W_iinit[ y ][ x ] = fabsf( W_iinit[y][x] );
-                }
+                FactorInitializer::init( W_item, param.num_randinit_ifactor, param.i_init_sigma, 
+                                         param.item_nonnegative, 2, rand_init_nthread );
             }
 
             if( mtype.format_type == svd_type::USER_GROUP_FORMAT ){
-                apex_tensor::tensor::sample_gaussian( W_ufeedback, param.ufeedback_init_sigma );
+                FactorInitializer::init( W_ufeedback, 0, param.ufeedback_init_sigma, 0, 3, rand_init_nthread );
             }
         }        
     };    
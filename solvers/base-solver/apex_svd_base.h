@@ -21,7 +21,10 @@
 #define _APEX_SVD_BASE_H_
 
 #include "../../apex_svd.h"
+#include "../../apex-tensor/apex_tensor_int8.h"
 #include <cstring>
+#include <climits>
+#include <cmath>
 
 namespace apex_svd{
     using namespace apex_tensor;
@@ -29,6 +32,55 @@ namespace apex_svd{
 };
 
 namespace apex_svd{
+    // regularization coefficients of a range of feature index, compiled from the configuration
+    struct RegCoef{
+        // power table of decay is split in two levels, (1-lambda)^k = pow_lo[ low bits of k ] * pow_hi[ high bits of k ]
+        static const int kPowBits = 10;
+        static const unsigned kPowSize = 1U << kPowBits;
+        // weight decay
+        float wd;
+        // learning_rate * wd
+        float lambda;
+        // 1 - lambda
+        float decay;
+        float pow_lo[ kPowSize ], pow_hi[ kPowSize ];
+        inline void init( float wd, float learning_rate ){
+            this->wd = wd;
+            this->lambda = learning_rate * wd;
+            this->decay  = 1.0f - lambda;
+            for( unsigned i = 0; i < kPowSize; i ++ ){
+                pow_lo[ i ] = static_cast<float>( pow( static_cast<double>( decay ), static_cast<double>( i ) ) );
+                pow_hi[ i ] = static_cast<float>( pow( static_cast<double>( decay ), static_cast<double>( i << kPowBits ) ) );
+            }
+        }
+        // (1-lambda)^k, used by lazy L2 decay
+        inline float pow_decay( unsigned k ) const{
+            if( k < kPowSize * kPowSize ) return pow_lo[ k & ( kPowSize - 1 ) ] * pow_hi[ k >> kPowBits ];
+            return expf( logf( decay ) * static_cast<float>( k ) );
+        }
+    };
+    // flat table of regularization coefficients of each index range
+    class RegPlan{
+    private:
+        // last index of each range
+        std::vector<unsigned> bound;
+        std::vector<RegCoef>  coef;
+    public:
+        inline void clear( void ){
+            bound.clear(); coef.clear();
+        }
+        inline void add_range( unsigned last, float wd, float learning_rate ){
+            bound.push_back( last );
+            coef.resize( coef.size() + 1 );
+            coef.back().init( wd, learning_rate );
+        }
+        inline const RegCoef &operator[]( unsigned id ) const{
+            size_t i = 0;
+            while( i < bound.size() && id > bound[i] ) i ++;
+            apex_utils::assert_true( i < bound.size(), "bound set err" );
+            return coef[ i ];
+        }
+    };
     // parameter set, used for detailed tuning
     class ParameterSet{
     private:
@@ -72,6 +124,16 @@ namespace apex_svd{
             apex_utils::assert_true( idx < bound.size() , "bound set err" );
             return wd[ idx ];
         }
+        // compile the setting into flat table, wd_default is used when no range is given
+        inline void compile( RegPlan &plan, float wd_default, float learning_rate ) const{
+            plan.clear();
+            if( bound.size() == 0 ){
+                plan.add_range( UINT_MAX, wd_default, learning_rate ); return;
+            }
+            for( size_t i = 0; i < bound.size(); i ++ ){
+                plan.add_range( bound[i], wd[i], learning_rate );
+            }
+        }
     };
 };
 // this file defines the main algorithm of toolkit
@@ -85,11 +147,39 @@ namespace apex_svd{
         CTensor1D tmp_ufactor, tmp_ifactor;
         // extend hierachical feature associated with each user/item
         SparseFeatureArray<float> feat_user, feat_item;
+    private:
+        // factor row touched by a sample, gathered once in pred_raw and reused by update_no_decay
+        struct RowRef{
+            CTensor1D row;
+            float *bias;
+            // weight of the feature, iv is the weight of the item it extends, 1 otherwise
+            float v, iv;
+        };
+        std::vector<RowRef> urows, irows;
+        // 16-bit factor rows or paged user rows touched by a sample are copied into the slots once, 
+        // and written back after the update, 16-bit rows are encoded with stochastic rounding
+        // key of a slot is row index * 2, plus 1 for item rows
+        std::vector<size_t> slot_key;
+        std::vector<CTensor1D> slot_row;
+        size_t num_slot;
+        // open addressing table from key to slot, slot_pos is the position of each slot in the table,
+        // an entry is in use only if the slot it points to is placed there, so it needs no clearing per sample
+        std::vector<size_t> slot_table, slot_pos;
+        apex_half::RoundRandom round_rnd;
+        // counters of paged user rows at the end of last round
+        apex_utils::RowCache::Stat page_stat;
     private:
         int round_counter;
     private:
         char name_feat_user[ 256 ];
         char name_feat_item[ 256 ];
+        // id remapping stored into the model, and whether to translate ids of predicted input with it
+        char name_remap[ 256 ];
+        int remap_input;
+        // whether to grow the model when a trained sample has feature index exceeding the setting
+        int grow_model;
+        // whether to be silent
+        int silent;
     protected:
         // data structure used for lazy decay
         unsigned sample_counter;
@@ -98,17 +188,45 @@ namespace apex_svd{
     private:
         // data structure for detail weight decay tuning
         ParameterSet u_param, i_param, g_param;
+        // regularization plan compiled from the setting, rebuilt when learning rate changes
+        RegPlan u_plan, i_plan, g_plan;
+        float u_bias_decay, i_bias_decay;
+        // regularization of the factors and global bias of a sample, chosen by compile_reg_plan
+        void (SVDFeature::*fn_reg_factor)( const SVDFeatureCSR::Elem &feature );
+        void (SVDFeature::*fn_reg_global)( const SVDFeatureCSR::Elem &feature );
+        // prediction and update of a sample, specialized for the active type at construction
+        float (SVDFeature::*fn_pred)( const SVDFeatureCSR::Elem &feature );
+        void (SVDFeature::*fn_update)( const SVDFeatureCSR::Elem &feature, float sample_weight );
     public:
         SVDFeature( const SVDTypeParam &mtype ):
             u_param("up:","uip:"),i_param("ip:","uip:"),g_param("gp:","gp:"){
             model.mtype = mtype;
+            switch( mtype.active_type ){
+            case active_type::LINEAR            : this->bind_active<active_type::LINEAR>(); break;
+            case active_type::SIGMOID_L2        : this->bind_active<active_type::SIGMOID_L2>(); break;
+            case active_type::SIGMOID_LIKELIHOOD: this->bind_active<active_type::SIGMOID_LIKELIHOOD>(); break;
+            case active_type::SIGMOID_RANK      : this->bind_active<active_type::SIGMOID_RANK>(); break;
+            case active_type::HINGE_SMOOTH      : this->bind_active<active_type::HINGE_SMOOTH>(); break;
+            case active_type::HINGE_L2          : this->bind_active<active_type::HINGE_L2>(); break;
+            case active_type::SIGMOID_QSGRAD    : this->bind_active<active_type::SIGMOID_QSGRAD>(); break;
+            default: apex_utils::error("unknown active type");
+            }
             strcpy( name_feat_user, "NULL" );
             strcpy( name_feat_item, "NULL" );
+            strcpy( name_remap, "NULL" );
+            this->remap_input = 0;
+            this->grow_model = 0;
+            this->silent = 0;
             this->round_counter = 0;
+            this->num_slot = 0;
+            this->round_rnd.seed( apex_random::task_stream( 4, 0 ) );
             this->init_end = 0;
         }
         virtual ~SVDFeature(){
             model.free_space();
+            for( size_t i = 0; i < slot_row.size(); i ++ ){
+                tensor::free_space( slot_row[i] );
+            }
             if( init_end == 0 ) return;
             tensor::free_space( tmp_ufactor );
             tensor::free_space( tmp_ifactor );
@@ -126,6 +244,16 @@ namespace apex_svd{
         virtual void set_param( const char *name, const char *val ){
             if( !strcmp( name,"feature_user" )) strcpy( name_feat_user  , val ); 
             if( !strcmp( name,"feature_item" )) strcpy( name_feat_item  , val ); 
+            if( !strcmp( name,"feature_remap" )) strcpy( name_remap, val );
+            if( !strcmp( name,"remap_input" )) remap_input = atoi( val );
+            if( !strcmp( name,"grow_model" )) grow_model = atoi( val );
+            if( !strcmp( name,"rand_init_nthread" )) model.rand_init_nthread = atoi( val );
+            if( !strcmp( name,"silent" )) silent = atoi( val );
+            if( model.space_allocated == 0 ){
+                if( !strcmp( name,"page_user_mb" )) model.page_user_mb = (float)atof( val );
+                if( !strcmp( name,"page_block_rows" )) model.page_block_rows = atoi( val );
+                if( !strcmp( name,"page_user_file" )) strcpy( model.page_user_file, val );
+            }
             param.set_param( name, val );
             u_param.set_param( name, val );
             i_param.set_param( name, val );
@@ -137,6 +265,8 @@ namespace apex_svd{
         // load model from file
         virtual void load_model( FILE *fi ) {
             model.load_from_file( fi );
+            // rows written while loading are not counted in the first round
+            if( model.paged_user() ) page_stat = model.P_user.get_stat();
         }
         // save model to file
         virtual void save_model( FILE *fo ) {
@@ -146,13 +276,30 @@ namespace apex_svd{
         virtual void init_model( void ){
             model.alloc_space();
             model.rand_init();
+            if( strcmp( name_remap, "NULL" ) ){
+                apex_utils::assert_true( model.mtype.format_type != svd_type::USER_GROUP_FORMAT, 
+                                         "feature_remap only supports random order input" );
+                FILE *fi = apex_utils::fopen_check( name_remap, "rb" );
+                model.remap.load( fi );
+                fclose( fi );
+                model.param.remap_flag = 1;
+            }
         }
         // initialize trainer before training 
         virtual void init_trainer( void ){
+            apex_utils::assert_true( model.param.remap_flag == 0 || 
+                                     ( !strcmp( name_feat_user, "NULL" ) && !strcmp( name_feat_item, "NULL" ) ), 
+                                     "feature_user/feature_item can not be used with remapped feature ids" );
+            apex_utils::assert_true( grow_model == 0 || 
+                                     ( model.mtype.format_type != svd_type::USER_GROUP_FORMAT && model.param.common_latent_space == 0 ),
+                                     "grow_model only supports random order input without common latent space" );
             if( strcmp( name_feat_user , "NULL") ) feat_user.load( name_feat_user );
             if( strcmp( name_feat_item , "NULL") ) feat_item.load( name_feat_item );
-            tmp_ufactor = clone( model.W_user[0] );
-            tmp_ifactor = clone( model.W_item[0] );
+            // factors of the model may be stored in 16 bits, only the shape is taken
+            tmp_ufactor.set_param( model.param.num_factor );
+            tmp_ifactor.set_param( model.param.num_factor );
+            tensor::alloc_space( tmp_ufactor );
+            tensor::alloc_space( tmp_ifactor );
             // lazy decay
             this->sample_counter = 0;
             if( param.reg_global >= 4 ) {
@@ -169,6 +316,7 @@ namespace apex_svd{
                 memset( ref_user, 0, sizeof(unsigned)*model.param.num_user );
                 memset( ref_item, 0, sizeof(unsigned)*model.param.num_item );
             }
+            this->compile_reg_plan();
             this->init_end = 1;
         }
     protected:        
@@ -184,153 +332,234 @@ namespace apex_svd{
                 w *= sqrtf( B / sum );
             }            
         }
+    protected:
+        // regularization policies, each applies to a scalar or a factor with coefficients c, 
+        // lazy policies also take k: number of samples since last regularization of the parameter
+        struct RegL2{
+            static const bool kLazy = false;
+            inline static void apply( float &w, const RegCoef &c, unsigned k ){ w *= c.decay; }
+            inline static void apply( CTensor1D w, const RegCoef &c, unsigned k ){ w *= c.decay; }
+        };
+        struct RegL1{
+            static const bool kLazy = false;
+            inline static void apply( float &w, const RegCoef &c, unsigned k ){ reg_L1( w, c.lambda ); }
+            inline static void apply( CTensor1D w, const RegCoef &c, unsigned k ){ tensor::regularize_L1( w, c.lambda ); }
+        };
+        struct RegProject{
+            static const bool kLazy = false;
+            inline static void apply( CTensor1D w, const RegCoef &c, unsigned k ){ project( w, c.wd ); }
+        };
+        struct RegLazyL2{
+            static const bool kLazy = true;
+            inline static void apply( float &w, const RegCoef &c, unsigned k ){ w *= c.pow_decay( k ); }
+            inline static void apply( CTensor1D w, const RegCoef &c, unsigned k ){ w *= c.pow_decay( k ); }
+        };
+        struct RegLazyL1{
+            static const bool kLazy = true;
+            inline static void apply( float &w, const RegCoef &c, unsigned k ){ reg_L1( w, c.lambda * static_cast<float>( k ) ); }
+            inline static void apply( CTensor1D w, const RegCoef &c, unsigned k ){ tensor::regularize_L1( w, c.lambda * static_cast<float>( k ) ); }
+        };
+        // compile the regularization setting, must be called again when learning rate changes
+        inline void compile_reg_plan( void ){
+            u_param.compile( u_plan, param.wd_user, param.learning_rate );
+            i_param.compile( i_plan, param.wd_item, param.learning_rate );
+            g_param.compile( g_plan, param.wd_global, param.learning_rate );
+            u_bias_decay = 1.0f - param.learning_rate * param.wd_user_bias;
+            i_bias_decay = 1.0f - param.learning_rate * param.wd_item_bias;
+            switch( param.reg_method ){
+            case 0: fn_reg_factor = &SVDFeature::reg_factor<RegL2,RegL2>; break;
+            case 1: fn_reg_factor = &SVDFeature::reg_factor<RegL1,RegL1>; break;
+            case 2: fn_reg_factor = &SVDFeature::reg_factor<RegProject,RegProject>; break;
+            // L1 for user, L2 for item
+            case 3: fn_reg_factor = &SVDFeature::reg_factor<RegL1,RegL2>; break;
+            case 4: fn_reg_factor = &SVDFeature::reg_factor<RegLazyL2,RegLazyL2>; break;
+            case 5: fn_reg_factor = &SVDFeature::reg_factor<RegLazyL1,RegLazyL1>; break;
+            default:apex_utils::error( "unknown reg_method" );
+            }
+            switch( param.reg_global ){
+            case 0: fn_reg_global = &SVDFeature::reg_global<RegL2>; break;
+            case 1: fn_reg_global = &SVDFeature::reg_global<RegL1>; break;
+            case 4: fn_reg_global = &SVDFeature::reg_global<RegLazyL2>; break;
+            case 5: fn_reg_global = &SVDFeature::reg_global<RegLazyL1>; break;
+            default:apex_utils::error( "unknown global decay method" );
+            }
+        }
     private:
-        inline void reg_global( const unsigned gid ){
-            float lambda = param.learning_rate * g_param.get_wd( gid, param.wd_global );
-            if( gid >= param.num_regfree_global ){ 
-                switch( param.reg_global ){
-                case 0: model.g_bias[ gid ] *= ( 1.0f - lambda ); break;
-                case 1: reg_L1( model.g_bias[ gid ], lambda ); break;
-                case 4: {// lazy L2 decay
-                    float k = static_cast<float>( ref_global[gid] - sample_counter );
-                    model.g_bias[ gid ] *= expf( logf( 1.0f - lambda ) * k );
-                    ref_global[ gid ] = sample_counter;
-                    break;
+        // whether rows of a sample go through the slots
+        inline bool slot_rows( void ) const{
+            return model.half_factor() || model.paged_user();
+        }
+        inline size_t slot_hash( size_t key ) const{
+            return static_cast<size_t>( ( static_cast<unsigned long long>( key ) * 0x9E3779B97F4A7C15ULL ) >> 32 ) & ( slot_table.size() - 1 );
+        }
+        // position of key in slot table, it is either the entry of key or the empty entry to place it
+        inline size_t slot_find( size_t key ) const{
+            size_t h = this->slot_hash( key );
+            while( true ){
+                const size_t i = slot_table[ h ];
+                if( i >= num_slot || slot_pos[ i ] != h || slot_key[ i ] == key ) return h;
+                h = ( h + 1 ) & ( slot_table.size() - 1 );
+            }
+        }
+        // enlarge slot table to keep it at most half full
+        inline void rehash_slots( void ){
+            size_t n = 16;
+            while( n < ( num_slot + 1 ) * 2 ) n <<= 1;
+            slot_table.assign( n, static_cast<size_t>( -1 ) );
+            for( size_t i = 0; i < num_slot; i ++ ){
+                const size_t h = this->slot_find( slot_key[i] );
+                slot_table[ h ] = i; slot_pos[ i ] = h;
+            }
+        }
+        // float copy of a row that is not kept as float in memory, copied once per sample
+        inline CTensor1D copy_row( size_t key ){
+            if( slot_table.size() < ( num_slot + 1 ) * 2 ) this->rehash_slots();
+            const size_t h = this->slot_find( key );
+            const size_t s = slot_table[ h ];
+            if( s < num_slot && slot_pos[ s ] == h ) return slot_row[ s ];
+            if( num_slot == slot_row.size() ){
+                slot_key.push_back( 0 ); slot_pos.push_back( 0 );
+                slot_row.push_back( CTensor1D( model.param.num_factor ) );
+                tensor::alloc_space( slot_row.back() );
+            }
+            slot_key[ num_slot ] = key;
+            slot_table[ h ] = num_slot; slot_pos[ num_slot ] = h;
+            float *dst = slot_row[ num_slot ].elem;
+            const size_t idx = key >> 1;
+            if( key & 1 ){
+                apex_half::decode( dst, model.H_item[ idx ], model.param.num_factor, model.param.factor_storage );
+            }else if( model.paged_user() ){
+                model.P_user.read_row( idx, dst );
+            }else{
+                apex_half::decode( dst, model.H_user[ idx ], model.param.num_factor, model.param.factor_storage );
+            }
+            return slot_row[ num_slot ++ ];
+        }
+        inline CTensor1D user_row( unsigned uid ){
+            if( this->slot_rows() ) return this->copy_row( static_cast<size_t>( uid ) << 1 );
+            return model.W_user[ uid ];
+        }
+        inline CTensor1D item_row( unsigned iid ){
+            if( model.half_factor() ) return this->copy_row( ( static_cast<size_t>( iid ) << 1 ) | 1 );
+            return model.W_item[ iid ];
+        }
+        // write the rows of current sample back to the model, and start a new sample
+        inline void commit_rows( void ){
+            for( size_t i = 0; i < num_slot; i ++ ){
+                const size_t idx = slot_key[i] >> 1;
+                if( slot_key[i] & 1 ){
+                    apex_half::encode( model.H_item[ idx ], slot_row[i].elem, model.param.num_factor, model.param.factor_storage, round_rnd );
+                }else if( model.paged_user() ){
+                    model.P_user.write_row( idx, slot_row[i].elem );
+                }else{
+                    apex_half::encode( model.H_user[ idx ], slot_row[i].elem, model.param.num_factor, model.param.factor_storage, round_rnd );
                 }
-                case 5: {// lazy L1 decay
-                    float k = static_cast<float>( ref_global[gid] - sample_counter );
-                    reg_L1( model.g_bias[ gid ], lambda * k );
+            }
+            num_slot = 0;
+        }
+    private:
+        template<typename Reg>
+        inline void reg_global( const SVDFeatureCSR::Elem &feature ){
+            for( int i = 0; i < feature.num_global; i ++ ){
+                const unsigned gid = feature.index_global[i];
+                if( gid < param.num_regfree_global ) continue;
+                unsigned k = 0;
+                if( Reg::kLazy ){
+                    k = sample_counter - ref_global[ gid ];
                     ref_global[ gid ] = sample_counter;
-                    break;                    
-                }
-                default:
-                    apex_utils::error("unknown global decay method");
                 }
+                Reg::apply( model.g_bias[ gid ], g_plan[ gid ], k );
             }
         }
+        template<typename Reg>
         inline void reg_user( const unsigned uid ){
-            // regularize factor 
-            float wd =u_param.get_wd( uid, param.wd_user );
-            float lambda = param.learning_rate * wd;
-            switch( param.reg_method ){
-            case 0: model.W_user[ uid ] *= ( 1.0f - lambda ); break;
-			case 3: 
-            case 1:{
-                CTensor1D w;
-                w = model.W_user[ uid ];
-                tensor::regularize_L1( w, lambda ); 
-                break;                
-            }
-            case 2: project( model.W_user[ uid ], wd ); break;
-            case 4: {// lazy L2 decay
-                float k = static_cast<float>( ref_user[uid] - sample_counter );
-                model.W_user[ uid ] *= expf( logf( 1.0f - lambda ) * k );
-                ref_user[ uid ] = sample_counter;
-                break;
-            }
-            case 5: {// lazy L1 decay
-                CTensor1D w;
-                w = model.W_user[ uid ];
-                float k = static_cast<float>( ref_user[uid] - sample_counter );
-                tensor::regularize_L1( w, lambda * k );
+            unsigned k = 0;
+            if( Reg::kLazy ){
+                k = sample_counter - ref_user[ uid ];
                 ref_user[ uid ] = sample_counter;
-                break;                    
             }
-            default:apex_utils::error( "unknown reg_method" );
-            }
-
+            CTensor1D w = this->user_row( uid );
+            Reg::apply( w, u_plan[ uid ], k );
             if( model.param.user_nonnegative ) {
-                CTensor1D w = model.W_user[ uid ];
                 tensor::smaller_then_fill( w, 0.0f );
             }  
             // only do L2 decay for bias
             if( model.param.no_user_bias == 0 ){
-                model.u_bias[ uid ] *= ( 1.0f - param.learning_rate * param.wd_user_bias );
+                model.u_bias[ uid ] *= u_bias_decay;
             }
         }
+        template<typename Reg>
         inline void reg_item( const unsigned iid ){
-            CTensor1D w;           
-            float wd = i_param.get_wd( iid, param.wd_item );
-            float lambda = param.learning_rate * wd;
-            switch( param.reg_method ){
-			case 3:
-            case 0: model.W_item[ iid ] *= ( 1.0f - lambda ); break;
-            case 1:{
-                CTensor1D w;
-                w = model.W_item[ iid ];
-                tensor::regularize_L1( w, lambda ); 
-                break;
-            }
-            case 2: project( model.W_item[ iid ], wd ); break;
-            case 4: {// lazy L2 decay
-                float k = static_cast<float>( ref_item[iid] - sample_counter );
-                model.W_item[ iid ] *= expf( logf( 1.0f - lambda ) * k );
+            unsigned k = 0;
+            if( Reg::kLazy ){
+                k = sample_counter - ref_item[ iid ];
                 ref_item[ iid ] = sample_counter;
-                break;
             }
-            case 5: {// lazy L1 decay
-                CTensor1D w;
-                w = model.W_item[ iid ];
-                float k = static_cast<float>( ref_item[iid] - sample_counter );
-                tensor::regularize_L1( w, lambda * k );
-                ref_item[ iid ] = sample_counter;
-                break;                    
+            Reg::apply( this->item_row( iid ), i_plan[ iid ], k );
+            // only do L2 decay for bias
+            model.i_bias[ iid ] *= i_bias_decay;
+        }
+        template<typename UReg, typename IReg>
+        inline void reg_factor( const SVDFeatureCSR::Elem &feature ){
+            for( int i = 0; i < feature.num_ufactor; i ++ ){
+                this->reg_user<UReg>( feature.index_ufactor[i] );
+                SparseFeatureArray<float>::Vector vec = feat_user[ feature.index_ufactor[i] ];
+                for( int j = 0; j < vec.size(); j ++ ){
+                    this->reg_user<UReg>( vec[j].index );
+                }
             }
-            default:apex_utils::error( "unknown reg_method" );
+            for( int i = 0; i < feature.num_ifactor; i ++ ){                
+                this->reg_item<IReg>( feature.index_ifactor[i] );
+                SparseFeatureArray<float>::Vector vec = feat_item[ feature.index_ifactor[i] ];
+                for( int j = 0; j < vec.size(); j ++ ){
+                    this->reg_item<IReg>( vec[j].index );
+                }
             }
-            // only do L2 decay for bias
-            model.i_bias[ iid ] *= ( 1.0f - param.learning_rate * param.wd_item_bias );
         }
-
         // do regularization
         inline void regularize( const SVDFeatureCSR::Elem feature, bool is_after_update ){            
-            // when reg_method>=3, regularization is performed before update
-            if( ( is_after_update && param.reg_global < 4) || 
-                (!is_after_update && param.reg_global >=4)  ){ 
-                for( int i = 0; i < feature.num_global; i ++ ){
-                    this->reg_global( feature.index_global[i] );
-                }
+            // lazy decay is performed before update, others after update
+            if( is_after_update != ( param.reg_global >= 4 ) ){ 
+                (this->*fn_reg_global)( feature );
             }
-            if( ( is_after_update && param.reg_method < 4) || 
-                (!is_after_update && param.reg_method >=4)  ){ 
-                for( int i = 0; i < feature.num_ufactor; i ++ ){
-                    this->reg_user( feature.index_ufactor[i] );
-                    SparseFeatureArray<float>::Vector vec = feat_user[ feature.index_ufactor[i] ];
-                    for( int j = 0; j < vec.size(); j ++ ){
-                        this->reg_user( vec[j].index );
-                    }
-                }
-                for( int i = 0; i < feature.num_ifactor; i ++ ){                
-                    this->reg_item( feature.index_ifactor[i] );
-                    SparseFeatureArray<float>::Vector vec = feat_item[ feature.index_ifactor[i] ];
-                    for( int j = 0; j < vec.size(); j ++ ){
-                        this->reg_item( vec[j].index );
-                    }
-                }
+            if( is_after_update != ( param.reg_method >= 4 ) ){ 
+                (this->*fn_reg_factor)( feature );
             }
         }
     private:
-        inline double calc_bias( const SVDFeatureCSR::Elem &feature,
-                                 const CTensor1D &u_bias, 
-                                 const CTensor1D &i_bias, 
-                                 const CTensor1D &g_bias ){
+        // prefetch every cache line the row overlaps, rows are only 16 byte aligned
+        inline static void prefetch_row( const CTensor1D &r ){
+            apex_utils::prefetch( static_cast<const TENSOR_FLOAT*>( r.elem ), r.x_max * sizeof(TENSOR_FLOAT) );
+        }
+        inline static void push_row( std::vector<RowRef> &rows, CTensor1D row, float *bias, float v, float iv ){
+            RowRef r;
+            r.row = row; r.bias = bias;
+            r.v = v; r.iv = iv;
+            rows.push_back( r );
+        }
+        // walk the features of a sample once: check bounds, collect the factor rows, and sum up the bias
+        inline double gather_rows( const SVDFeatureCSR::Elem &feature ){
             double sum = 0.0f;
             for( int i = 0; i < feature.num_global; i ++ ){
                 const unsigned gid = feature.index_global[i];
                 apex_utils::assert_true( gid < (unsigned)model.param.num_global, "global feature index exceed setting" );
-                sum += feature.value_global[i] * g_bias[ gid ];
+                sum += feature.value_global[i] * model.g_bias[ gid ];
+            }
+            
+            urows.clear(); irows.clear();
+            for( int i = 0; i < feature.num_ufactor; i ++ ){
+                const unsigned uid = feature.index_ufactor[i];
+                apex_utils::assert_true( uid < (unsigned)model.param.num_user, "user feature index exceed bound" );
+                push_row( urows, this->user_row( uid ), &model.u_bias[ uid ], feature.value_ufactor[i], 1.0f );
+                // extra feature
+                SparseFeatureArray<float>::Vector vec = feat_user[ uid ];
+                for( int j = 0; j < vec.size(); j ++ ){
+                    push_row( urows, this->user_row( vec[j].index ), &model.u_bias[ vec[j].index ], vec[j].value, 1.0f );
+                }
             }
-                        
             if( model.param.no_user_bias == 0 ){
-                for( int i = 0; i < feature.num_ufactor; i ++ ){
-                    const unsigned uid = feature.index_ufactor[i];
-                    apex_utils::assert_true( uid < (unsigned)model.param.num_user, "user feature index exceed bound" );
-                    sum += feature.value_ufactor[i] * u_bias[ uid ];
-                    // extra feature
-                    SparseFeatureArray<float>::Vector vec = feat_user[ uid ];
-                    for( int j = 0; j < vec.size(); j ++ ){
-                        sum += u_bias[ vec[j].index ] * vec[j].value;
-                    }
+                for( size_t k = 0; k < urows.size(); k ++ ){
+                    sum += *urows[k].bias * urows[k].v;
                 }
                 sum += this->get_bias_svdpp();
             }
@@ -341,85 +570,52 @@ namespace apex_svd{
                 const unsigned iid = feature.index_ifactor[i];
                 const float    ival= feature.value_ifactor[i];
                 apex_utils::assert_true( iid < (unsigned)model.param.num_item, "item feature index exceed bound" );
-                sum +=  ival * i_bias[ iid ];
+                push_row( irows, this->item_row( iid ), &model.i_bias[ iid ], ival, 1.0f );
                 // extra feature
                 SparseFeatureArray<float>::Vector vec = feat_item[ iid ];
                 for( int j = 0; j < vec.size(); j ++ ){
-                    sum += i_bias[ vec[j].index ] * vec[j].value * ival;
+                    push_row( irows, this->item_row( vec[j].index ), &model.i_bias[ vec[j].index ], vec[j].value, ival );
                 }
             }
-            
+            for( size_t k = 0; k < irows.size(); k ++ ){
+                sum += *irows[k].bias * irows[k].v * irows[k].iv;
+            }
             return sum;
         }
+        // dst += sum of gathered rows, the next row is prefetched while current one is added
+        inline static void add_rows( CTensor1D &dst, const std::vector<RowRef> &rows ){
+            for( size_t k = 0; k < rows.size(); k ++ ){
+                if( k + 1 < rows.size() ) prefetch_row( rows[k+1].row );
+                dst += rows[k].row * rows[k].v * rows[k].iv;
+            }
+        }
         inline void prepare_tmp( const SVDFeatureCSR::Elem &feature ){ 
             this->prepare_svdpp( tmp_ufactor );
             tmp_ifactor = 0.0f;
-
-            for( int i = 0; i < feature.num_ufactor; i ++ ){
-                const unsigned uid = feature.index_ufactor[i];
-                apex_utils::assert_true( uid < (unsigned)model.param.num_user, "user feature index exceed bound" );
-
-                tmp_ufactor += model.W_user[ uid ] * feature.value_ufactor[i];
-
-                // extra feature
-                SparseFeatureArray<float>::Vector vec = feat_user[ uid ];
-                for( int j = 0; j < vec.size(); j ++ ){
-                    tmp_ufactor += model.W_user[ vec[j].index ] * vec[j].value;
-                }               
-            }            
-            for( int i = 0; i < feature.num_ifactor; i ++ ){
-                const unsigned iid = feature.index_ifactor[i];
-                const float    ival= feature.value_ifactor[i];
-                tmp_ifactor += model.W_item[ iid ] * ival;
-
-                // extra feature
-                SparseFeatureArray<float>::Vector vec = feat_item[ iid ];
-                for( int j = 0; j < vec.size(); j ++ ){
-                    tmp_ifactor += model.W_item[ vec[j].index ] * vec[j].value * ival;
-                }
-            }            
+            add_rows( tmp_ufactor, urows );
+            add_rows( tmp_ifactor, irows );
         }
-                
+        // scatter the gradient to rows gathered by the last prediction of the same sample
         inline void update_no_decay( float err, const SVDFeatureCSR::Elem &feature  ){ 
             for( int i = 0; i < feature.num_global; i ++ ){
                 const unsigned gid = feature.index_global[i];                
                 model.g_bias[ gid ] += param.learning_rate * err * feature.value_global[i];
             }
-                
-            for( int i = 0; i < feature.num_ufactor; i ++ ){
-                const unsigned uid = feature.index_ufactor[i];                
-                float scale = param.learning_rate * err * feature.value_ufactor[i];
-                    
-                model.W_user[ uid ] += scale * tmp_ifactor;
-
+            
+            const float lr_err = param.learning_rate * err;
+            for( size_t k = 0; k < urows.size(); k ++ ){
+                if( k + 1 < urows.size() ) prefetch_row( urows[k+1].row );
+                float scale = lr_err * urows[k].v * urows[k].iv;
+                urows[k].row += scale * tmp_ifactor;
                 if( model.param.no_user_bias == 0 ){ 
-                    model.u_bias[ uid ] += scale;
-                }
-                // extra feature
-                SparseFeatureArray<float>::Vector vec = feat_user[ uid ];
-                for( int j = 0; j < vec.size(); j ++ ){
-                    float sc = param.learning_rate * err * vec[j].value;                    
-                    model.W_user[ vec[j].index ] += sc * tmp_ifactor;
-                    if( model.param.no_user_bias == 0 ){
-                        model.u_bias[ vec[j].index ] += sc;
-                    }
+                    *urows[k].bias += scale;
                 }
             }
-
-            for( int i = 0; i < feature.num_ifactor; i ++ ){
-                const unsigned iid = feature.index_ifactor[i];
-                const float    ival= feature.value_ifactor[i];
-                float scale = param.learning_rate * err * ival;
-                model.W_item[ iid ] += scale * tmp_ufactor;                 
-                model.i_bias[ iid ] += scale;
-
-                // extra feature
-                SparseFeatureArray<float>::Vector vec = feat_item[ iid ];
-                for( int j = 0; j < vec.size(); j ++ ){
-                    float sc = param.learning_rate * err * vec[j].value * ival;
-                    model.i_bias[ vec[j].index ] += sc;
-                    model.W_item[ vec[j].index ] += sc * tmp_ufactor;
-                }
+            for( size_t k = 0; k < irows.size(); k ++ ){
+                if( k + 1 < irows.size() ) prefetch_row( irows[k+1].row );
+                float scale = lr_err * irows[k].v * irows[k].iv;
+                irows[k].row += scale * tmp_ufactor;
+                *irows[k].bias += scale;
             }
                         
             this->update_svdpp( err, tmp_ifactor );
@@ -442,30 +638,129 @@ namespace apex_svd{
             // do nothing
         }
     protected:
-        inline float pred( const SVDFeatureCSR::Elem &feature ){ 
-            double sum = model.param.base_score + 
-                this->calc_bias( feature, model.u_bias, model.i_bias, model.g_bias );
+        // prediction before the activation function
+        inline float pred_raw( const SVDFeatureCSR::Elem &feature ){ 
+            double sum = model.param.base_score + this->gather_rows( feature );
             
             this->prepare_tmp( feature );
 
             sum += apex_tensor::cpu_only::dot( tmp_ufactor, tmp_ifactor );            
             
-            return active_type::map_active( (float)sum, model.mtype.active_type ); 
+            return (float)sum;
         }
-
-        inline void update_inner( const SVDFeatureCSR::Elem &feature, float sample_weight = 1.0f ){ 
+        template<int atype>
+        inline float pred_active( const SVDFeatureCSR::Elem &feature ){
+            return active_type::ActiveFunc<atype>::map_active( this->pred_raw( feature ) );
+        }
+        template<int atype>
+        inline void update_active( const SVDFeatureCSR::Elem &feature, float sample_weight ){ 
             this->regularize( feature, false );
-            float err = active_type::cal_grad( feature.label, this->pred( feature ), model.mtype.active_type ) * sample_weight;
+            float err = active_type::ActiveFunc<atype>::cal_grad( feature.label, this->pred_active<atype>( feature ) ) * sample_weight;
             this->update_no_decay( err, feature  );
             this->sample_counter ++;
             this->regularize( feature, true );
+            if( this->slot_rows() ) this->commit_rows();
+        }
+        template<int atype>
+        inline void bind_active( void ){
+            fn_pred   = &SVDFeature::pred_active<atype>;
+            fn_update = &SVDFeature::update_active<atype>;
+        }
+        inline float pred( const SVDFeatureCSR::Elem &feature ){ 
+            return (this->*fn_pred)( feature );
+        }
+        inline void update_inner( const SVDFeatureCSR::Elem &feature, float sample_weight = 1.0f ){ 
+            (this->*fn_update)( feature, sample_weight );
+        }
+        // prediction of a sample that is not followed by update, copied rows are dropped
+        inline float pred_rows( const SVDFeatureCSR::Elem &feature ){
+            const float p = this->pred( feature );
+            num_slot = 0;
+            return p;
+        }
+    private:
+        // reallocate lazy decay reference when the rows of model are reserved again, new entries are 0 as in init_trainer
+        inline static void grow_ref( unsigned *&ref, int num, int old_cap, int new_cap ){
+            if( new_cap == old_cap ) return;
+            unsigned *p = new unsigned[ new_cap ];
+            memcpy( p, ref, sizeof(unsigned) * num );
+            memset( p + num, 0, sizeof(unsigned) * ( new_cap - num ) );
+            delete [] ref;
+            ref = p;
+        }
+        // number of rows needed to hold feature id, the rows of model are indexed by int
+        inline static unsigned rows_for( unsigned id ){
+            apex_utils::assert_true( id < static_cast<unsigned>( INT_MAX ), "grow_model: feature id must be smaller than INT_MAX" );
+            return id + 1;
+        }
+        // grow the model to hold all the features of a sample, including the extend features
+        inline void grow_for( const SVDFeatureCSR::Elem &feature ){
+            unsigned nu = model.param.num_user, ni = model.param.num_item, ng = model.param.num_global;
+            for( int i = 0; i < feature.num_ufactor; i ++ ){
+                const unsigned uid = feature.index_ufactor[i];
+                nu = std::max( nu, rows_for( uid ) );
+                SparseFeatureArray<float>::Vector vec = feat_user[ uid ];
+                for( int j = 0; j < vec.size(); j ++ ) nu = std::max( nu, rows_for( vec[j].index ) );
+            }
+            for( int i = 0; i < feature.num_ifactor; i ++ ){
+                const unsigned iid = feature.index_ifactor[i];
+                ni = std::max( ni, rows_for( iid ) );
+                SparseFeatureArray<float>::Vector vec = feat_item[ iid ];
+                for( int j = 0; j < vec.size(); j ++ ) ni = std::max( ni, rows_for( vec[j].index ) );
+            }
+            for( int i = 0; i < feature.num_global; i ++ ){
+                ng = std::max( ng, rows_for( feature.index_global[i] ) );
+            }
+            if( nu == (unsigned)model.param.num_user && ni == (unsigned)model.param.num_item && ng == (unsigned)model.param.num_global ) return;
+            const int ou = model.param.num_user, oi = model.param.num_item, og = model.param.num_global;
+            const int cu = model.cap_user, ci = model.cap_item, cg = model.cap_global;
+            model.grow( (int)nu, (int)ni, (int)ng );
+            if( param.reg_method >= 4 ){
+                grow_ref( ref_user, ou, cu, model.cap_user );
+                grow_ref( ref_item, oi, ci, model.cap_item );
+            }
+            if( param.reg_global >= 4 ){
+                grow_ref( ref_global, og, cg, model.cap_global );
+            }
         }
     public:        
         virtual void update( const SVDFeatureCSR::Elem &feature ){             
+            if( grow_model != 0 ) this->grow_for( feature );
             this->update_inner( feature );
         }
         virtual float predict( const SVDFeatureCSR::Elem &feature ){ 
-            return this->pred( feature );
+            // features unknown to a growing model have no effect on prediction
+            if( ( remap_input != 0 && model.param.remap_flag != 0 ) || grow_model != 0 ){
+                const unsigned bound[3] = { (unsigned)model.param.num_global, (unsigned)model.param.num_user, (unsigned)model.param.num_item };
+                return this->pred_rows( model.remap.map( feature, bound ) );
+            }
+            return this->pred_rows( feature );
+        }
+        virtual void prefetch( const SVDFeatureCSR::Elem &feature ){
+            for( int i = 0; i < feature.num_ufactor; i ++ ){
+                const unsigned uid = feature.index_ufactor[i];
+                if( uid >= (unsigned)model.param.num_user ) continue;
+                if( model.half_factor() ){
+                    apex_utils::prefetch( model.H_user[ uid ], model.param.num_factor * sizeof(uint16_t) );
+                }else if( !model.paged_user() ){
+                    prefetch_row( model.W_user[ uid ] );
+                }
+                apex_utils::prefetch( &model.u_bias[ uid ] );
+                if( param.reg_method >= 4 ) apex_utils::prefetch( ref_user + uid );
+                feat_user.prefetch( uid );
+            }
+            for( int i = 0; i < feature.num_ifactor; i ++ ){
+                const unsigned iid = feature.index_ifactor[i];
+                if( iid >= (unsigned)model.param.num_item ) continue;
+                if( model.half_factor() ){
+                    apex_utils::prefetch( model.H_item[ iid ], model.param.num_factor * sizeof(uint16_t) );
+                }else{
+                    prefetch_row( model.W_item[ iid ] );
+                }
+                apex_utils::prefetch( &model.i_bias[ iid ] );
+                if( param.reg_method >= 4 ) apex_utils::prefetch( ref_item + iid );
+                feat_item.prefetch( iid );
+            }
         }
         virtual void set_round( int nround ){
             if( param.decay_learning_rate != 0 ){
@@ -474,8 +769,20 @@ namespace apex_svd{
                     param.learning_rate *= param.decay_rate;
                     round_counter ++;
                 }
+                if( init_end != 0 ) this->compile_reg_plan();
             }
         }
+        virtual void finish_round( void ){
+            if( !model.paged_user() || silent != 0 ) return;
+            const apex_utils::RowCache::Stat &st = model.P_user.get_stat();
+            const size_t hit = st.hit - page_stat.hit, miss = st.miss - page_stat.miss;
+            printf("\npage_user: hit-rate=%f, miss=%lu, evict=%lu, write-back=%.1fMB, %lu blocks in memory",
+                   static_cast<double>( hit ) / std::max( hit + miss, (size_t)1 ), 
+                   (unsigned long)miss, (unsigned long)( st.evict - page_stat.evict ),
+                   static_cast<double>( st.write_back - page_stat.write_back ) * model.P_user.get_block_bytes() / ( 1 << 20 ),
+                   (unsigned long)model.P_user.num_resident() );
+            page_stat = st;
+        }
     };
 };
 
@@ -497,6 +804,8 @@ namespace apex_svd{
         }
         // initialize trainer before training 
         virtual void init_trainer( void ){
+            apex_utils::assert_true( !model.half_factor(), "16-bit factor_storage is not supported by user grouped solvers" );
+            apex_utils::assert_true( !model.paged_user(), "page_user_mb is not supported by user grouped solvers" );
             tmp_ufeedback = clone( model.W_user[0] );
             old_ufeedback = clone( model.W_user[0] );
             SVDFeature::init_trainer();            
@@ -558,8 +867,13 @@ namespace apex_svd{
          *        can be overwrite
          */
         virtual void update_each( const SVDPlusBlock &data ){ 
-            // update 
+            // update, rows of the sample prefetch_distance ahead are prefetched
+            const int d = param.prefetch_distance;
+            for( int i = 0; i < d && i < data.data.num_row; i ++ ){
+                this->prefetch( data.data[i] );
+            }
             for( int i = 0; i < data.data.num_row; i ++ ){
+                if( d > 0 && i + d < data.data.num_row ) this->prefetch( data.data[i+d] );
                 this->update_inner( data.data[i] );
             }            
         }
@@ -586,7 +900,11 @@ namespace apex_svd{
                 this->prepare_ufeedback( data );
             }
             for( int i = 0; i < data.data.num_row; i ++ ){
-                p.push_back( this->pred( data.data[i] ) );
+                p.push_back( this->pred_raw( data.data[i] ) );
+            }
+            // activation of the whole block at once
+            if( p.size() != 0 ){
+                active_type::map_active( &p[0], p.size(), model.mtype.active_type );
             }
         }        
     };
@@ -602,6 +920,8 @@ namespace apex_svd{
     private:
         char name_feat_user[ 256 ];
         char name_feat_item[ 256 ];
+        // whether to translate ids of input with the remapping stored in model
+        int remap_input;
     private:
         // whether all the allocations has been done
         int init_end;
@@ -612,6 +932,12 @@ namespace apex_svd{
         CTensor1D bias_ifactors;
         // user factor data here
         CTensor1D tmp_ufactor, tmp_ifactor, tmp_ufeedback;        
+        // whether to pick candidates by int8 scores before exact ranking, and number of candidates picked
+        int rank_quant, rerank_size;
+        // int8 copy of tmp_ifactors, rows before num_item_quantized are filled
+        apex_int8::QTensor2D q_ifactors;
+        int num_item_quantized;
+        std::vector<int8_t> q_ufactor;
     private:
         struct Entry{
             int iid;
@@ -636,6 +962,9 @@ namespace apex_svd{
             strcpy( name_feat_item, "NULL" );
             this->init_end = 0;
             this->top_k    = 0;
+            this->remap_input = 0;
+            this->rank_quant  = 0;
+            this->rerank_size = 0;
         }
         virtual ~SVDFeatureRanker(){
             model.free_space();
@@ -646,6 +975,7 @@ namespace apex_svd{
             tensor::free_space( bias_ifactors );
             tensor::free_space( item_score );
             delete []item_tag;
+            apex_int8::free_space( q_ifactors );
             // SVD++ style
             if( model.mtype.format_type == svd_type::USER_GROUP_FORMAT ){
                 tensor::free_space( tmp_ufeedback );
@@ -657,13 +987,22 @@ namespace apex_svd{
             if( !strcmp( name,"feature_user" )) strcpy( name_feat_user  , val ); 
             if( !strcmp( name,"feature_item" )) strcpy( name_feat_item  , val ); 
             if( !strcmp( name,"top_k" )) top_k = atoi( val );
+            if( !strcmp( name,"remap_input" )) remap_input = atoi( val );
+            if( !strcmp( name,"rank_quant" )) rank_quant = atoi( val );
+            if( !strcmp( name,"rerank_size" )) rerank_size = atoi( val );
         }
         // load model from file
         virtual void load_model( FILE *fi ) {
+            // ranking keeps all the user factors in memory
+            model.page_user_mb = 0.0f;
             model.load_from_file( fi );
+            model.to_float();
         }
         // initialize trainer before ranking
         virtual void init_ranker( int num_item_set ){
+            apex_utils::assert_true( model.param.remap_flag == 0 || 
+                                     ( !strcmp( name_feat_user, "NULL" ) && !strcmp( name_feat_item, "NULL" ) ), 
+                                     "feature_user/feature_item can not be used with remapped feature ids" );
             if( strcmp( name_feat_user , "NULL") ) feat_user.load( name_feat_user );
             if( strcmp( name_feat_item , "NULL") ) feat_item.load( name_feat_item );
             // allocate necessary space for the item set
@@ -677,6 +1016,12 @@ namespace apex_svd{
             tensor::alloc_space( bias_ifactors );
             item_score = clone( bias_ifactors );
             item_tag   = new int[ num_item_set ];
+            if( rank_quant != 0 ){
+                q_ifactors.set_param( num_item_set, model.param.num_factor );
+                apex_int8::alloc_space( q_ifactors );
+                q_ufactor.resize( model.param.num_factor );
+            }
+            this->num_item_quantized = 0;
             // SVD++ style
             if( model.mtype.format_type == svd_type::USER_GROUP_FORMAT ){
                 tmp_ufeedback = clone( model.W_user[0] );
@@ -756,22 +1101,53 @@ namespace apex_svd{
             this->prepare_ifactor( tmp_ifactor, bias, feature );
             item_score[ idx ] = bias + cpu_only::dot( tmp_ufactor, tmp_ifactor );
         }
+        // pick candidates by int8 scores, and rank top_k of them by exact scores
+        inline void proc_rank_quant( std::vector<int> &rst ){
+            for( ; num_item_quantized < num_item_processed; num_item_quantized ++ ){
+                q_ifactors.set_row( num_item_quantized, tmp_ifactors[ num_item_quantized ].elem );
+            }
+            const int n = model.param.num_factor;
+            const float su = apex_int8::quantize( &q_ufactor[0], tmp_ufactor.elem, n );
+            std::vector<Entry> entry;
+            for( int i = 0; i < num_item_processed; i ++ ){
+                if( item_tag[i] == svdranker_tag::BAN_SAMPLE  ) continue;
+                const float s = su * q_ifactors.scale[ i ] * apex_int8::dot( &q_ufactor[0], q_ifactors[ i ], n );
+                entry.push_back( Entry( i, item_score[i] + bias_ifactors[ i ] + s ) );
+            }
+            apex_utils::assert_true( entry.size() >= static_cast<size_t>(top_k), "k can not exceed candidate size" );
+            const size_t ncand = std::min( entry.size(), static_cast<size_t>( std::max( top_k, rerank_size > 0 ? rerank_size : 4 * top_k ) ) );
+            std::nth_element( entry.begin(), entry.begin() + ( ncand - 1 ), entry.end() );
+            entry.erase( entry.begin() + ncand, entry.end() );
+            // exact scores of the candidates
+            for( size_t k = 0; k < entry.size(); k ++ ){
+                const int i = entry[k].iid;
+                item_score[ i ] += bias_ifactors[ i ] + cpu_only::dot( tmp_ufactor, tmp_ifactors[i] );
+                entry[k].score = item_score[ i ];
+            }
+            std::partial_sort( entry.begin(), entry.begin() + top_k, entry.end() );
+            for( int k = 0; k < top_k; k ++ )
+                rst.push_back( entry[k].iid );
+        }
         inline void proc_rank( std::vector<int> &rst ){
+            // int8 scores are only used to pick top k items, rank positions of all items are exact
+            if( rank_quant != 0 && top_k > 0 ){
+                this->proc_rank_quant( rst ); return;
+            }
             std::vector<Entry> entry;
             for( int i = 0; i < num_item_processed; i ++ ){
                 if( item_tag[i] == svdranker_tag::BAN_SAMPLE  ) continue;
                 item_score[ i ] += bias_ifactors[ i ] + cpu_only::dot( tmp_ufactor, tmp_ifactors[i] );
                 entry.push_back( Entry( i, item_score[i] ) );                                 
             } 
-            // sort the candidate
-            std::sort( entry.begin(), entry.end() );
             if( top_k > 0 ){
-                // grab result for top k
+                // grab result for top k, only the top k candidates need to be sorted
                 apex_utils::assert_true( entry.size() >= static_cast<size_t>(top_k), "k can not exceed candidate size" );
+                std::partial_sort( entry.begin(), entry.begin() + top_k, entry.end() );
                 for( int k = 0; k < top_k; k ++ )
                     rst.push_back( entry[k].iid );
             }else{
                 // grab rank positions for the pos samples
+                std::sort( entry.begin(), entry.end() );
                 for( size_t i = 0; i < entry.size(); i ++ ){
                     item_tag[ entry[i].iid ]  = static_cast<int>(i);
                 }
@@ -793,7 +1169,15 @@ namespace apex_svd{
         }
     public:
         virtual void process( std::vector<int> &result, const SVDFeatureCSR::Elem &feature ){ 
-            this->proc( result, feature );
+            if( remap_input != 0 && model.param.remap_flag != 0 ){
+                const int tag = static_cast<int>( feature.label );
+                const unsigned bound[3] = { (unsigned)model.param.num_global, (unsigned)model.param.num_user, (unsigned)model.param.num_item };
+                // user field of the samples holds index in item set instead of user feature
+                const int fields = ( tag == svdranker_tag::ITEM_TAG || tag == svdranker_tag::USER_TAG ) ? 7 : 5;
+                this->proc( result, model.remap.map( feature, bound, fields ) );
+            }else{
+                this->proc( result, feature );
+            }
         }
         virtual void process( std::vector<int> &result, const SVDPlusBlock &data ){
             if( data.extend_tag == svdpp_tag::DEFAULT || data.extend_tag == svdpp_tag::START_TAG ){
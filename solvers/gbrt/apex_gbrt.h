@@ -27,8 +27,11 @@
 #include "../../apex_svd.h"
 #include "../../apex_svd_model.h"
 #include "../../apex-utils/apex_config.h"
+#include <cmath>
 #include <cstring>
 #include <vector>
+#include <algorithm>
+#include <functional>
 
 // GBRT implementation of SVDFeature
 namespace apex_svd{
@@ -102,8 +105,10 @@ namespace apex_svd{
         int item_feature_mode;
         // number of root weight that is passed through global feature
         int num_root_weight;
+        // number of prediction caches saved after the trees
+        int num_res_buf;
         // reserved parameters
-        int reserved[ 28 ];
+        int reserved[ 27 ];
         // constructor
         GBRTModelParam( void ){
             num_trees = 0; 
@@ -112,6 +117,7 @@ namespace apex_svd{
             num_item = num_global = num_ufeedback = num_spec_sparse = 0;
             use_tax_root = 0; item_feature_mode = 0; 
             num_root_weight = 0;
+            num_res_buf = 0;
             memset( reserved, 0, sizeof( reserved ) );            
         }
         inline void set_param( const char *name, const char *val ){
@@ -414,37 +420,68 @@ namespace apex_svd{
     };
     
     // result buffer to temporally store results produced by gbrt
+    // each entry caches the sum of the first num_tree() trees of one row, so a pass only needs to add newer trees
     template<typename SType>
     class GBRTResultBuffer{
     private:
         size_t dindex;
-        bool first_round;
+        // number of trees summed up in buf, only meaningful when valid
+        size_t ntree;
+        // whether a full pass has been finished
+        bool valid;
         std::vector<SType> buf;
     public:
         GBRTResultBuffer( void ){ 
-            dindex = 0; first_round = true; 
+            this->clear();
         }
-        // move cursor before first
-        inline void finish_round( void ){
-            dindex = 0;
-            first_round = false;
+        // drop all the cached results
+        inline void clear( void ){
+            dindex = 0; ntree = 0; valid = false; buf.clear();
+        }
+        // finish a pass over the data, the buffer now contains sum of first ntree trees
+        inline void finish_pass( size_t ntree ){
+            apex_utils::assert_true( !valid || dindex == buf.size(), "result buffer: data size changed between passes" );
+            this->ntree = ntree; 
+            dindex = 0; valid = true;
         }
         // move cursor to next 
         inline void next( void ){
             dindex ++;
             if( dindex > buf.size() ){
-                apex_utils::assert_true( this->is_first_round(), "can't change buffer size after first round" );
+                apex_utils::assert_true( !valid, "result buffer: data size changed between passes" );
                 buf.push_back( 0.0 );
             }
         }
-        inline bool is_first_round( void ) const{
-            return first_round;
+        inline bool is_valid( void ) const{
+            return valid;
+        }
+        inline size_t num_tree( void ) const{
+            return ntree;
         }
         // current storage
         inline SType &curr( void ){
             apex_utils::assert_true( dindex != 0, "need to call next" );
             return buf[ dindex - 1 ];
         }
+        inline void save_to_file( FILE *fo ) const{
+            int v = valid ? 1 : 0;
+            size_t len = buf.size();
+            fwrite( &v, sizeof(int), 1, fo );
+            fwrite( &ntree, sizeof(size_t), 1, fo );
+            fwrite( &len, sizeof(size_t), 1, fo );
+            if( len != 0 ) fwrite( &buf[0], sizeof(SType), len, fo );
+        }
+        inline void load_from_file( FILE *fi ){
+            int v; size_t len;
+            apex_utils::assert_true( fread( &v, sizeof(int), 1, fi ) > 0, "load result buffer" );
+            apex_utils::assert_true( fread( &ntree, sizeof(size_t), 1, fi ) > 0, "load result buffer" );
+            apex_utils::assert_true( fread( &len, sizeof(size_t), 1, fi ) > 0, "load result buffer" );
+            buf.resize( len );
+            if( len != 0 ){
+                apex_utils::assert_true( fread( &buf[0], sizeof(SType), len, fi ) > 0, "load result buffer" );
+            }
+            valid = v != 0; dindex = 0;
+        }
     };
 
     // rank net implementation
@@ -470,8 +507,13 @@ namespace apex_svd{
     private:
         // training data result buffer
         GBRTResultBuffer<double> res_buf_train;
+        // evaluation data result buffer, filled by predict passes closed by finish_eval
+        GBRTResultBuffer<double> res_buf_eval;
         // option to use result buffer
         int use_res_buf;        
+        // whether to restore result buffers saved with the model, 
+        // set internally only when training continues from the latest checkpoint of the same run
+        int res_buf_restore;
     private:
         // base score
         float base_score;
@@ -491,6 +533,10 @@ namespace apex_svd{
         std::vector<unsigned> dgroup_id;
         std::vector<float>    dweight;
         apex_rt::FMatrixS  dsmat;
+        // external memory feature matrix, used instead of dmat and dsmat when rt_extmem is set
+        apex_rt::FMatrixExt dmat_ext;
+        apex_rt::FVector    fext;
+        std::vector<float>  fext_s;
     private:
         // root type scheduler
         GBRTScheduler rscheduler;
@@ -511,6 +557,7 @@ namespace apex_svd{
             this->pred_tree_leaf = -1;
             // whether to use result buffer
             this->use_res_buf = 0;
+            this->res_buf_restore = 0;
             this->base_score = 0.0f;
         }
         virtual ~GBRTTrainer( void ){
@@ -526,6 +573,8 @@ namespace apex_svd{
             if( !strcmp( name, "scale_baseline") ) scale_baseline = (float)atof( val ); 
             if( !strcmp( name, "base_score") )     base_score = (float)atof( val ); 
             if( !strcmp( "use_res_buf", name ) ) use_res_buf = atoi( val );
+            if( !strcmp( "res_buf_restore", name ) ) res_buf_restore = atoi( val );
+            dmat_ext.set_param( name, val );
             if( model.param.num_trees == 0 ) model.param.set_param( name, val );
             pscheduler.set_param( name, val );
             rscheduler.set_param( name, val );
@@ -536,6 +585,14 @@ namespace apex_svd{
         // load model from file
         virtual void load_model( FILE *fi ) {
             model.load_from_file( fi );
+            if( model.param.num_res_buf != 0 && res_buf_restore != 0 ){
+                apex_utils::assert_true( model.param.num_res_buf == 2, "unknown result buffer format" );
+                res_buf_train.load_from_file( fi );
+                res_buf_eval.load_from_file( fi );
+            }
+            // buffers that contains trees not in the model are no longer valid
+            if( res_buf_train.num_tree() > model.trees.size() ) res_buf_train.clear();
+            if( res_buf_eval.num_tree()  > model.trees.size() ) res_buf_eval.clear();
             // chg baseline
             if( chg_baseline_mode >= 0 ){
                 model.param.baseline_mode = chg_baseline_mode;
@@ -543,7 +600,12 @@ namespace apex_svd{
         }
         // save model to file
         virtual void save_model( FILE *fo ) {
+            model.param.num_res_buf = use_res_buf != 0 ? 2 : 0;
             model.save_to_file( fo );
+            if( model.param.num_res_buf != 0 ){
+                res_buf_train.save_to_file( fo );
+                res_buf_eval.save_to_file( fo );
+            }
         }
         // initialize model by defined setting
         virtual void init_model( void ){
@@ -557,6 +619,10 @@ namespace apex_svd{
             fcommon.set_state( &fcommon_s[0], model.param.num_ufeedback );
             
             dmat.set_column_len( model.param.num_global );
+            if( dmat_ext.is_enabled() ){
+                fext_s.resize( model.param.num_global );
+                fext.set_state( model.param.num_global != 0 ? &fext_s[0] : NULL, model.param.num_global );
+            }
             for( int i = 0; i < fcommon.size(); i ++ ){
                 fcommon.set_unknown( i );
             }
@@ -597,8 +663,8 @@ namespace apex_svd{
             }
         }
         
-        // generate prediction
-        inline float forward( const SVDFeatureCSR::Elem &e, bool use_res_buf_train ){
+        // generate prediction, rbuf caches results of previous trees if not NULL
+        inline float forward( const SVDFeatureCSR::Elem &e, GBRTResultBuffer<double> *rbuf ){
             unsigned gid = 0;
             if( model.param.num_item != 0 ){
                 apex_utils::assert_true( e.num_ifactor == 1, "need exact 1 item id to specify item" );
@@ -614,13 +680,13 @@ namespace apex_svd{
             this->build_dense( feat, e, model.param.num_spec_sparse );            
 
             if( this->pred_tree_leaf == -1 ){
-                // res buf train
+                // result buffer, only add trees that are not yet in the buffer
                 size_t istart = 0;               
-                if( use_res_buf_train ){
-                    res_buf_train.next();
-                    if( !res_buf_train.is_first_round() ){
-                        istart = model.trees.size() - 1;
-                        sum = res_buf_train.curr();
+                if( rbuf != NULL ){
+                    rbuf->next();
+                    if( rbuf->is_valid() ){
+                        istart = rbuf->num_tree();
+                        sum = rbuf->curr();
                     }
                 }
                 
@@ -640,9 +706,9 @@ namespace apex_svd{
                     }
                 }
 
-                // res buf train
-                if( use_res_buf_train ){
-                    res_buf_train.curr() = sum;
+                // result buffer
+                if( rbuf != NULL ){
+                    rbuf->curr() = sum;
                 }
             }else{
                 apex_utils::assert_true( pred_tree_leaf < (int)model.trees.size(), "tree id exceed bound" );
@@ -685,19 +751,23 @@ namespace apex_svd{
     protected:
         // add instance to sparse matrix 
         inline void add_instance( const SVDFeatureCSR::Elem &e, int gid, float grad, float sgrad, float weight ){
-            // add it to feature matrix
-            size_t idx = dmat.add_row( spart_index ); 
-
             const GBRTParamScheduler::Entry &pe = pscheduler.curr_type();
-            this->build_dense( dmat[idx], e, 0, pe.gstart, pe.gend );
-            
-            // add extra sparse part if any
-            if( model.param.num_spec_sparse != 0 ){
-                apex_rt::FVectorSparse sp;
-                sp.findex = e.index_ufactor;
-                sp.fvalue = e.value_ufactor;
-                sp.len    = e.num_ufactor;
-                apex_utils::assert_true( this->dsmat.add_row( sp ) == idx, "BUG" );
+            apex_rt::FVectorSparse sp;
+            sp.findex = e.index_ufactor;
+            sp.fvalue = e.value_ufactor;
+            sp.len    = model.param.num_spec_sparse != 0 ? e.num_ufactor : 0;
+            if( dmat_ext.is_enabled() ){
+                // external memory mode, the row is binned and written to disk
+                this->build_dense( fext, e, 0, pe.gstart, pe.gend );
+                dmat_ext.add_row( fext, sp, model.param.num_ufeedback, model.param.num_spec_sparse );
+            }else{
+                // add it to feature matrix
+                size_t idx = dmat.add_row( spart_index ); 
+                this->build_dense( dmat[idx], e, 0, pe.gstart, pe.gend );
+                // add extra sparse part if any
+                if( model.param.num_spec_sparse != 0 ){
+                    apex_utils::assert_true( this->dsmat.add_row( sp ) == idx, "BUG" );
+                }
             }
             
             if( gid >= 0 ){
@@ -755,7 +825,7 @@ namespace apex_svd{
          */
         virtual void update_stats( const std::vector<float> &tmp_pred, const SVDPlusBlock &data ) = 0;
     private:
-        virtual void forward( std::vector<float> &p, const SVDPlusBlock &data, bool use_res_buf_train = false ){ 
+        virtual void forward( std::vector<float> &p, const SVDPlusBlock &data, GBRTResultBuffer<double> *rbuf = NULL ){ 
             // add trace to fcommon
             if( data.extend_tag == svdpp_tag::DEFAULT || data.extend_tag == svdpp_tag::START_TAG ){
                 for( int i = 0; i < data.num_ufeedback; i ++ ){
@@ -767,7 +837,7 @@ namespace apex_svd{
             p.resize( data.data.num_row );
             
             for( int i = 0; i < data.data.num_row; i ++ ){
-                p[ i ] = this->forward( data.data[i], use_res_buf_train );
+                p[ i ] = this->forward( data.data[i], rbuf );
             }
             // remove trace from fcommon
             if( data.extend_tag == svdpp_tag::DEFAULT || data.extend_tag == svdpp_tag::END_TAG ){
@@ -785,10 +855,14 @@ namespace apex_svd{
                 sp.fvalue = data.value_ufeedback;
                 sp.len    = data.num_ufeedback;
                 const GBRTParamScheduler::Entry &e = pscheduler.curr_type(); 
-                this->spart_index = dmat.add_spart( sp, e.fstart, e.fend );
+                if( dmat_ext.is_enabled() ){
+                    dmat_ext.set_spart( sp, e.fstart, e.fend );
+                }else{
+                    this->spart_index = dmat.add_spart( sp, e.fstart, e.fend );
+                }
             }
 
-            this->forward( tmp_pred, data, use_res_buf != 0 );
+            this->forward( tmp_pred, data, use_res_buf != 0 ? &res_buf_train : NULL );
             {// tmp space setting
                 tmp_grad.resize( data.data.num_row );
                 tmp_weight.resize( data.data.num_row );
@@ -801,7 +875,7 @@ namespace apex_svd{
             this->add_batch( data );
         }
         virtual void predict( std::vector<float> &p, const SVDPlusBlock &data ){ 
-            this->forward( p, data );
+            this->forward( p, data, use_res_buf != 0 ? &res_buf_eval : NULL );
             for( int i = 0; i < data.data.num_row; i ++ ){
                 p[ i ] = active_type::map_active( p[ i ] , model.mtype.active_type ); 
             }
@@ -810,6 +884,7 @@ namespace apex_svd{
             dgrad.resize( 0 ); 
             dgrad_second.resize( 0 );
             dmat.clear(); dsmat.clear();
+            if( dmat_ext.is_enabled() ) dmat_ext.clear();
             dgroup_id.resize( 0 );
             dweight.resize( 0 );
             rscheduler.set_round( nround );
@@ -821,7 +896,16 @@ namespace apex_svd{
             // try to train a new tree
             apex_rt::IRTTrainer *rt = this->new_rt();
             // train the rt
-            rt->do_boost( dgrad, dgrad_second, dmat, dgroup_id, dweight, dsmat );
+            if( dmat_ext.is_enabled() ){
+                dmat_ext.flush();
+                rt->do_boost( dgrad, dgrad_second, dmat_ext, dgroup_id, dweight );
+            }else{
+                rt->do_boost( dgrad, dgrad_second, dmat, dgroup_id, dweight, dsmat );
+            }
+            // res buf train, results of the current trees are in buffer
+            if( use_res_buf != 0 ){
+                res_buf_train.finish_pass( model.trees.size() );
+            }
             
             int wtype = model.param.num_root_weight != 0 ? wscheduler.curr_type(): -1;
             if( model.param.use_tax_root == 0 ){
@@ -829,8 +913,11 @@ namespace apex_svd{
             }else{
                 model.push_back( rt, rscheduler.curr_type(), wtype );
             }
-            // res buf train
-            res_buf_train.finish_round();
+        }
+        virtual void finish_eval( void ){
+            if( use_res_buf != 0 ){
+                res_buf_eval.finish_pass( model.trees.size() );
+            }
         }
     };
 };
@@ -874,6 +961,10 @@ namespace apex_svd{
         int sample_pointwise;
         // how to make use of lambda rank weight
         int lambda_weight_mode;
+        // whether to use all pairs with different labels instead of sampling
+        int all_pair;
+        // whether all pairs are weighted by |delta NDCG| of swapping them, 0 means weight 1 (RankNet)
+        int all_pair_ndcg;
     protected:
         /*! \brief entry for information used to generate lambda rank sample */
         struct Entry{
@@ -904,6 +995,250 @@ namespace apex_svd{
                 this->weight = weight;
             }
         };
+    private:
+        /*! \brief linear piece of pair gradient, grad = a + b * diff for diff in [lo,hi) */
+        struct PairSegment{
+            float lo, hi, a, b;
+        };
+        /*! \brief compare position in info by label */
+        struct LabelCmp{
+            const std::vector<Entry> *info;
+            LabelCmp( const std::vector<Entry> *info ):info(info){}
+            inline bool operator()( unsigned a, unsigned b ) const{
+                return (*info)[a].label < (*info)[b].label;
+            }
+        };
+        /*! 
+         * \brief sums kept in the binary indexed tree, over entries m with gain g, discount d and score s:
+         *   count, d, g, g*d, s, d*s, g*s, g*d*s
+         */
+        struct Moment{
+            double v[ 8 ];
+            inline void clear( void ){
+                std::fill( v, v + 8, 0.0 );
+            }
+            inline void add( const Moment &m, double sc ){
+                for( int i = 0; i < 8; i ++ ) v[i] += sc * m.v[i];
+            }
+        };
+    private:
+        // reusable buffers, the trainer is owned by one thread, so they are never shared 
+        std::vector<Entry> info;
+        std::vector<LambdaSample> samples;
+        // positions in info sorted by label, and scores in info order (descending)
+        std::vector<unsigned> lorder;
+        std::vector<float>    lscore;
+        // NDCG gain and discount of each position in info, inverse of the ideal DCG of the query
+        std::vector<double>   lgain, ldisc;
+        double inv_idcg;
+        // gradient, and sum of pair weights against lower/higher labels, accumulated for each position in info
+        std::vector<double>   lgrad, lwlow, lwhigh;
+        // binary indexed tree over score position
+        std::vector<Moment>   bit;
+    private:
+        inline void bit_clear( size_t n ){
+            bit.resize( n + 1 );
+            for( size_t i = 0; i < bit.size(); i ++ ) bit[i].clear();
+        }
+        inline void bit_add( size_t pos ){
+            Moment m;
+            const double g = lgain[pos], d = ldisc[pos], s = lscore[pos];
+            m.v[0] = 1.0; m.v[1] = d;     m.v[2] = g;     m.v[3] = g * d;
+            m.v[4] = s;   m.v[5] = d * s; m.v[6] = g * s; m.v[7] = g * d * s;
+            for( size_t i = pos + 1; i < bit.size(); i += i & (~i + 1) ){
+                bit[i].add( m, 1.0 );
+            }
+        }
+        // sums of inserted entries over positions [b,e)
+        inline void bit_query( size_t b, size_t e, Moment &q ) const{
+            q.clear();
+            for( size_t i = e; i > 0; i -= i & (~i + 1) ) q.add( bit[i], 1.0 );
+            for( size_t i = b; i > 0; i -= i & (~i + 1) ) q.add( bit[i], -1.0 );
+        }
+        /*! 
+         * \brief positions [b,e) of entries whose score lies in (slo,shi] when lo_open, in [slo,shi) otherwise,
+         *    one end is open so a score on the boundary of two segments is counted once
+         */
+        inline void score_range( float slo, float shi, bool lo_open, size_t &b, size_t &e ) const{
+            // lscore is sorted descending
+            if( lo_open ){
+                b = std::lower_bound( lscore.begin(), lscore.end(), shi, std::greater<float>() ) - lscore.begin();
+                e = std::lower_bound( lscore.begin(), lscore.end(), slo, std::greater<float>() ) - lscore.begin();
+            }else{
+                b = std::upper_bound( lscore.begin(), lscore.end(), shi, std::greater<float>() ) - lscore.begin();
+                e = std::upper_bound( lscore.begin(), lscore.end(), slo, std::greater<float>() ) - lscore.begin();
+            }
+        }
+        /*! 
+         * \brief sum of w(k,m) * ( A + B * s_m ) over inserted entries m at positions [b,e), 
+         *    w(k,m) = |g_k-g_m| * |d_k-d_m| / IDCG is |delta NDCG| of swapping k and m, or 1 if all_pair_ndcg = 0
+         * \param gsign sign of g_k - g_m, same for all inserted entries
+         */
+        inline double pair_sum( size_t k, size_t b, size_t e, double A, double B, double gsign ) const{
+            if( b >= e ) return 0.0;
+            Moment q;
+            if( all_pair_ndcg == 0 ){
+                this->bit_query( b, e, q );
+                return A * q.v[0] + B * q.v[4];
+            }
+            const double gk = lgain[k], dk = ldisc[k];
+            double sum = 0.0;
+            // d_m > d_k for positions before k, and d_m < d_k after k
+            for( int side = 0; side < 2; side ++ ){
+                const size_t rb = side == 0 ? b : std::max( b, k + 1 );
+                const size_t re = side == 0 ? std::min( e, k ) : e;
+                if( rb >= re ) continue;
+                this->bit_query( rb, re, q );
+                // (g_k - g_m) * (d_k - d_m) * ( A + B * s_m ) expanded over the moments
+                const double val = 
+                    A * ( gk * dk * q.v[0] - gk * q.v[1] - dk * q.v[2] + q.v[3] ) +
+                    B * ( gk * dk * q.v[4] - gk * q.v[5] - dk * q.v[6] + q.v[7] );
+                sum += side == 0 ? -val : val;
+            }
+            return sum * gsign * inv_idcg;
+        }
+        /*! \brief weight of pair at positions i, j in info */
+        inline float pair_weight( size_t i, size_t j ) const{
+            if( all_pair_ndcg == 0 ) return 1.0f;
+            return (float)( fabs( lgain[i] - lgain[j] ) * fabs( ldisc[i] - ldisc[j] ) * inv_idcg );
+        }
+        /*! 
+         * \brief write pair gradient cal_grad( 1, diff ) as piecewise linear function of diff
+         * \return number of segments, 0 if the active type is not piecewise linear
+         */
+        inline int get_segments( PairSegment *seg ) const{
+            const float inf = 1e30f;
+            switch( model.mtype.active_type ){
+            case active_type::LINEAR:{
+                seg[0].lo = -inf; seg[0].hi = inf; seg[0].a = 1.0f; seg[0].b = -1.0f; 
+                return 1;
+            }
+            case active_type::HINGE_L2:{
+                seg[0].lo = -inf; seg[0].hi = 1.0f; seg[0].a = 1.0f; seg[0].b = -1.0f; 
+                return 1;
+            }
+            case active_type::HINGE_SMOOTH:{
+                seg[0].lo = -inf; seg[0].hi = 0.5f; seg[0].a = 1.0f; seg[0].b = 0.0f;
+                seg[1].lo = 0.5f; seg[1].hi = 1.5f; seg[1].a = 1.5f; seg[1].b = -1.0f;
+                return 2;
+            }
+            default: return 0;
+            }
+        }
+        /*! \brief NDCG gain and discount of each position, and the ideal DCG of the query */
+        inline void prepare_ndcg( void ){
+            const size_t n = info.size();
+            lgain.resize( n ); ldisc.resize( n );
+            for( size_t i = 0; i < n; i ++ ){
+                lgain[i] = pow( 2.0, (double)info[i].label ) - 1.0;
+                ldisc[i] = 1.0 / log2( 2.0 + i );
+            }
+            // lorder is sorted by label ascending, the ideal order is its reverse
+            double idcg = 0.0;
+            for( size_t r = 0; r < n; r ++ ){
+                idcg += lgain[ lorder[ n - 1 - r ] ] * ldisc[ r ];
+            }
+            inv_idcg = idcg > 0.0 ? 1.0 / idcg : 0.0;
+        }
+        /*! 
+         * \brief update statistics using all pairs (i,j) with label[i] > label[j], weighted by |delta NDCG| of the pair 
+         *   when all_pair_ndcg is set. Piecewise linear losses are summed exactly in O(n log n) using sorted label groups 
+         *   and cumulative sums over score position, other losses enumerate the pairs without storing them
+         */
+        inline void update_allpair( const SVDPlusBlock &data ){
+            const size_t n = info.size();
+            lorder.resize( n ); lscore.resize( n ); 
+            for( size_t i = 0; i < n; i ++ ){
+                lorder[i] = static_cast<unsigned>( i ); 
+                lscore[i] = info[i].score;
+            }
+            std::sort( lorder.begin(), lorder.end(), LabelCmp( &info ) );
+            this->prepare_ndcg();
+            
+            PairSegment seg[ 2 ];
+            const int nseg = this->get_segments( seg );
+            if( sample_pointwise == 0 && nseg == 0 ){
+                for( size_t i = 0; i < n; i ++ ){
+                    for( size_t j = 0; j < n; j ++ ){
+                        if( info[i].label > info[j].label ){
+                            this->update_grad( data, LambdaSample( info[i].data_index, info[j].data_index, this->pair_weight( i, j ) ) );
+                        }
+                    }
+                }
+                return;
+            }
+
+            lgrad.resize( n ); lwlow.resize( n ); lwhigh.resize( n );
+            std::fill( lgrad.begin(), lgrad.end(), 0.0 );
+            std::fill( lwlow.begin(), lwlow.end(), 0.0 );
+            std::fill( lwhigh.begin(), lwhigh.end(), 0.0 );
+            // positive side: pairs against entries with smaller label, diff = s_k - s_m in [lo,hi)
+            this->bit_clear( n );
+            for( size_t gs = 0; gs < n; ){
+                size_t ge = gs;
+                while( ge < n && info[ lorder[ge] ].label == info[ lorder[gs] ].label ) ge ++;
+                for( size_t t = gs; t < ge; t ++ ){
+                    const size_t k = lorder[t];
+                    const double s = lscore[k];
+                    lwlow[k] = this->pair_sum( k, 0, n, 1.0, 0.0, 1.0 );
+                    if( sample_pointwise != 0 ) continue;
+                    for( int i = 0; i < nseg; i ++ ){
+                        size_t b, e;
+                        this->score_range( (float)(s - seg[i].hi), (float)(s - seg[i].lo), true, b, e );
+                        lgrad[k] += this->pair_sum( k, b, e, seg[i].a + seg[i].b * s, -seg[i].b, 1.0 );
+                    }
+                }
+                for( size_t t = gs; t < ge; t ++ ){
+                    this->bit_add( lorder[t] );
+                }
+                gs = ge;
+            }
+            // negative side: pairs against entries with larger label, diff = s_m - s_k in [lo,hi)
+            this->bit_clear( n );
+            for( size_t ge = n; ge > 0; ){
+                size_t gs = ge;
+                while( gs > 0 && info[ lorder[gs-1] ].label == info[ lorder[ge-1] ].label ) gs --;
+                for( size_t t = gs; t < ge; t ++ ){
+                    const size_t k = lorder[t];
+                    const double s = lscore[k];
+                    lwhigh[k] = this->pair_sum( k, 0, n, 1.0, 0.0, -1.0 );
+                    if( sample_pointwise != 0 ) continue;
+                    for( int i = 0; i < nseg; i ++ ){
+                        size_t b, e;
+                        this->score_range( (float)(s + seg[i].lo), (float)(s + seg[i].hi), false, b, e );
+                        lgrad[k] -= this->pair_sum( k, b, e, seg[i].a - seg[i].b * s, seg[i].b, -1.0 );
+                    }
+                }
+                for( size_t t = gs; t < ge; t ++ ){
+                    this->bit_add( lorder[t] );
+                }
+                ge = gs;
+            }
+            // write back statistics, each entry is in nlower + nhigher pairs
+            const float psgrad = active_type::cal_sgrad( 1.0f, 0.0f, model.mtype.active_type );
+            for( size_t gs = 0; gs < n; ){
+                size_t ge = gs;
+                while( ge < n && info[ lorder[ge] ].label == info[ lorder[gs] ].label ) ge ++;
+                const float nlower = (float)gs, nhigher = (float)( n - ge );
+                for( size_t t = gs; t < ge; t ++ ){
+                    const unsigned pos = lorder[t];
+                    const unsigned idx = info[ pos ].data_index;
+                    const float wlow = (float)lwlow[ pos ], whigh = (float)lwhigh[ pos ];
+                    if( sample_pointwise == 0 ){
+                        tmp_grad [ idx ] += (float)lgrad[ pos ];
+                        tmp_sgrad[ idx ] += psgrad * ( wlow + whigh );
+                    }else{
+                        const float p = active_type::map_active( tmp_pred[ idx ], model.mtype.active_type );
+                        tmp_grad [ idx ] += active_type::cal_grad ( 1.0f, p, model.mtype.active_type ) * wlow
+                            + active_type::cal_grad ( 0.0f, p, model.mtype.active_type ) * whigh;
+                        tmp_sgrad[ idx ] += active_type::cal_sgrad( 1.0f, p, model.mtype.active_type ) * wlow
+                            + active_type::cal_sgrad( 0.0f, p, model.mtype.active_type ) * whigh;
+                    }
+                    tmp_weight[ idx ] += lambda_weight_mode == 0 ? nlower + nhigher : wlow + whigh;
+                }
+                gs = ge;
+            }
+        }
     private:
         // update step, one pair
         inline void update_grad( const SVDPlusBlock &data, const LambdaSample &sample ){
@@ -949,10 +1284,9 @@ namespace apex_svd{
         virtual void gen_sample( std::vector<LambdaSample> &samples, std::vector<Entry> &data, bool is_attach ) = 0;
     protected:
         virtual void update_stats( const std::vector<float> &tmp_pred, const SVDPlusBlock &data ){
-            std::vector<LambdaSample> samples;
             {// get prediction for each data
                 Entry e;
-                std::vector<Entry> info;
+                info.resize( 0 );
                 for( int i = 0; i < data.data.num_row; i ++ ){
                     e.score = tmp_pred[i];
                     e.label = data.data[i].label;
@@ -960,8 +1294,12 @@ namespace apex_svd{
                     info.push_back( e );
                 }
                 std::sort( info.begin(), info.end() );
-                this->gen_sample( samples, info, data.extra_info != 0 );
             }
+            if( all_pair != 0 ){
+                this->update_allpair( data ); return;
+            }
+            samples.resize( 0 );
+            this->gen_sample( samples, info, data.extra_info != 0 );
             
             {// update samples                
                 for( size_t i = 0; i < samples.size(); i ++ ){
@@ -974,10 +1312,14 @@ namespace apex_svd{
             :GBRTTrainer( mtype ){
             this->lambda_weight_mode = 1;
             this->sample_pointwise = 0;
+            this->all_pair = 0;
+            this->all_pair_ndcg = 1;
         }
         virtual void set_param( const char *name, const char *val ){
             if( !strcmp( name, "lambda_weight_mode") ) lambda_weight_mode = atoi( val ); 
             if( !strcmp( name, "rank_sample_pointwise") ) sample_pointwise = atoi( val );             
+            if( !strcmp( name, "rank_all_pair") ) all_pair = atoi( val );             
+            if( !strcmp( name, "rank_all_pair_ndcg") ) all_pair_ndcg = atoi( val );             
             GBRTTrainer::set_param( name, val );
         }     
     };
@@ -996,6 +1338,12 @@ namespace apex_svd{
 		int nround;
 		float ap_alpha;
         float keep_prob;
+    private:
+        // reusable buffers for sample generation
+        std::vector<int> pos, neg, pos_top;
+        // top_cnt[r]: number of pos_top with rank < r, top_inv[r]: sum of 1/(rank+1) over them
+        std::vector<int>    top_cnt;
+        std::vector<double> top_inv;
     public:
         APLambdaGBRTTrainer( const SVDTypeParam &mtype ):
             LambdaGBRTTrainer( mtype ){
@@ -1015,12 +1363,16 @@ namespace apex_svd{
                 if( apex_random::sample_binary( keep_prob ) == 0 ) return;
             }
             // simple implementation using uniform sampling
-            std::vector<int> pos, neg, pos_top;
+            pos.resize( 0 ); neg.resize( 0 ); pos_top.resize( 0 );
+            top_cnt.resize( data.size() + 1 ); top_inv.resize( data.size() + 1 );
+            top_cnt[0] = 0; top_inv[0] = 0.0;
             for( size_t i = 0; i < data.size(); i ++ ){
+                top_cnt[i+1] = top_cnt[i]; top_inv[i+1] = top_inv[i];
                 if( data[i].label > 0.5f ){
                     pos.push_back( (int)i );
                     if( (int)i < ap_maxn ){  
                         pos_top.push_back( (int)i );
+                        top_cnt[i+1] += 1; top_inv[i+1] += 1.0 / ( i + 1.0 );
                     }
                 }else{
                     neg.push_back( (int)i );
@@ -1045,20 +1397,14 @@ namespace apex_svd{
 
 						if( pos_idx < neg_idx ) std::swap( pos_idx, neg_idx );                        
                         if( neg_idx < ap_maxn ){
-                            // try to calculate delta ap
-                            int pos_cnt = 0;
-                            for( size_t j = 0; j < pos_top.size(); j ++ ){
-                                if( pos_top[j] >= pos_idx ){
-                                    delta_ap -= ( j + 1.0f ) / ( pos_idx + 1.0f ); break;
-                                }
-                                if( pos_top[j] > neg_idx ){
-                                    delta_ap += 1.0f /( pos_top[j] + 1.0f ); 
-                                }else{
-                                    if( pos_top[j] != neg_idx ) pos_cnt ++;
-                                }				
+                            // delta ap of swapping the pair, using prefix statistics of pos_top
+                            const int j = top_cnt[ pos_idx ];
+                            double dap = top_inv[ pos_idx ] - top_inv[ neg_idx + 1 ];
+                            if( j < (int)pos_top.size() ){
+                                dap -= ( j + 1.0 ) / ( pos_idx + 1.0 );
                             }
-                            delta_ap += ( pos_cnt + 1.0f ) / ( neg_idx + 1.0f );
-                            delta_ap /= pos.size();
+                            dap += ( top_cnt[ neg_idx ] + 1.0 ) / ( neg_idx + 1.0 );
+                            delta_ap = (float)( dap / pos.size() );
                         }
                         apex_utils::assert_true( delta_ap < 1.0f + 1e-6f, "BUGA" ); 
                         apex_utils::assert_true( delta_ap ==  delta_ap, "BUGB" ); 
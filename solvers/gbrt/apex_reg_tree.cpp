@@ -26,6 +26,7 @@
 #include "apex_reg_tree.h"
 #include "../../apex-tensor/apex_random.h"
 #include <cstring>
+#include <cfloat>
 #include <algorithm>
 
 namespace apex_rt{
@@ -268,6 +269,8 @@ namespace apex_rt{
         float wd_child;
         // specific split loss for each layer
         std::vector<float> layer_split_loss;
+        // memory in MB allowed for histograms in external memory mode
+        float hist_mem;
 
         RTParamTrain( void ){
             learning_rate = 0.3f;
@@ -281,6 +284,7 @@ namespace apex_rt{
             split_temper = 1.0f;
             wd_child = 0.0f;
             loss_type = 0;
+            hist_mem = 512.0f;
         }
         virtual void set_param( const char *name, const char *val ){
             if( !strcmp( name, "learning_rate") )     learning_rate = (float)atof( val );
@@ -295,6 +299,7 @@ namespace apex_rt{
             if( !strcmp( name, "split_temper") )        split_temper = (float)atof( val );
             if( !strcmp( name, "rt_loss_type") )        loss_type = atoi( val );
             if( !strcmp( name, "wd_child") )            wd_child = (float)atof( val );
+            if( !strcmp( name, "rt_hist_mem") )         hist_mem = (float)atof( val );
         }
         inline float get_min_split_loss( int depth ) const{
             return depth < (int)layer_split_loss.size() ? layer_split_loss[ depth ] : min_split_loss;
@@ -385,8 +390,74 @@ namespace apex_rt{
         }
     };
 
+    // common part of rtree updaters: instance weight, leaf making and pruning
+    class RTreeUpdaterBase{
+    protected:
+        const RTParamTrain &param;
+        // parameters 
+        RTree &tree;
+        std::vector<float> &grad;
+        std::vector<float> &grad_second;
+        std::vector<unsigned> &group_id;
+        std::vector<float>    &weight;
+    protected:
+        // maximum depth up to now
+        int max_depth;
+        // number of nodes being pruned
+        int num_pruned;
+    protected:
+        RTreeUpdaterBase( const RTParamTrain &pparam, 
+                          RTree &ptree,
+                          std::vector<float> &pgrad,
+                          std::vector<float> &pgrad_second,
+                          std::vector<unsigned> &pgroup_id,
+                          std::vector<float>    &pweight ):
+            param( pparam ), tree( ptree ), grad( pgrad ), grad_second( pgrad_second ),
+            group_id( pgroup_id ), weight( pweight ){
+            max_depth = 0; num_pruned = 0;
+        }
+        // get weight for current instance
+        inline float get_weight( unsigned ridx ){
+            if( param.loss_type == 0 ){
+                return weight.size() == 0 ? 1.0f : weight[ ridx ];
+            }else{
+                // for compability issue
+                return grad_second[ ridx ] * 4.0f;
+            }
+        }
+        // try to prune off current leaf, return true if successful
+        inline void try_prune_leaf( int nid, double rsum, double rsum_sgrad, int depth ){
+            if( tree[ nid ].is_root() ) return;
+            int pid = tree[ nid ].parent();
+            RTree::NodeStat &s = tree.stat( pid );
+            s.leaf_child_cnt ++; 
+            s.rsum = s.rsum + rsum; 
+            s.rsum_sgrad = s.rsum_sgrad + rsum_sgrad;
+
+            if( s.leaf_child_cnt >= 2 && s.loss_chg < param.get_min_split_loss( depth - 1 ) ){
+                // need to be pruned
+                apex_utils::assert_true( rsum_sgrad > 1e-5f, "second order derivative too low" );
+                tree.chg_to_leaf( pid, - param.learning_rate * s.rsum /( s.rsum_sgrad + param.wd_child ) );
+                // add statistics to number of nodes pruned
+                num_pruned += 2;
+                // tail recursion
+                this->try_prune_leaf( pid, s.rsum, s.rsum_sgrad, depth - 1 );
+            }
+        }
+        // set leaf value of node given statistics of its instances, then try to prune
+        inline void set_leaf( int nid, double rsum, double rsum_sgrad, double rweight ){
+            if( rweight < param.min_child_weight ){
+                tree[ nid ].set_leaf( 0.0f );
+            }else{                
+                apex_utils::assert_true( rsum_sgrad > 1e-5f, "second order derivative too low" );
+                tree[ nid ].set_leaf( - param.learning_rate * rsum / ( rsum_sgrad + param.wd_child ) );                
+            }
+            this->try_prune_leaf( nid, rsum, rsum_sgrad, tree.get_depth( nid ) );
+        }
+    };
+
     // updater of rtree, allows the parameters to be stored inside, key solver
-    class RTreeUpdater{
+    class RTreeUpdater: public RTreeUpdaterBase{
     private:
         // training task
         struct Task{
@@ -423,20 +494,9 @@ namespace apex_rt{
             }
         };
     private:
-        const RTParamTrain &param;
-        // parameters 
-        RTree &tree;
-        std::vector<float> &grad;
-        std::vector<float> &grad_second;
         FMatrix &mat;
-        std::vector<unsigned> &group_id;
-        std::vector<float>    &weight;
         FMatrixS &smat;
     private:
-        // maximum depth up to now
-        int max_depth;
-        // number of nodes being pruned
-        int num_pruned;
         // stack to store current task
         std::vector<Task> task_stack;
         // temporal space for index set
@@ -452,35 +512,6 @@ namespace apex_rt{
             return true;
         } 
     private:
-        // get weight for current instance
-        inline float get_weight( unsigned ridx ){
-            if( param.loss_type == 0 ){
-                return weight.size() == 0 ? 1.0f : weight[ ridx ];
-            }else{
-                // for compability issue
-                return grad_second[ ridx ] * 4.0f;
-            }
-        }
-    private:
-        // try to prune off current leaf, return true if successful
-        inline void try_prune_leaf( int nid, double rsum, double rsum_sgrad, int depth ){
-            if( tree[ nid ].is_root() ) return;
-            int pid = tree[ nid ].parent();
-            RTree::NodeStat &s = tree.stat( pid );
-            s.leaf_child_cnt ++; 
-            s.rsum = s.rsum + rsum; 
-            s.rsum_sgrad = s.rsum_sgrad + rsum_sgrad;
-
-            if( s.leaf_child_cnt >= 2 && s.loss_chg < param.get_min_split_loss( depth - 1 ) ){
-                // need to be pruned
-                apex_utils::assert_true( rsum_sgrad > 1e-5f, "second order derivative too low" );
-                tree.chg_to_leaf( pid, - param.learning_rate * s.rsum /( s.rsum_sgrad + param.wd_child ) );
-                // add statistics to number of nodes pruned
-                num_pruned += 2;
-                // tail recursion
-                this->try_prune_leaf( pid, s.rsum, s.rsum_sgrad, depth - 1 );
-            }
-        }
         // make leaf for current node :)
         inline void make_leaf( Task tsk, double rsum, double rweight, bool compute ){
             double rsum_sgrad = 0.0;
@@ -493,13 +524,7 @@ namespace apex_rt{
                     rweight += this->get_weight( ridx );
                 }
             }
-            if( rweight < param.min_child_weight ){
-                tree[ tsk.nid ].set_leaf( 0.0f );
-            }else{                
-                apex_utils::assert_true( rsum_sgrad > 1e-5f, "second order derivative too low" );
-                tree[ tsk.nid ].set_leaf( - param.learning_rate * rsum / ( rsum_sgrad + param.wd_child ) );                
-            }
-            this->try_prune_leaf( tsk.nid, rsum, rsum_sgrad, tree.get_depth( tsk.nid ) );
+            this->set_leaf( tsk.nid, rsum, rsum_sgrad, rweight );
         }
         
         // make split for current task, re-arrange positions in idset
@@ -707,8 +732,8 @@ namespace apex_rt{
                       std::vector<unsigned> &pgroup_id,
                       std::vector<float>    &pweight,
                       FMatrixS &psmat ):
-            param( pparam ), tree( ptree ), grad( pgrad ), grad_second( pgrad_second ),
-            mat( pmat ), group_id( pgroup_id ), weight( pweight ), smat( psmat ){            
+            RTreeUpdaterBase( pparam, ptree, pgrad, pgrad_second, pgroup_id, pweight ),
+            mat( pmat ), smat( psmat ){            
         }
         inline int do_boost( int &num_pruned ){
             this->init_tasks( grad.size() );
@@ -723,6 +748,246 @@ namespace apex_rt{
         }
     };
     
+    // updater of rtree using external memory feature matrix, the tree is grown level by level,
+    // for each level the blocks are streamed to build histograms of the expanding nodes,
+    // and streamed again to move the instances to the children, 
+    // only gradients, node positions and histograms are kept in memory
+    class RTreeExtUpdater: public RTreeUpdaterBase{
+    private:
+        // statistics of instances in a node
+        struct NStat{
+            double rsum, rsum_sgrad, rweight, rcnt;
+        };
+    private:
+        FMatrixExt &mat;
+        // node of each instance, -1 if the instance is in a finished leaf
+        std::vector<int> position;
+        // nodes to be expanded in current and next level, nodes to be splitted in current level
+        std::vector<int> qexpand, qnext, qsplit;
+        // statistics of nodes, indexed by node id
+        std::vector<NStat> nstat;
+        // slot of node in histogram, -1 if not in current batch
+        std::vector<int> slot;
+        // split feature and bin of nodes splitted in current level, instances with bin <= split bin go left
+        std::vector<int> sfeat, sbin;
+        // best split entry of nodes, start is used to store split bin + 1
+        std::vector<RTSelecter::Entry> best;
+        // offset of each feature in histogram of a node
+        std::vector<size_t> foffset;
+        // histogram of (grad, weight, count) for each slot, feature and bin
+        std::vector<double> hist;
+    private:
+        inline void resize_node( void ){
+            const size_t n = static_cast<size_t>( tree.param.num_nodes );
+            if( nstat.size() >= n ) return;
+            nstat.resize( n ); best.resize( n );
+            slot.resize( n, -1 ); sfeat.resize( n, -1 ); sbin.resize( n, -1 );
+        }
+        // statistics of nodes in qexpand
+        inline void calc_node_stat( void ){
+            for( size_t i = 0; i < qexpand.size(); i ++ ){
+                memset( &nstat[ qexpand[i] ], 0, sizeof(NStat) );
+            }
+            for( size_t r = 0; r < position.size(); r ++ ){
+                if( position[r] < 0 ) continue;
+                NStat &st = nstat[ position[r] ];
+                st.rsum += grad[r]; st.rsum_sgrad += grad_second[r];
+                st.rweight += this->get_weight( (unsigned)r ); st.rcnt += 1.0;
+            }
+        }
+        // enumerate splits of one node using histogram
+        inline void enum_split( int nid, const double *h, float min_split_loss ){
+            const NStat &st = nstat[ nid ];
+            const double rmean_sqr_sum = sqr( st.rsum / st.rweight ) * st.rweight;
+            RTSelecter sglobal( param );
+            for( size_t f = 0; f + 1 < foffset.size(); f ++ ){
+                const double *hf = h + foffset[f] * 3;
+                const int nb = static_cast<int>( foffset[f+1] - foffset[f] );
+                const std::vector<rt_float> &cut = mat.get_cut( f );
+                // local selecter
+                RTSelecter slocal( param );
+                {// forward process, default right, bins <= b go left
+                    double csum = 0.0, cweight = 0.0, ccnt = 0.0;
+                    for( int b = 0; b < nb; b ++ ){
+                        if( hf[ b*3+2 ] == 0.0 ) continue;
+                        csum += hf[ b*3 ]; cweight += hf[ b*3+1 ]; ccnt += hf[ b*3+2 ];
+                        if( ccnt < param.min_child_instance || cweight < param.min_child_weight ) continue;
+                        const double dweight = st.rweight - cweight;
+                        if( st.rcnt - ccnt < param.min_child_instance || dweight < param.min_child_weight ) break;
+                        double loss_chg = sqr( csum / cweight ) * cweight + sqr( (st.rsum - csum) / dweight ) * dweight - rmean_sqr_sum;
+                        slocal.push_back( RTSelecter::Entry( loss_chg, b + 1, (int)ccnt, (unsigned)f, 
+                                                             b + 1 < nb ? cut[b] : FLT_MAX, false ), min_split_loss );
+                    }
+                }
+                {// backward process, default left, bins >= b go right
+                    double csum = 0.0, cweight = 0.0, ccnt = 0.0;
+                    for( int b = nb - 1; b >= 0; b -- ){
+                        if( hf[ b*3+2 ] == 0.0 ) continue;
+                        csum += hf[ b*3 ]; cweight += hf[ b*3+1 ]; ccnt += hf[ b*3+2 ];
+                        if( ccnt < param.min_child_instance || cweight < param.min_child_weight ) continue;
+                        const double dweight = st.rweight - cweight;
+                        if( st.rcnt - ccnt < param.min_child_instance || dweight < param.min_child_weight ) break;
+                        double loss_chg = sqr( csum / cweight ) * cweight + sqr( (st.rsum - csum) / dweight ) * dweight - rmean_sqr_sum;
+                        slocal.push_back( RTSelecter::Entry( loss_chg, b, (int)ccnt, (unsigned)f, 
+                                                             b > 0 ? cut[b-1] : -FLT_MAX, true ), min_split_loss );
+                    }
+                    sglobal.push_back( slocal.select(), min_split_loss );
+                }
+            }
+            best[ nid ] = sglobal.select();
+        }
+        // find best split for nodes in qsplit, nodes are processed in batches that fit histogram memory
+        inline void find_split( int depth ){
+            const size_t nbin = foffset.back();
+            size_t nbatch = static_cast<size_t>( param.hist_mem * 1024.0 * 1024.0 / ( nbin * 3 * sizeof(double) + 1 ) );
+            if( nbatch == 0 ) nbatch = 1;
+            for( size_t start = 0; start < qsplit.size(); start += nbatch ){
+                const size_t end = std::min( qsplit.size(), start + nbatch );
+                for( size_t i = start; i < end; i ++ ){
+                    slot[ qsplit[i] ] = static_cast<int>( i - start );
+                }
+                hist.resize( ( end - start ) * nbin * 3 );
+                std::fill( hist.begin(), hist.end(), 0.0 );
+                // stream the blocks
+                FMatrixExt::Block b;
+                mat.before_first();
+                while( mat.next_block( b ) ){
+                    for( unsigned c = 0; c < b.num_col; c ++ ){
+                        const size_t off = foffset[ b.findex[c] ];
+                        for( unsigned k = b.col_ptr[c]; k < b.col_ptr[c+1]; k ++ ){
+                            const size_t ridx = b.row_base + b.rindex[k];
+                            const int nid = position[ ridx ];
+                            if( nid < 0 || slot[ nid ] < 0 ) continue;
+                            double *h = &hist[ ( slot[ nid ] * nbin + off + b.bin[k] ) * 3 ];
+                            h[0] += grad[ ridx ]; 
+                            h[1] += this->get_weight( (unsigned)ridx ); 
+                            h[2] += 1.0;
+                        }
+                    }
+                }
+                for( size_t i = start; i < end; i ++ ){
+                    this->enum_split( qsplit[i], &hist[ slot[ qsplit[i] ] * nbin * 3 ], param.get_min_split_loss( depth ) );
+                    slot[ qsplit[i] ] = -1;
+                }
+            }
+        }
+        // move instances of splitted nodes to children, default direction first, then by feature value
+        inline void update_position( void ){
+            for( size_t r = 0; r < position.size(); r ++ ){
+                const int nid = position[r];
+                if( nid < 0 ) continue;
+                const RTree::Node &n = tree[ nid ];
+                position[r] = n.default_left() ? n.left : n.right;
+            }
+            FMatrixExt::Block b;
+            mat.before_first();
+            while( mat.next_block( b ) ){
+                for( unsigned c = 0; c < b.num_col; c ++ ){
+                    const int fid = static_cast<int>( b.findex[c] );
+                    for( unsigned k = b.col_ptr[c]; k < b.col_ptr[c+1]; k ++ ){
+                        const size_t ridx = b.row_base + b.rindex[k];
+                        if( position[ ridx ] < 0 ) continue;
+                        const int pid = tree[ position[ ridx ] ].parent();
+                        if( sfeat[ pid ] != fid ) continue;
+                        position[ ridx ] = (int)b.bin[k] <= sbin[ pid ] ? tree[ pid ].left : tree[ pid ].right;
+                    }
+                }
+            }
+        }
+    public:
+        RTreeExtUpdater( const RTParamTrain &pparam, 
+                         RTree &ptree,
+                         std::vector<float> &pgrad,
+                         std::vector<float> &pgrad_second,
+                         FMatrixExt &pmat,
+                         std::vector<unsigned> &pgroup_id,
+                         std::vector<float>    &pweight ):
+            RTreeUpdaterBase( pparam, ptree, pgrad, pgrad_second, pgroup_id, pweight ), mat( pmat ){            
+        }
+        inline int do_boost( int &num_pruned ){
+            const size_t nrow = grad.size();
+            apex_utils::assert_true( mat.num_row() == nrow, "number of rows in external matrix do not match gradient" );
+            // initial position, partition by group
+            position.resize( nrow );
+            if( group_id.size() == 0 ){
+                std::fill( position.begin(), position.end(), 0 );
+            }else{
+                apex_utils::assert_true( group_id.size() == nrow, "number of groups must be exact" );
+                for( size_t i = 0; i < nrow; i ++ ){
+                    apex_utils::assert_true( group_id[ i ] < (unsigned)tree.param.num_roots, "group id exceed number of roots" );
+                    position[i] = static_cast<int>( group_id[i] );
+                }
+            }
+            // histogram layout 
+            foffset.resize( mat.num_feature() + 1 ); foffset[0] = 0;
+            for( size_t f = 0; f < mat.num_feature(); f ++ ){
+                foffset[f+1] = foffset[f] + mat.get_cut( f ).size() + 1;
+            }
+            qexpand.clear();
+            for( int i = 0; i < tree.param.num_roots; i ++ ){
+                qexpand.push_back( i );
+            }
+            this->max_depth = 0;
+            this->num_pruned = 0;
+            for( int depth = 0; qexpand.size() != 0; depth ++ ){
+                this->resize_node();
+                this->calc_node_stat();
+                qsplit.clear();
+                for( size_t i = 0; i < qexpand.size(); i ++ ){
+                    const int nid = qexpand[i];
+                    const NStat &st = nstat[ nid ];
+                    // groups without instance are not touched
+                    if( depth == 0 && st.rcnt == 0.0 ) continue;
+                    if( depth > max_depth ) max_depth = depth;
+                    if( depth >= param.max_depth || st.rcnt < param.min_split_instance || st.rweight < param.min_split_weight ){
+                        this->set_leaf( nid, st.rsum, st.rsum_sgrad, st.rweight );
+                    }else{
+                        qsplit.push_back( nid );
+                    }
+                }
+                this->find_split( depth );
+                // make leaf for nodes without good split, then release their instances 
+                // before adding childs, since ids of pruned nodes can be reused
+                size_t top = 0;
+                for( size_t i = 0; i < qsplit.size(); i ++ ){
+                    const int nid = qsplit[i];
+                    if( best[ nid ].loss_chg > rt_eps ){
+                        qsplit[ top ++ ] = nid; sfeat[ nid ] = (int)best[ nid ].split_index();
+                    }else{
+                        const NStat &st = nstat[ nid ];
+                        this->set_leaf( nid, st.rsum, st.rsum_sgrad, st.rweight );
+                    }
+                }
+                qsplit.resize( top );
+                for( size_t r = 0; r < nrow; r ++ ){
+                    if( position[r] >= 0 && sfeat[ position[r] ] < 0 ) position[r] = -1;
+                }
+                qnext.clear();
+                for( size_t i = 0; i < qsplit.size(); i ++ ){
+                    const int nid = qsplit[i];
+                    const RTSelecter::Entry &e = best[ nid ];
+                    tree[ nid ].set_split( e.split_index(), e.split_value, e.default_left() );
+                    RTree::NodeStat &s = tree.stat( nid );
+                    s.loss_chg = e.loss_chg; 
+                    s.leaf_child_cnt = 0;
+                    s.rsum = s.rsum_sgrad = 0.0f;
+                    tree.add_childs( nid );
+                    sbin[ nid ] = static_cast<int>( e.start ) - 1;
+                    qnext.push_back( tree[ nid ].left );
+                    qnext.push_back( tree[ nid ].right );
+                }
+                this->resize_node();
+                this->update_position();
+                for( size_t i = 0; i < qsplit.size(); i ++ ){
+                    sfeat[ qsplit[i] ] = -1;
+                }
+                qexpand.swap( qnext );
+            }
+            num_pruned = this->num_pruned;
+            return max_depth;
+        }
+    };
+
     class RTreeTrainer : public IRTTrainer{
     private:
         int silent;
@@ -768,6 +1033,25 @@ namespace apex_rt{
             }
         }
 
+        virtual void do_boost( std::vector<float> &grad, 
+                               std::vector<float> &grad_second,
+                               FMatrixExt &mat,
+                               std::vector<unsigned> &group_id,
+                               std::vector<float>    &weight ){
+            apex_utils::assert_true( grad.size() < UINT_MAX, "number of instance exceed what we can handle" );
+            if( check_bug || !silent ){
+                printf( "\nbuild GBRT with %u instances, external memory\n", (unsigned)grad.size() );
+            }
+            RTreeExtUpdater updater( param, tree, grad, grad_second, mat, group_id, weight );
+            int num_pruned;
+            tree.param.max_depth = updater.do_boost( num_pruned );
+
+            if( check_bug || !silent ){
+                printf( "tree train end, %d roots, %d extra nodes, %d pruned nodes ,max_depth=%d\n", 
+                        tree.param.num_roots, tree.num_extra_nodes(), num_pruned, tree.param.max_depth );
+            }
+        }
+
         virtual int get_leaf_id( const FVector &feat, const FVector &fcommon, unsigned gid = 0 ){
             // start from groups that belongs to current data
             int pid = (int)gid;
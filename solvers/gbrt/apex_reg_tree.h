@@ -24,6 +24,8 @@
  */
 #include <vector>
 #include <climits>
+#include <cstring>
+#include <algorithm>
 #include "../../apex-utils/apex_utils.h"
 
 /*! \brief namespace of regression tree */
@@ -228,6 +230,433 @@ namespace apex_rt{
         }
     };
 
+    /*! 
+     * \brief external memory feature matrix, rows are binned and stored on disk as blocks,
+     *   inside each block entries are grouped by column, with 16 bit row offset and 8 bit bin,
+     *   feature index follows the same convention as the tree: group sparse, spec sparse, then dense part,
+     *   cut points are weighted quantiles of each feature over all the rows, decided at the end of the first pass
+     */
+    class FMatrixExt{
+    public:
+        /*! \brief maximum number of rows in a block, row offset is stored in 16 bits */
+        const static unsigned kMaxBlockRow = 1U << 16;
+        /*! \brief a block of rows, pointers valid until next call of next_block */
+        struct Block{
+            /*! \brief index of first row in this block */
+            size_t   row_base;
+            /*! \brief number of rows in this block */
+            unsigned num_row;
+            /*! \brief number of columns that have entries in this block */
+            unsigned num_col;
+            /*! \brief feature index of each column */
+            const rt_uint  *findex;
+            /*! \brief column pointer, entries of column i are in [col_ptr[i], col_ptr[i+1]) */
+            const unsigned *col_ptr;
+            /*! \brief row offset of each entry, relative to row_base */
+            const unsigned short *rindex;
+            /*! \brief bin of each entry */
+            const unsigned char  *bin;
+        };
+    private:
+        /*! \brief pending entry of rows not yet written */
+        struct Entry{
+            rt_uint  findex;
+            rt_float fvalue;
+            unsigned rindex;
+            inline bool operator<( const Entry &p ) const{
+                if( findex != p.findex ) return findex < p.findex;
+                return rindex < p.rindex;
+            }
+        };
+        /*! \brief header of block on disk */
+        struct BlockHeader{
+            unsigned num_row, num_col, num_entry;
+        };
+        /*! \brief value and total weight of entries summarized by it */
+        struct WEntry{
+            rt_float value;
+            double   weight;
+        };
+        /*! 
+         * \brief mergeable quantile summary of a feature, level l summarizes 2^l blocks, 
+         *   each level keeps at most max_size values, and the weight of a value includes all values pruned into it,
+         *   so the cumulative weight at a kept value is exact within the level, the rank error of merged levels 
+         *   is bounded by the sum of their gaps, about (number of levels) * total / max_size
+         */
+        struct QSketch{
+            std::vector< std::vector<WEntry> > level;
+            // merge sorted summaries a and b into dst
+            inline static void merge( std::vector<WEntry> &dst, const std::vector<WEntry> &a, const std::vector<WEntry> &b ){
+                dst.resize( 0 );
+                size_t i = 0, j = 0;
+                while( i < a.size() || j < b.size() ){
+                    WEntry e;
+                    if( j == b.size() || ( i < a.size() && a[i].value < b[j].value ) ){
+                        e = a[ i ++ ];
+                    }else if( i == a.size() || b[j].value < a[i].value ){
+                        e = b[ j ++ ];
+                    }else{
+                        e = a[ i ++ ]; e.weight += b[ j ++ ].weight;
+                    }
+                    dst.push_back( e );
+                }
+            }
+            // keep at most max_size values, each kept value takes the weight of the values before it that are dropped
+            inline static void prune( std::vector<WEntry> &s, size_t max_size ){
+                if( s.size() <= max_size ) return;
+                double total = 0.0;
+                for( size_t i = 0; i < s.size(); i ++ ) total += s[i].weight;
+                const double step = total / max_size;
+                size_t top = 0;
+                double acc = 0.0, next = step;
+                for( size_t i = 0; i < s.size(); i ++ ){
+                    acc += s[i].weight;
+                    if( acc >= next || i + 1 == s.size() ){
+                        s[ top ].value = s[i].value;
+                        s[ top ].weight = acc;
+                        top ++; 
+                        while( next <= acc ) next += step;
+                    }
+                }
+                s.resize( top );
+                // weights were cumulative, turn them back to per value weights
+                for( size_t i = top; i > 1; i -- ) s[i-1].weight -= s[i-2].weight;
+            }
+            inline void push( std::vector<WEntry> &carry, size_t max_size, std::vector<WEntry> &tmp ){
+                prune( carry, max_size );
+                for( size_t l = 0; ; l ++ ){
+                    if( l == level.size() ) level.resize( l + 1 );
+                    if( level[l].size() == 0 ){
+                        level[l].swap( carry ); return;
+                    }
+                    merge( tmp, level[l], carry );
+                    prune( tmp, max_size );
+                    level[l].resize( 0 );
+                    carry.swap( tmp );
+                }
+            }
+            // merge all the levels into dst
+            inline void finalize( std::vector<WEntry> &dst, std::vector<WEntry> &tmp ){
+                dst.resize( 0 );
+                for( size_t l = 0; l < level.size(); l ++ ){
+                    merge( tmp, dst, level[l] );
+                    dst.swap( tmp );
+                }
+                level.clear();
+            }
+        };
+    private:
+        /*! \brief name of the file storing the blocks */
+        char fname[ 256 ];
+        /*! \brief file storing the blocks */
+        FILE *fp;
+        /*! \brief number of rows in block, number of bins per feature */
+        unsigned block_row, max_bin;
+        /*! \brief number of rows written to disk and in pending block */
+        size_t nrow_disk;
+        unsigned nrow_pend;
+        /*! \brief number of blocks written to disk, block cursor during reading */
+        size_t nblock, rblock;
+        /*! \brief cut points of each feature, a value v goes to bin upper_bound( cuts, v ) */
+        std::vector< std::vector<rt_float> > cuts;
+        /*! 
+         * \brief whether cut points are decided, they are decided at the end of the first pass over the data, 
+         *   during which unbinned blocks are written to an anonymous temporary file and values are summarized in sketch
+         */
+        bool cut_ready;
+        /*! \brief file of unbinned blocks in first pass */
+        FILE *fraw;
+        /*! \brief quantile summary of each feature in first pass */
+        std::vector<QSketch> sketch;
+        std::vector<WEntry> wtmp, wcarry;
+        /*! \brief entries of pending block */
+        std::vector<Entry> pend;
+        /*! \brief current group sparse part, shared by rows added after it */
+        std::vector<rt_uint>  sp_findex;
+        std::vector<rt_float> sp_fvalue;
+        /*! \brief buffers of block being written or read */
+        BlockHeader hdr;
+        std::vector<rt_uint>  b_findex;
+        std::vector<unsigned> b_colptr;
+        std::vector<unsigned short> b_rindex;
+        std::vector<unsigned char>  b_bin;
+        std::vector<rt_float> tmp_value;
+    private:
+        // size of quantile summary kept for each feature
+        inline size_t sketch_size( void ) const{
+            return static_cast<size_t>( max_bin ) * 32;
+        }
+        // add values of a feature in current block to its summary
+        inline void add_sketch( rt_uint fid, const Entry *e, size_t n ){
+            tmp_value.resize( n );
+            for( size_t i = 0; i < n; i ++ ) tmp_value[i] = e[i].fvalue;
+            std::sort( tmp_value.begin(), tmp_value.end() );
+            wcarry.resize( 0 );
+            for( size_t i = 0; i < n; ){
+                size_t j = i;
+                while( j < n && tmp_value[j] == tmp_value[i] ) j ++;
+                WEntry w; w.value = tmp_value[i]; w.weight = (double)( j - i );
+                wcarry.push_back( w );
+                i = j;
+            }
+            if( fid >= sketch.size() ) sketch.resize( fid + 1 );
+            sketch[ fid ].push( wcarry, this->sketch_size(), wtmp );
+        }
+        // decide cut points of a feature from the summary of all its values
+        inline void make_cut( rt_uint fid ){
+            std::vector<rt_float> &c = cuts[ fid ];
+            c.clear();
+            if( fid >= sketch.size() ) return;
+            sketch[ fid ].finalize( wcarry, wtmp );
+            const std::vector<WEntry> &v = wcarry;
+            if( v.size() <= max_bin ){
+                // every distinct value gets its own bin, values are exact since the summary was never pruned
+                for( size_t i = 1; i < v.size(); i ++ ){
+                    c.push_back( 0.5f * ( v[i-1].value + v[i].value ) );
+                }
+                return;
+            }
+            // weighted quantiles, cut after the first value whose cumulative weight reaches k/max_bin of the total
+            double total = 0.0;
+            for( size_t i = 0; i < v.size(); i ++ ) total += v[i].weight;
+            double acc = 0.0;
+            unsigned k = 1;
+            for( size_t i = 0; i + 1 < v.size() && k < max_bin; i ++ ){
+                acc += v[i].weight;
+                if( acc < total * k / max_bin ) continue;
+                const rt_float cv = 0.5f * ( v[i].value + v[i+1].value );
+                if( c.size() == 0 || c.back() < cv ) c.push_back( cv );
+                while( k < max_bin && acc >= total * k / max_bin ) k ++;
+            }
+        }
+        // bin the sorted pending entries and write them as a block
+        inline void write_block( void ){
+            b_findex.resize( 0 ); b_colptr.resize( 0 );
+            b_rindex.resize( pend.size() ); b_bin.resize( pend.size() );
+            for( size_t i = 0; i < pend.size(); ){
+                size_t j = i;
+                const rt_uint fid = pend[i].findex;
+                while( j < pend.size() && pend[j].findex == fid ) j ++;
+                // a feature missing in the first pass has a single bin
+                if( fid >= cuts.size() ) cuts.resize( fid + 1 );
+                const std::vector<rt_float> &c = cuts[ fid ];
+                b_findex.push_back( fid );
+                b_colptr.push_back( (unsigned)i );
+                for( size_t k = i; k < j; k ++ ){
+                    b_rindex[k] = (unsigned short)pend[k].rindex;
+                    b_bin[k] = (unsigned char)( std::upper_bound( c.begin(), c.end(), pend[k].fvalue ) - c.begin() );
+                }
+                i = j;
+            }
+            b_colptr.push_back( (unsigned)pend.size() );
+            hdr.num_row = nrow_pend; 
+            hdr.num_col = (unsigned)b_findex.size(); 
+            hdr.num_entry = (unsigned)pend.size();
+            fwrite( &hdr, sizeof(BlockHeader), 1, fp );
+            if( hdr.num_col != 0 ){
+                fwrite( &b_findex[0], sizeof(rt_uint), b_findex.size(), fp );
+            }
+            fwrite( &b_colptr[0], sizeof(unsigned), b_colptr.size(), fp );
+            if( hdr.num_entry != 0 ){
+                fwrite( &b_rindex[0], sizeof(unsigned short), b_rindex.size(), fp );
+                fwrite( &b_bin[0], sizeof(unsigned char), b_bin.size(), fp );
+            }
+            nblock ++;
+        }
+        // write the pending rows as a block, unbinned to fraw if cut points are not decided yet
+        inline void flush_block( void ){
+            if( nrow_pend == 0 ) return;
+            std::sort( pend.begin(), pend.end() );
+            if( cut_ready ){
+                this->write_block();
+            }else{
+                for( size_t i = 0; i < pend.size(); ){
+                    size_t j = i;
+                    while( j < pend.size() && pend[j].findex == pend[i].findex ) j ++;
+                    this->add_sketch( pend[i].findex, &pend[i], j - i );
+                    i = j;
+                }
+                const unsigned nh[2] = { nrow_pend, (unsigned)pend.size() };
+                fwrite( nh, sizeof(unsigned), 2, fraw );
+                if( pend.size() != 0 ) fwrite( &pend[0], sizeof(Entry), pend.size(), fraw );
+                nblock ++;
+            }
+            nrow_disk += nrow_pend; nrow_pend = 0;
+            pend.resize( 0 );
+        }
+        // end of first pass: decide all cut points from the summaries, then bin the blocks in fraw
+        inline void make_cuts( void ){
+            cuts.resize( sketch.size() );
+            for( size_t fid = 0; fid < sketch.size(); fid ++ ){
+                this->make_cut( (rt_uint)fid );
+            }
+            sketch.clear();
+            cut_ready = true;
+            fseek( fraw, 0, SEEK_SET );
+            unsigned nh[2];
+            const size_t nraw = nblock;
+            nblock = 0;
+            for( size_t i = 0; i < nraw; i ++ ){
+                apex_utils::assert_true( fread( nh, sizeof(unsigned), 2, fraw ) == 2, "FMatrixExt: load unbinned block" );
+                pend.resize( nh[1] );
+                if( nh[1] != 0 ){
+                    apex_utils::assert_true( fread( &pend[0], sizeof(Entry), nh[1], fraw ) == nh[1], "FMatrixExt: load unbinned block" );
+                }
+                nrow_pend = nh[0];
+                this->write_block();
+            }
+            nrow_pend = 0; pend.resize( 0 );
+            fclose( fraw ); fraw = NULL;
+        }
+        inline void add_entry( rt_uint findex, rt_float fvalue ){
+            Entry e;
+            e.findex = findex; e.fvalue = fvalue; e.rindex = nrow_pend;
+            pend.push_back( e );
+        }
+    public:
+        FMatrixExt( void ){
+            fp = NULL; fraw = NULL; cut_ready = false; strcpy( fname, "NULL" );
+            block_row = kMaxBlockRow; max_bin = 256;
+            nrow_disk = 0; nrow_pend = 0; nblock = 0; rblock = 0;
+        }
+        ~FMatrixExt( void ){
+            if( fp != NULL ){
+                fclose( fp ); remove( fname );
+            }
+            if( fraw != NULL ) fclose( fraw );
+        }
+        /*! \brief whether external memory mode is enabled */
+        inline bool is_enabled( void ) const{
+            return strcmp( fname, "NULL" ) != 0;
+        }
+        /*! 
+         * \brief set parameters
+         *   rt_extmem: file used to store the blocks, it must not exist and is removed at the end, NULL means disabled
+         *   rt_extmem_block: number of rows in a block
+         *   rt_max_bin: maximum number of bins of each feature
+         */
+        inline void set_param( const char *name, const char *val ){
+            if( !strcmp( name, "rt_extmem" ) )       strcpy( fname, val );
+            if( !strcmp( name, "rt_extmem_block" ) ) block_row = (unsigned)atoi( val );
+            if( !strcmp( name, "rt_max_bin" ) )      max_bin = (unsigned)atoi( val );
+        }
+        /*! \brief number of rows */
+        inline size_t num_row( void ) const{
+            return nrow_disk + nrow_pend;
+        }
+        /*! \brief number of features that have cut points */
+        inline size_t num_feature( void ) const{
+            return cuts.size();
+        }
+        /*! \brief cut points of feature, bin b covers values in [cut[b-1], cut[b]) */
+        inline const std::vector<rt_float> &get_cut( size_t fid ) const{
+            return cuts[ fid ];
+        }
+        /*! \brief clear the rows, cut points are kept since the data won't change between rounds */
+        inline void clear( void ){
+            apex_utils::assert_true( block_row > 0 && block_row <= kMaxBlockRow, "rt_extmem_block exceed bound" );
+            apex_utils::assert_true( max_bin >= 2 && max_bin <= 256, "rt_max_bin must be in [2,256]" );
+            if( fp == NULL ){
+                // never truncate a file of user, the file is created once and rewritten from start in later rounds
+                FILE *fo = fopen( fname, "rb" );
+                if( fo != NULL ){
+                    fclose( fo );
+                    char msg[ 512 ];
+                    sprintf( msg, "FMatrixExt: rt_extmem file \"%.256s\" already exists, remove it or choose another file", fname );
+                    apex_utils::error( msg );
+                }
+                fp = apex_utils::fopen_check( fname, "w+b" );
+            }else{
+                fseek( fp, 0, SEEK_SET );
+            }
+            if( !cut_ready ){
+                if( fraw != NULL ) fclose( fraw );
+                fraw = tmpfile();
+                apex_utils::assert_true( fraw != NULL, "FMatrixExt: can not create temporary file" );
+                sketch.clear();
+            }
+            nrow_disk = 0; nrow_pend = 0; nblock = 0;
+            pend.resize( 0 );
+        }
+        /*! 
+         * \brief set group sparse part, used by rows added afterwards 
+         * \param feat sparse feature
+         * \param fstart start bound of feature
+         * \param fend   end bound range of feature
+         */
+        inline void set_spart( FVectorSparse feat, unsigned fstart = 0, unsigned fend = UINT_MAX ){
+            sp_findex.resize( 0 ); sp_fvalue.resize( 0 );
+            for( int i = 0; i < feat.len; i ++ ){
+                if( feat.findex[i] < fstart || feat.findex[i] >= fend ) continue;
+                sp_findex.push_back( feat.findex[i] );
+                sp_fvalue.push_back( feat.fvalue[i] );
+            }
+        }
+        /*! 
+         * \brief add one row 
+         * \param dense dense part of the row
+         * \param spec  spec sparse part of the row
+         * \param num_group_sparse number of group sparse feature
+         * \param num_spec_sparse  number of spec sparse feature
+         * \return the row added
+         */
+        inline size_t add_row( const FVector &dense, const FVectorSparse &spec, int num_group_sparse, int num_spec_sparse ){
+            if( fp == NULL ) this->clear();
+            for( size_t i = 0; i < sp_findex.size(); i ++ ){
+                this->add_entry( sp_findex[i], sp_fvalue[i] );
+            }
+            for( int i = 0; i < spec.len; i ++ ){
+                this->add_entry( spec.findex[i] + num_group_sparse, spec.fvalue[i] );
+            }
+            const rt_uint base = num_group_sparse + num_spec_sparse;
+            for( int i = 0; i < dense.size(); i ++ ){
+                if( !dense.is_unknown( i ) ) this->add_entry( i + base, dense[i] );
+            }
+            if( ++ nrow_pend == block_row ) this->flush_block();
+            return this->num_row() - 1;
+        }
+        /*! \brief write remaining rows to disk, must be called before reading */
+        inline void flush( void ){
+            if( fp == NULL ) this->clear();
+            this->flush_block();
+            if( !cut_ready ) this->make_cuts();
+            fflush( fp );
+        }
+        /*! \brief move reading cursor before first block */
+        inline void before_first( void ){
+            apex_utils::assert_true( nrow_pend == 0, "FMatrixExt: need to flush before reading" );
+            fseek( fp, 0, SEEK_SET );
+            rblock = 0; hdr.num_row = 0;
+            b.row_base = 0; 
+        }
+        /*! \brief read next block, return false if reaches end */
+        inline bool next_block( Block &blk ){
+            if( rblock >= nblock ) return false;
+            b.row_base += hdr.num_row;
+            apex_utils::assert_true( fread( &hdr, sizeof(BlockHeader), 1, fp ) > 0, "FMatrixExt: load block" );
+            b_findex.resize( hdr.num_col ); b_colptr.resize( hdr.num_col + 1 );
+            b_rindex.resize( hdr.num_entry ); b_bin.resize( hdr.num_entry );
+            if( hdr.num_col != 0 ){
+                apex_utils::assert_true( fread( &b_findex[0], sizeof(rt_uint), hdr.num_col, fp ) > 0, "FMatrixExt: load block" );
+            }
+            apex_utils::assert_true( fread( &b_colptr[0], sizeof(unsigned), hdr.num_col + 1, fp ) > 0, "FMatrixExt: load block" );
+            if( hdr.num_entry != 0 ){
+                apex_utils::assert_true( fread( &b_rindex[0], sizeof(unsigned short), hdr.num_entry, fp ) > 0, "FMatrixExt: load block" );
+                apex_utils::assert_true( fread( &b_bin[0], sizeof(unsigned char), hdr.num_entry, fp ) > 0, "FMatrixExt: load block" );
+            }
+            b.num_row = hdr.num_row; b.num_col = hdr.num_col;
+            b.findex  = hdr.num_col != 0 ? &b_findex[0] : NULL;
+            b.col_ptr = &b_colptr[0];
+            b.rindex  = hdr.num_entry != 0 ? &b_rindex[0] : NULL;
+            b.bin     = hdr.num_entry != 0 ? &b_bin[0] : NULL;
+            blk = b; rblock ++;
+            return true;
+        }
+    private:
+        /*! \brief block being read */
+        Block b;
+    };
+
     /*! \brief interface of single regression trainer */
     class IRTTrainer{
     public:
@@ -278,6 +707,19 @@ namespace apex_rt{
                                std::vector<unsigned> &group_id,
                                std::vector<float>    &weight,
                                FMatrixS &smat ) = 0;        
+        /*! 
+         * \brief do gradient boost training for one step, with features stored in external memory
+         * \param grad first order gradient of each instance
+         * \param grad_second second order gradient of each instance
+         * \param mat binned feature matrix stored on disk, only block-wise streaming access is used
+         * \param group_id pre-partitioned group id of each instance, can be empty which indicates that no pre-partition involved
+         * \param weight weight of each instance, can be empty which means weight=1 for all instances
+         */
+        virtual void do_boost( std::vector<float> &grad, 
+                               std::vector<float> &grad_second,
+                               FMatrixExt &mat,
+                               std::vector<unsigned> &group_id,
+                               std::vector<float>    &weight ){ apex_utils::error("external memory not supported by this tree"); }
         /*! 
          * \brief predict values for given feature, and common user feature,
          *        a preliminary implementation handles the case where fcommon is empty and gid = 0
@@ -40,6 +40,24 @@ namespace apex_svd{
         int input_type;
         IDataIterator<SVDFeatureCSR::Elem> *itr_csr;
         IDataIterator<SVDPlusBlock>        *itr_plus;
+    private:
+        // evaluation data, configured by parameters with prefix "eval:"
+        int eval_input_type;
+        IDataIterator<SVDFeatureCSR::Elem> *itr_eval_csr;
+        IDataIterator<SVDPlusBlock>        *itr_eval_plus;
+        // stop training if evaluation rmse doesn't improve for early_stop_round rounds, 0 means never stop
+        int early_stop_round;
+        // best evaluation result so far 
+        double best_eval;
+        int    best_round;
+    private:
+        // CSR samples are read prefetch_distance ahead of training, so the trainer can prefetch their model rows
+        int prefetch_distance;
+        // ring of samples read ahead, each slot holds a copy of its sample in its own arena
+        std::vector<SVDFeatureCSR::Elem> ahead;
+        std::vector<apex_utils::MemoryArena> ahead_arena;
+        size_t ahead_head, ahead_count;
+        bool   ahead_end;
     private:
         // initialize end
         int init_end;
@@ -71,6 +89,15 @@ namespace apex_svd{
             this->input_type  = input_type::BINARY_BUFFER;
             this->itr_csr     = NULL;
             this->itr_plus    = NULL;
+            this->eval_input_type = -1;
+            this->itr_eval_csr    = NULL;
+            this->itr_eval_plus   = NULL;
+            this->early_stop_round = 0;
+            this->best_eval  = 1e30;
+            this->best_round = -1;
+            this->prefetch_distance = 0;
+            this->ahead_head = this->ahead_count = 0;
+            this->ahead_end  = false;
             strcpy( name_config, "config.conf" );
             strcpy( name_job, "" );
             strcpy( name_model_out_folder, "models" );
@@ -90,6 +117,8 @@ namespace apex_svd{
                 delete svd_trainer;
                 if( itr_csr != NULL ) delete itr_csr;
                 if( itr_plus!= NULL ) delete itr_plus;
+                if( itr_eval_csr != NULL ) delete itr_eval_csr;
+                if( itr_eval_plus!= NULL ) delete itr_eval_plus;
             }
         }
     private:
@@ -107,6 +136,9 @@ namespace apex_svd{
             if( !strcmp( name, "job") )               strcpy( name_job, val ); 
             if( !strcmp( name, "print_ratio") )       print_ratio= (float)atof( val );            
             if( !strcmp( name, "input_type"  ))       input_type = atoi( val ); 
+            if( !strcmp( name, "eval:input_type"  ))  eval_input_type = atoi( val ); 
+            if( !strcmp( name, "early_stop_round" ))  early_stop_round = atoi( val ); 
+            if( !strcmp( name, "prefetch_distance" )) prefetch_distance = atoi( val ); 
             mtype.set_param( name, val );
         }
         
@@ -141,6 +173,35 @@ namespace apex_svd{
             if( itr_csr != NULL ) itr_csr->init();
             if( itr_plus!= NULL ) itr_plus->init();
         }
+        
+        // configure evaluation iterator, only created when parameters with prefix "eval:" are given
+        inline void configure_eval_iterator( void ){
+            bool has_eval = false;
+            cfg.before_first();
+            while( cfg.next() ){
+                if( !strncmp( cfg.name(), "eval:", 5 ) ) has_eval = true;
+            }
+            if( !has_eval ) return;
+            if( eval_input_type < 0 ) eval_input_type = input_type;
+            if( mtype.format_type == svd_type::USER_GROUP_FORMAT ){
+                this->itr_eval_plus = create_plus_iterator( eval_input_type );
+            }else{
+                this->itr_eval_csr = create_csr_iterator( eval_input_type );
+            }        
+            cfg.before_first();
+            while( cfg.next() ){
+                char name[ 256 ];
+                if( !strncmp( cfg.name(), "eval:", 5 ) ){
+                    sscanf( cfg.name(), "eval:%s", name );
+                }else if( !strcmp( cfg.name(), "scale_score" ) || !strcmp( cfg.name(), "silent" ) || !strncmp( cfg.name(), "hash_", 5 ) ){
+                    strcpy( name, cfg.name() );
+                }else continue;
+                if( itr_eval_csr != NULL ) itr_eval_csr->set_param ( name, cfg.val() );
+                if( itr_eval_plus!= NULL ) itr_eval_plus->set_param( name, cfg.val() );
+            }
+            if( itr_eval_csr != NULL ) itr_eval_csr->init();
+            if( itr_eval_plus!= NULL ) itr_eval_plus->init();
+        }
 
         inline void configure_trainer( void ){
             cfg.before_first();
@@ -148,6 +209,13 @@ namespace apex_svd{
                 svd_trainer->set_param( cfg.name(), cfg.val() );
             }
         }
+        // settings of paged user factors are needed before the model is loaded
+        inline void configure_page( void ){
+            cfg.before_first();
+            while( cfg.next() ){
+                if( !strncmp( cfg.name(), "page_", 5 ) ) svd_trainer->set_param( cfg.name(), cfg.val() );
+            }
+        }
         
         // load in latest model from model_folder
         inline int sync_latest_model( void ){
@@ -164,6 +232,9 @@ namespace apex_svd{
             if( last != NULL ){
                 apex_utils::assert_true( fread( &mtype, sizeof(SVDTypeParam), 1, last ) > 0, "loading model" );
                 svd_trainer = create_svd_trainer( mtype );
+                // only a checkpoint of the same run may restore its cached results of the training data
+                svd_trainer->set_param( "res_buf_restore", "1" );
+                this->configure_page();
                 svd_trainer->load_model( last );
                 start_counter = s_counter - 1;
                 fclose( last );
@@ -177,6 +248,7 @@ namespace apex_svd{
             // load model from file 
             apex_utils::assert_true( fread( &mtype, sizeof(SVDTypeParam), 1, fi ) > 0, "loading model" );
             svd_trainer = create_svd_trainer( mtype );
+            this->configure_page();
             svd_trainer->load_model( fi );
             fclose( fi );
         }
@@ -213,10 +285,44 @@ namespace apex_svd{
                 }
             }
             this->configure_iterator();
+            this->configure_eval_iterator();
             svd_trainer->init_trainer();
             this->init_end = 1;           
         }     
 
+        // get next block to train, blocks are prefetched by the trainer itself
+        inline bool next_sample( IDataIterator<SVDPlusBlock> *itr, SVDPlusBlock &dt ){
+            return itr->next( dt );
+        }
+        // get next sample to train, the sample prefetch_distance ahead is read and prefetched
+        inline bool next_sample( IDataIterator<SVDFeatureCSR::Elem> *itr, SVDFeatureCSR::Elem &dt ){
+            if( prefetch_distance <= 0 ) return itr->next( dt );
+            // one extra slot, so the sample returned in last call is kept until this call returns
+            const size_t nslot = static_cast<size_t>( prefetch_distance ) + 1;
+            if( ahead.size() != nslot ){
+                ahead.resize( nslot ); ahead_arena.resize( nslot );
+                ahead_head = ahead_count = 0; ahead_end = false;
+            }
+            SVDFeatureCSR::Elem e;
+            while( !ahead_end && ahead_count + 1 < nslot ){
+                if( !itr->next( e ) ){
+                    ahead_end = true; break;
+                }
+                const size_t s = ( ahead_head + ahead_count ) % nslot;
+                ahead_arena[ s ].reset();
+                ahead[ s ] = e.clone( ahead_arena[ s ] );
+                svd_trainer->prefetch( ahead[ s ] );
+                ahead_count ++;
+            }
+            if( ahead_count == 0 ){
+                ahead_end = false; return false;
+            }
+            dt = ahead[ ahead_head ];
+            ahead_head = ( ahead_head + 1 ) % nslot;
+            ahead_count --;
+            return true;
+        }
+
         template<typename DataType>
         inline void update( int r, unsigned long elapsed, time_t start, IDataIterator<DataType> *itr ){
             size_t total_num = itr->get_data_size() * train_repeat;
@@ -229,7 +335,7 @@ namespace apex_svd{
             size_t sample_counter = 0;
             DataType dt;
             for( int j = 0; j < train_repeat; j ++ ){ 
-                while( itr->next( dt ) ){
+                while( this->next_sample( itr, dt ) ){
                     svd_trainer->update( dt );
                     if( sample_counter  % print_step == 0 ){
                         if( !silent ){
@@ -247,6 +353,52 @@ namespace apex_svd{
             }
         }
 
+        // squared error of evaluation data, returns number of instances
+        inline double eval_sqr( IDataIterator<SVDFeatureCSR::Elem> *itr, double &sum ){
+            SVDFeatureCSR::Elem e;
+            double cnt = 0.0;
+            itr->before_first();
+            while( itr->next( e ) ){
+                const double diff = svd_trainer->predict( e ) - e.label;
+                sum += diff * diff; cnt += 1.0;
+            }
+            return cnt;
+        }
+        inline double eval_sqr( IDataIterator<SVDPlusBlock> *itr, double &sum ){
+            SVDPlusBlock e;
+            std::vector<float> p;
+            double cnt = 0.0;
+            itr->before_first();
+            while( itr->next( e ) ){
+                svd_trainer->predict( p, e );
+                for( int i = 0; i < e.data.num_row; i ++ ){
+                    const double diff = p[i] - e.data[i].label;
+                    sum += diff * diff; cnt += 1.0;
+                }
+            }
+            return cnt;
+        }
+        // evaluate rmse on evaluation data, return whether training should stop
+        inline bool eval( int r ){
+            double sum = 0.0, cnt = 0.0;
+            if( itr_eval_csr != NULL ) cnt = this->eval_sqr( itr_eval_csr, sum );
+            if( itr_eval_plus!= NULL ) cnt = this->eval_sqr( itr_eval_plus, sum );
+            svd_trainer->finish_eval();
+            const double rmse = sqrt( sum / ( cnt > 0.0 ? cnt : 1.0 ) );
+            if( !silent ){
+                printf("\nround %8d: eval-rmse=%lf\n", r, rmse );
+            }
+            if( rmse < best_eval ){
+                best_eval = rmse; best_round = r;
+            }
+            if( early_stop_round > 0 && r - best_round >= early_stop_round ){
+                if( !silent ){
+                    printf("early stop, best round %d, eval-rmse=%lf\n", best_round, best_eval );
+                }
+                return true;
+            }
+            return false;
+        }
     public:
         virtual void set_param( const char *name , const char *val ){
             cfg.push_back_high( name, val );
@@ -279,7 +431,12 @@ namespace apex_svd{
                     this->update( start_counter-1, elapsed, start, itr_plus );
 
                 elapsed = (unsigned long)(time(NULL) - start); 
+                bool stop = false;
+                if( itr_eval_csr != NULL || itr_eval_plus != NULL ){
+                    stop = this->eval( start_counter-1 );
+                }
                 this->save_model();
+                if( stop ) break;
             }
 
             if( !silent ){
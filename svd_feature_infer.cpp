@@ -130,6 +130,11 @@ namespace apex_svd{
             apex_utils::assert_true( fread( &mtype, sizeof(SVDTypeParam), 1, fi ) > 0, "load model" );
             if( use_ranker == 0 ){
                 svd_inferencer = create_svd_trainer( mtype );
+                // settings of paged user factors are needed before the model is loaded
+                cfg.before_first();
+                while( cfg.next() ){
+                    if( !strncmp( cfg.name(), "page_", 5 ) ) svd_inferencer->set_param( cfg.name(), cfg.val() );
+                }
                 svd_inferencer->load_model( fi );
                 fclose( fi );
             }else{
@@ -217,6 +222,11 @@ namespace apex_svd{
                     if( itr_csr != NULL ) itr_csr->set_param ( "silent", cfg.val() );
                     if( itr_plus!= NULL ) itr_plus->set_param( "silent", cfg.val() );
                 }
+                // test data must be hashed in the same way as training data
+                if( !strncmp( cfg.name(), "hash_", 5 )){
+                    if( itr_csr != NULL ) itr_csr->set_param ( cfg.name(), cfg.val() );
+                    if( itr_plus!= NULL ) itr_plus->set_param( cfg.name(), cfg.val() );
+                }
             }
             if( itr_csr != NULL ) itr_csr->init();
             if( itr_plus!= NULL ) itr_plus->init();
@@ -228,6 +238,8 @@ namespace apex_svd{
                 if( svd_ranker != NULL ) svd_ranker->set_param( cfg.name(), cfg.val() );
                 if( svd_inferencer != NULL ) svd_inferencer->set_param( cfg.name(), cfg.val() );
             }
+            // cached results of training are bound to the training and eval data, never apply them to the input of inference
+            if( svd_inferencer != NULL ) svd_inferencer->set_param( "res_buf_restore", "0" );
         }
                 
         inline void init( void ){
@@ -266,8 +278,10 @@ namespace apex_svd{
                         for( int i = 0; i < e.data.num_row; i ++ ){
                             rmse_eval.add_eval( e.data[i].label, p[i], scale_score );
                         }
-                    }                    
+                    }
                 }
+                // allow solver to reuse predictions of this checkpoint for the next one
+                svd_inferencer->finish_eval();
                 rmse_eval.print_stat( fo, iter );
             }
             
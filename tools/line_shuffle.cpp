@@ -1,65 +1,293 @@
 #define _CRT_SECURE_NO_WARNINGS
 #define _CRT_SECURE_NO_DEPRECATE
 
+#include <ctime>
+#include <deque>
+#include <string>
 #include <vector>
+#include <cstdio>
 #include <cstring>
 #include <cstdlib>
 #include <algorithm>
 
 #include "../apex-tensor/apex_random.h"
-#include "../apex-tensor/apex_tensor.h"
 #include "../apex-utils/apex_utils.h"
+#include "../apex-utils/apex_thread.h"
+#include "../apex_svd_data.h"
 
-std::vector<const char*> data;
+// external memory shuffle:
+//   scatter lines into K temp buckets uniformly at random,
+//   then shuffle each bucket in memory and concatenate them,
+//   result is a uniform random permutation of the lines
+//   at most kMaxBucket buckets are written at a time, a bucket that is still too large 
+//   to fit in memory is scattered again in the same way
+// line break is '\n' or '\r', empty lines are removed
+
+// size of read and write buffer
+const size_t kIOBuffer = 16 << 20;
+// maximum number of buckets a file is scattered into, bounded by the number of files that can be open
+const int kMaxBucket = 256;
+
+// temp files created, the ones not yet removed are removed at exit when the program fails
+std::vector<std::string> temp_files;
+void remove_temp_files( void ){
+    for( size_t i = 0; i < temp_files.size(); i ++ ){
+        remove( temp_files[i].c_str() );
+    }
+}
+
+// read lines from file with a large buffer
+class LineReader{
+private:
+    FILE *fi;
+    std::vector<char> buf;
+    size_t top, end;
+    bool eof;
+public:
+    LineReader( FILE *fi ):fi(fi){
+        buf.resize( kIOBuffer ); top = end = 0; eof = false;
+    }
+    // get next nonempty line, the line ends with '\0' and is valid until next call
+    inline bool next( char *&line, size_t &len ){
+        while( true ){
+            while( top < end && ( buf[top] == '\n' || buf[top] == '\r' ) ) ++ top;
+            size_t i = top;
+            while( i < end && buf[i] != '\n' && buf[i] != '\r' ) ++ i;
+            if( i < end || ( eof && i > top ) ){
+                if( i == buf.size() ) buf.push_back( '\0' );
+                buf[ i ] = '\0';
+                line = &buf[ top ]; len = i - top;
+                top = i + 1;
+                return true;
+            }
+            if( eof ) return false;
+            // move the partial line to the front and load more
+            memmove( &buf[0], &buf[top], end - top );
+            end -= top; top = 0;
+            if( end == buf.size() ) buf.resize( buf.size() * 2 );
+            size_t n = fread( &buf[end], sizeof(char), buf.size() - end, fi );
+            if( n == 0 ) eof = true;
+            end += n;
+        }
+    }
+};
+
+// write lines in text or BINARY_PAGE format
+class LineWriter{
+private:
+    FILE *fo;
+    int  page;
+    apex_svd::SVDFeatureCSRPage pg;
+    std::vector<unsigned> index;
+    std::vector<float>    value;
+    size_t npage;
+    // parse a line of text feature format: label ng nu ni i:v ...
+    inline void push_feature( char *line ){
+        apex_svd::SVDFeatureCSR::Elem e;
+        char *p = line, *q;
+        e.label = static_cast<float>( strtod( p, &q ) );
+        e.num_global  = static_cast<int>( strtol( q, &p, 10 ) );
+        e.num_ufactor = static_cast<int>( strtol( p, &q, 10 ) );
+        e.num_ifactor = static_cast<int>( strtol( q, &p, 10 ) );
+        apex_utils::assert_true( e.num_global >= 0 && e.num_ufactor >= 0 && e.num_ifactor >= 0, "invalid feature line" );
+        const int n = e.total_num();
+        index.resize( n + 1 ); value.resize( n + 1 );
+        for( int i = 0; i < n; i ++ ){
+            index[i] = static_cast<unsigned>( strtoul( p, &q, 10 ) );
+            apex_utils::assert_true( *q == ':', "invalid feature line" );
+            value[i] = static_cast<float>( strtod( q + 1, &p ) );
+        }
+        e.set_space( &index[0], &value[0] );
+        if( !pg.push_back( e ) ){
+            pg.save_to_file( fo ); pg.clear(); npage ++;
+            apex_utils::assert_true( pg.push_back( e ), "line too long to fit into a page" );
+        }
+    }
+public:
+    LineWriter( const char *fname, int page ):page(page){
+        fo = apex_utils::fopen_check( fname, page ? "wb" : "w" );
+        setvbuf( fo, NULL, _IOFBF, kIOBuffer );
+        npage = 0;
+        if( page != 0 ) pg.alloc_space();
+    }
+    ~LineWriter(){
+        if( page != 0 ){
+            if( pg.num_row() != 0 ){
+                pg.save_to_file( fo ); npage ++;
+            }
+            pg.free_space();
+            printf("%lu pages written\n", (unsigned long)npage );
+        }
+        fclose( fo );
+    }
+    inline void write( char *line ){
+        if( page != 0 ){
+            this->push_feature( line );
+        }else{
+            fputs( line, fo ); fputc( '\n', fo );
+        }
+    }
+};
+
+// a bucket of lines, loaded and shuffled in a worker thread
+struct Bucket{
+    char name[ 256 ];
+    uint32_t seed, id;
+    int  remove_file;
+    // size in bytes and number of lines, set when the bucket is written
+    size_t bytes, nline;
+    std::vector<char*> lines;
+    std::vector<char>  data;
+    inline void run( void ){
+        FILE *fi = apex_utils::fopen_check( name, "rb" );
+        LineReader reader( fi );
+        char *line; size_t len;
+        std::vector<size_t> offset;
+        data.resize( 0 ); lines.resize( 0 );
+        while( reader.next( line, len ) ){
+            offset.push_back( data.size() );
+            data.insert( data.end(), line, line + len + 1 );
+        }
+        fclose( fi );
+        if( remove_file != 0 ) remove( name );
+        for( size_t i = 0; i < offset.size(); i ++ ){
+            lines.push_back( &data[0] + offset[i] );
+        }
+        apex_random::RandomStream rnd( seed, static_cast<uint64_t>( id ) + 1 );
+        if( lines.size() != 0 ) apex_random::shuffle( lines, rnd );
+    }
+    inline void clear( void ){
+        std::vector<char*>().swap( lines );
+        std::vector<char>().swap( data );
+    }
+};
+
+inline APEX_THREAD_PREFIX bucket_entry( void *p ){
+    static_cast<Bucket*>( p )->run();
+    apex_thread::thread_exit( NULL );
+    return NULL;
+}
+
+// scatter lines of src into nbucket new buckets uniformly at random using random stream, new buckets take ids from next_id
+inline void scatter( const Bucket &src, int nbucket, uint64_t stream, const char *out, double mem, 
+                     uint32_t &next_id, std::vector<Bucket> &dst ){
+    printf("scatter lines of %s into %d buckets\n", src.name, nbucket );
+    dst.resize( nbucket );
+    for( int k = 0; k < nbucket; k ++ ){
+        dst[k].seed = src.seed; dst[k].id = next_id ++;
+        sprintf( dst[k].name, "%.200s.tmp%u", out, dst[k].id );
+        dst[k].remove_file = 1;
+        dst[k].bytes = dst[k].nline = 0;
+        temp_files.push_back( dst[k].name );
+    }
+    // write buffer of each bucket, the scatter phase takes at most half of memory
+    size_t wsize = static_cast<size_t>( mem * ( 1 << 20 ) / 2 / nbucket );
+    wsize = std::max( wsize, (size_t)( 64 << 10 ) );
+    wsize = std::min( wsize, (size_t)( 4 << 20 ) );
+    std::vector<FILE*> fo( nbucket );
+    for( int k = 0; k < nbucket; k ++ ){
+        fo[k] = apex_utils::fopen_check( dst[k].name, "wb" );
+        setvbuf( fo[k], NULL, _IOFBF, wsize );
+    }
+    FILE *fi = apex_utils::fopen_check( src.name, "rb" );
+    apex_random::RandomStream rnd( src.seed, stream );
+    LineReader reader( fi );
+    char *line; size_t len;
+    while( reader.next( line, len ) ){
+        const uint32_t k = rnd.next_uint32( static_cast<uint32_t>( nbucket ) );
+        line[ len ] = '\n';
+        fwrite( line, sizeof(char), len + 1, fo[k] );
+        dst[k].bytes += len + 1; dst[k].nline ++;
+    }
+    fclose( fi );
+    for( int k = 0; k < nbucket; k ++ ) fclose( fo[k] );
+    if( src.remove_file != 0 ) remove( src.name );
+}
 
 int main( int argc, char *argv[] ){
 	if( argc < 3 ) {
-        printf("Usage: filein out [seed]\n"); return -1;
+        printf("Usage: filein out [seed] [options...]\n"\
+               "options: -mem mem_MB, -nthread nthread, -page 1\n"\
+               "\tshuffle lines of filein with memory bounded by mem_MB(default 1024)\n"\
+               "\tnthread is the number of threads to shuffle buckets(default 2)\n"\
+               "\t-page 1 will directly output BINARY_PAGE buffer instead of text, filein must be in feature format\n");
+        return -1;
     }
-    if( argc > 3 ){
-        apex_random::seed( atoi(argv[3]) );
-    }else{
-        apex_random::seed( 10 );
+    uint32_t seed = 10;
+    double mem = 1024.0;
+    int nthread = 2, page = 0;
+    int i = 3;
+    if( argc > 3 && argv[3][0] != '-' ){
+        seed = static_cast<uint32_t>( atoi( argv[3] ) ); i = 4;
     }
+    for( ; i < argc; i ++ ){
+        if( !strcmp( argv[i], "-mem" ) && i + 1 < argc ){
+            mem = atof( argv[++i] ); continue;
+        }
+        if( !strcmp( argv[i], "-nthread" ) && i + 1 < argc ){
+            nthread = atoi( argv[++i] ); continue;
+        }
+        if( !strcmp( argv[i], "-page" ) && i + 1 < argc ){
+            page = atoi( argv[++i] ); continue;
+        }
+        printf("unknown option %s\n", argv[i] ); return -1;
+    }
+    apex_utils::assert_true( mem > 0.0 && nthread > 0, "invalid option" );
+    time_t start = time( NULL );
 
     FILE *fi = apex_utils::fopen_check( argv[1], "rb" );
-    fseek( fi, 0L, SEEK_END );
-    size_t sz = (size_t)ftell( fi );
-    char *ptr = new char[ sz + 1 ];
-    fseek( fi, 0L, SEEK_SET );
-    apex_utils::assert_true( fread( ptr, sizeof(char), sz, fi ) > 0, "load data" );            
+    fseeko( fi, 0L, SEEK_END );
+    const double sz = static_cast<double>( ftello( fi ) );
     fclose( fi );
+    // a bucket in memory costs about 2 times of its size, nthread buckets are in memory at the same time
+    const double bucket_size = mem * ( 1 << 20 ) / ( 2.5 * nthread );
+    atexit( remove_temp_files );
 
-    // split
-    data.push_back( ptr+0 );
-    for( size_t i = 0; i < sz - 1; i ++ ){
-        if( ptr[i] == '\n' || ptr[i] == '\r' ){
-            ptr[i] = '\0'; 
-            if( data.back() == ptr + i ){
-                data.back() = ptr + i + 1;
-            }else{
-                data.push_back( ptr + i + 1 );
-            }
-        }        
+    // buckets to be output in order, a bucket larger than bucket_size is replaced by the buckets it is scattered into
+    std::deque<Bucket> work( 1 );
+    {
+        Bucket &b = work[0];
+        strncpy( b.name, argv[1], sizeof(b.name) - 1 );
+        b.name[ sizeof(b.name) - 1 ] = '\0';
+        b.seed = seed; b.id = 0; b.remove_file = 0;
+        b.bytes = static_cast<size_t>( sz ); b.nline = static_cast<size_t>( -1 );
     }
-    if( ptr[ sz-1 ] == '\n' || ptr[sz-1] == '\r' ){
-        ptr[ sz-1 ] = '\0';
-        if( data.back() == ptr + sz - 1 ) data.pop_back();
-    }else{
-        ptr[ sz ] = '\0';
-        if( data.back() == ptr + sz ) data.pop_back();
+    uint32_t next_id = 0;
+    size_t nline = 0;
+    {
+        LineWriter writer( argv[2], page );
+        std::vector<apex_thread::Thread> threads( nthread );
+        std::vector<Bucket> child;
+        bool root = true;
+        printf("shuffle buckets with %d threads\n", nthread );
+        while( !work.empty() ){
+            if( static_cast<double>( work[0].bytes ) > bucket_size && work[0].nline > 1 ){
+                const double nb = static_cast<double>( work[0].bytes ) / bucket_size + 1.0;
+                const int nbucket = nb > kMaxBucket ? kMaxBucket : static_cast<int>( nb );
+                // input file uses stream 0, stream id+1 is used to shuffle bucket id
+                const uint64_t stream = root ? 0 : ( ( static_cast<uint64_t>( 1 ) << 63 ) | work[0].id );
+                scatter( work[0], nbucket, stream, argv[2], mem, next_id, child );
+                work.pop_front();
+                work.insert( work.begin(), child.begin(), child.end() );
+                root = false;
+                continue;
+            }
+            root = false;
+            // shuffle consecutive buckets that fit in memory
+            int n = 0;
+            while( n < nthread && n < static_cast<int>( work.size() ) && 
+                   ( static_cast<double>( work[n].bytes ) <= bucket_size || work[n].nline <= 1 ) ) n ++;
+            for( int t = 0; t < n; t ++ ) threads[t].start( bucket_entry, &work[t] );
+            for( int t = 0; t < n; t ++ ) threads[t].join();
+            for( int t = 0; t < n; t ++ ){
+                Bucket &b = work[ t ];
+                for( size_t j = 0; j < b.lines.size(); j ++ ) writer.write( b.lines[j] );
+                nline += b.lines.size();
+                b.clear();
+            }
+            for( int t = 0; t < n; t ++ ) work.pop_front();
+        }
     }
-
-    printf("all the data loaed in, %u lines, start shuffle\n", (unsigned)data.size() );
-    apex_random::shuffle( data );
-    printf("shuffle end\n");    
-    
-    FILE *fo = apex_utils::fopen_check( argv[2], "w" );
-    for( size_t i = 0; i < data.size(); i ++ ){
-        fprintf( fo,"%s\n", data[i] ); 
-    }
-    fclose( fo );
-    
-    delete []ptr;
+    printf("shuffle end, %lu lines, %lu sec used\n", (unsigned long)nline, (unsigned long)( time(NULL) - start ) );
     return 0;
 }
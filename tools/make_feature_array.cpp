@@ -0,0 +1,45 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*!
+ * \brief convert text feature_user/feature_item file into binary image that is mapped by the trainer
+ */
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_DEPRECATE
+
+#include <ctime>
+#include <cstring>
+#include <cstdio>
+#include "../apex-utils/apex_utils.h"
+
+using namespace apex_utils;
+
+int main( int argc, char *argv[] ){
+    if( argc < 3 ){
+        printf("Usage:make_feature_array <feature_file> <output>\n"\
+               "example: make_feature_array user_feature.txt user_feature.bin\n"\
+               "\tconvert text feature file used by feature_user/feature_item to binary image\n"\
+               "\tthe image can be set as feature_user/feature_item directly, it is mapped instead of parsed,\n"\
+               "\t  and the memory is shared by all processes that use the same image\n");
+        return 0; 
+    }
+    time_t start = time( NULL );
+    SparseFeatureArray<float> arr;
+    arr.load( argv[1] );
+    arr.save_binary( argv[2] );
+    printf("%u rows converted, %lu sec used\n", arr.size(), (unsigned long)(time(NULL) - start) );
+    return 0;
+}
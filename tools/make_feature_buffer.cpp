@@ -21,43 +21,390 @@
 #define _CRT_SECURE_NO_DEPRECATE
 
 #include <ctime>
+#include <vector>
+#include <algorithm>
+#include <string>
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
 #include "../apex_svd_data.h"
 #include "../apex-utils/apex_utils.h"
+#include "../apex-utils/apex_thread.h"
+#include "../apex-utils/apex_frame_file.h"
 
 using namespace apex_svd;
 
+// pipeline of buffer creation:
+//   main thread reads line aligned chunks of input,
+//   chunk i is parsed by worker thread i % nthread,
+//   writer thread takes parsed chunks in order and encodes them into the output format,
+//   at most 2 * nthread chunks are in flight
+
+// a chunk of input text and the parsed result
+struct Chunk{
+    // whether this chunk marks the end of input
+    bool end;
+    std::vector<char>     text;
+    std::vector<int>      row_ptr;
+    std::vector<float>    row_label;
+    std::vector<unsigned> feat_index;
+    std::vector<float>    feat_value;
+    apex_thread::Semaphore sem_free, sem_filled, sem_parsed;
+    inline void parse( float scale_score, const FeatureHasher &hasher ){
+        row_ptr.resize( 1 ); row_ptr[0] = 0;
+        row_label.clear(); feat_index.clear(); feat_value.clear();
+        text.push_back( '\0' );
+        char *p = &text[0], *q;
+        while( true ){
+            while( *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' ) ++ p;
+            if( *p == '\0' ) break;
+            row_label.push_back( strtof( p, &q ) / scale_score );
+            apex_utils::assert_true( q != p, "invalid feature format" );
+            int n[3];
+            for( int k = 0; k < 3; k ++ ){
+                n[k] = static_cast<int>( strtol( q, &p, 10 ) );
+                apex_utils::assert_true( n[k] >= 0 && p != q, "invalid feature format" );
+                q = p;
+            }
+            for( int k = 0; k < 3; k ++ ){
+                for( int i = 0; i < n[k]; i ++ ){
+                    if( hasher.enabled() ){
+                        const unsigned long long raw = strtoull( p, &q, 10 );
+                        apex_utils::assert_true( *q == ':', "invalid feature format" );
+                        float v = strtof( q + 1, &p );
+                        feat_index.push_back( hasher.map( k, raw, v ) );
+                        feat_value.push_back( v );
+                        continue;
+                    }
+                    feat_index.push_back( static_cast<unsigned>( strtoul( p, &q, 10 ) ) );
+                    apex_utils::assert_true( *q == ':', "invalid feature format" );
+                    feat_value.push_back( strtof( q + 1, &p ) );
+                }
+                row_ptr.push_back( row_ptr.back() + n[k] );
+            }
+        }
+    }
+    inline int num_row( void ) const{
+        return static_cast<int>( row_label.size() );
+    }
+    inline SVDFeatureCSR::Elem operator[]( int r ){
+        SVDFeatureCSR::Elem e;
+        e.label = row_label[ r ];
+        e.num_global  = row_ptr[ r*3 + 1 ] - row_ptr[ r*3 ];
+        e.num_ufactor = row_ptr[ r*3 + 2 ] - row_ptr[ r*3 + 1 ];
+        e.num_ifactor = row_ptr[ r*3 + 3 ] - row_ptr[ r*3 + 2 ];
+        e.set_space( &feat_index[0] + row_ptr[ r*3 ], &feat_value[0] + row_ptr[ r*3 ] );
+        return e;
+    }
+};
+
+// writer of BINARY_BUFFER format with index, same as create_binary_buffer
+struct BufferWriter{
+    struct Param{
+        int num_batch;
+        int batch_size;
+        int max_batch_num;
+    };
+    FILE *fo;
+    Param param;
+    apex_utils::FrameWriter *writer;
+    std::vector<char>     blob;
+    std::vector<int>      row_ptr;
+    std::vector<float>    row_label;
+    std::vector<unsigned> feat_index;
+    std::vector<float>    feat_value;
+    BufferWriter( const char *fname, int batch_size, int compress ){
+        fo = apex_utils::fopen_check( fname, "wb" );
+        setvbuf( fo, NULL, _IOFBF, 16 << 20 );
+        param.num_batch = 0; param.batch_size = batch_size; param.max_batch_num = 0;
+        writer = new apex_utils::FrameWriter( fo, compress );
+        writer->write_header( &param, sizeof(Param) );
+        row_ptr.push_back( 0 );
+    }
+    inline void append( const void *ptr, size_t size ){
+        blob.insert( blob.end(), static_cast<const char*>( ptr ), static_cast<const char*>( ptr ) + size );
+    }
+    inline void flush( void ){
+        int num_row = static_cast<int>( row_label.size() );
+        int num_val = row_ptr.back();
+        if( num_row == 0 ) return;
+        blob.clear();
+        this->append( &num_row, sizeof(int) );
+        this->append( &num_val, sizeof(int) );
+        if( num_val > param.max_batch_num ) param.max_batch_num = num_val;
+        this->append( &row_ptr[0], sizeof(int) * row_ptr.size() );
+        this->append( &row_label[0], sizeof(float) * num_row );
+        if( num_val != 0 ){
+            this->append( &feat_index[0], sizeof(unsigned) * num_val );
+            this->append( &feat_value[0], sizeof(float) * num_val );
+        }
+        writer->write_frame( &blob[0], blob.size(), num_row );
+        param.num_batch ++;
+        row_ptr.resize( 1 ); row_label.clear(); feat_index.clear(); feat_value.clear();
+    }
+    inline void write( Chunk &c ){
+        for( int r = 0; r < c.num_row(); r ++ ){
+            const int base = row_ptr.back() - c.row_ptr[ r*3 ];
+            for( int k = 1; k <= 3; k ++ ) row_ptr.push_back( c.row_ptr[ r*3 + k ] + base );
+            row_label.push_back( c.row_label[ r ] );
+            feat_index.insert( feat_index.end(), c.feat_index.begin() + c.row_ptr[ r*3 ], c.feat_index.begin() + c.row_ptr[ r*3 + 3 ] );
+            feat_value.insert( feat_value.end(), c.feat_value.begin() + c.row_ptr[ r*3 ], c.feat_value.begin() + c.row_ptr[ r*3 + 3 ] );
+            if( static_cast<int>( row_label.size() ) == param.batch_size ) this->flush();
+        }
+    }
+    inline void close( void ){
+        this->flush();
+        writer->close(); delete writer;
+        fseek( fo, apex_utils::FrameWriter::kHeaderOffset, SEEK_SET );
+        fwrite( &param, sizeof(Param), 1, fo );
+        fclose( fo );
+    }
+};
+
+// writer of BINARY_PAGE format, compressed pages are stored as one frame per page
+struct PageWriter{
+    FILE *fo;
+    SVDFeatureCSRPage page;
+    apex_utils::FrameWriter *writer;
+    std::vector<char> blob;
+    PageWriter( const char *fname, int compress ){
+        fo = apex_utils::fopen_check( fname, "wb" );
+        page.alloc_space();
+        writer = compress != 0 ? new apex_utils::FrameWriter( fo ) : NULL;
+    }
+    inline void save( void ){
+        if( writer != NULL ){
+            blob.resize( page.used_size() );
+            page.save_to_memory( &blob[0] );
+            writer->write_frame( &blob[0], blob.size(), page.num_row() );
+        }else{
+            page.save_to_file( fo );
+        }
+        page.clear();
+    }
+    inline void write( Chunk &c ){
+        for( int r = 0; r < c.num_row(); r ++ ){
+            SVDFeatureCSR::Elem e = c[ r ];
+            if( !page.push_back( e ) ){
+                this->save();
+                apex_utils::assert_true( page.push_back( e ), "line too long to fit into a page" );
+            }
+        }
+    }
+    inline void close( void ){
+        if( page.num_row() != 0 ) this->save();
+        page.free_space();
+        if( writer != NULL ){
+            writer->close(); delete writer;
+        }
+        fclose( fo );
+    }
+};
+
+class BufferMaker{
+private:
+    int nthread, batch_size, page, compress;
+    float scale_score;
+    size_t chunk_size;
+    const char *fout;
+    FeatureHasher hasher;
+    std::vector<Chunk> chunk;
+    std::vector<apex_thread::Thread> workers;
+    apex_thread::Thread writer;
+    struct WorkerEntry{
+        BufferMaker *self;
+        int tid;
+    };
+    std::vector<WorkerEntry> entry;
+    // statistics
+    time_t start;
+    double nbyte;
+    size_t nrow;
+private:
+    inline void run_worker( int tid ){
+        for( size_t s = tid; ; s += nthread ){
+            Chunk &c = chunk[ s % chunk.size() ];
+            c.sem_filled.wait();
+            const bool end = c.end;
+            if( !end ) c.parse( scale_score, hasher );
+            c.sem_parsed.post();
+            if( end ) break;
+        }
+    }
+    template<typename Writer>
+    inline void run_writer( Writer &w ){
+        time_t last = time( NULL );
+        for( size_t s = 0; ; s ++ ){
+            Chunk &c = chunk[ s % chunk.size() ];
+            c.sem_parsed.wait();
+            if( c.end ) break;
+            w.write( c );
+            nrow += c.num_row();
+            nbyte += c.text.size();
+            c.sem_free.post();
+            if( time( NULL ) - last >= 2 ){
+                last = time( NULL );
+                this->report();
+            }
+        }
+        w.close();
+    }
+    inline void run_writer( void ){
+        if( page != 0 ){
+            PageWriter w( fout, compress ); this->run_writer( w );
+        }else{
+            BufferWriter w( fout, batch_size, compress ); this->run_writer( w );
+        }
+    }
+    inline static APEX_THREAD_PREFIX worker_entry( void *p ){
+        WorkerEntry *e = static_cast<WorkerEntry*>( p );
+        e->self->run_worker( e->tid );
+        apex_thread::thread_exit( NULL );
+        return NULL;
+    }
+    inline static APEX_THREAD_PREFIX writer_entry( void *p ){
+        static_cast<BufferMaker*>( p )->run_writer();
+        apex_thread::thread_exit( NULL );
+        return NULL;
+    }
+public:
+    BufferMaker( const char *fout, int nthread, int batch_size, int page, int compress, float scale_score, size_t chunk_size, const FeatureHasher &hasher )
+        :nthread(nthread), batch_size(batch_size), page(page), compress(compress), scale_score(scale_score), chunk_size(chunk_size), fout(fout), hasher(hasher){
+        chunk.resize( nthread * 2 );
+        for( size_t i = 0; i < chunk.size(); i ++ ){
+            chunk[i].sem_free.init( 1 );
+            chunk[i].sem_filled.init( 0 );
+            chunk[i].sem_parsed.init( 0 );
+        }
+        nbyte = 0.0; nrow = 0;
+        start = time( NULL );
+    }
+    ~BufferMaker( void ){
+        for( size_t i = 0; i < chunk.size(); i ++ ){
+            chunk[i].sem_free.destroy();
+            chunk[i].sem_filled.destroy();
+            chunk[i].sem_parsed.destroy();
+        }
+    }
+    inline void report( void ){
+        double t = static_cast<double>( time( NULL ) - start );
+        if( t < 1.0 ) t = 1.0;
+        printf("%.1f MB, %lu rows processed, %.1f MB/s, %.0f rows/s\n",
+               nbyte / ( 1 << 20 ), (unsigned long)nrow, nbyte / ( 1 << 20 ) / t, nrow / t );
+        fflush( stdout );
+    }
+    inline void run( const std::vector<std::string> &fin ){
+        entry.resize( nthread ); workers.resize( nthread );
+        for( int i = 0; i < nthread; i ++ ){
+            entry[i].self = this; entry[i].tid = i;
+            workers[i].start( worker_entry, &entry[i] );
+        }
+        writer.start( writer_entry, this );
+        // read line aligned chunks
+        size_t s = 0;
+        std::vector<char> rest;
+        for( size_t k = 0; k < fin.size(); k ++ ){
+            FILE *fi = apex_utils::fopen_check( fin[k].c_str(), "rb" );
+            bool eof = false;
+            while( !eof ){
+                Chunk &c = chunk[ s % chunk.size() ];
+                c.sem_free.wait();
+                c.end = false;
+                c.text.swap( rest ); rest.clear();
+                size_t top = c.text.size();
+                c.text.resize( std::max( chunk_size, top * 2 ) );
+                size_t n = fread( &c.text[ top ], sizeof(char), c.text.size() - top, fi );
+                c.text.resize( top + n );
+                if( n == 0 ) eof = true;
+                if( !eof ){
+                    // move the partial last line to next chunk
+                    size_t i = c.text.size();
+                    while( i != 0 && c.text[ i - 1 ] != '\n' && c.text[ i - 1 ] != '\r' ) -- i;
+                    if( i != 0 ){
+                        rest.assign( c.text.begin() + i, c.text.end() );
+                        c.text.resize( i );
+                    }else{
+                        // a line longer than the chunk, read more into it
+                        rest.swap( c.text ); c.sem_free.post(); continue;
+                    }
+                }
+                c.sem_filled.post(); s ++;
+            }
+            fclose( fi );
+        }
+        // one end mark for each worker
+        for( int i = 0; i < nthread; i ++, s ++ ){
+            Chunk &c = chunk[ s % chunk.size() ];
+            c.sem_free.wait();
+            c.end = true;
+            c.sem_filled.post();
+        }
+        for( int i = 0; i < nthread; i ++ ) workers[i].join();
+        writer.join();
+        this->report();
+    }
+};
+
 int main( int argc, char *argv[] ){
     if( argc < 3 ){
         printf("Usage:make_feature_buffer <input> <output> [options...]\n"\
-               "options: -batch_size batch_size, -scale_score scale_score\n"\
-               "example: make_feature_buffer input output -batch_size 100 -scale_score 1\n"\
+               "options: -batch_size batch_size, -scale_score scale_score, -nthread nthread, -page 1, -compress 1, -chunk chunk_MB, -hash_xxx value\n"\
+               "example: make_feature_buffer input1,input2 output -batch_size 100 -scale_score 1 -nthread 4\n"\
                "\tmake a buffer used for svd-feature\n"\
+               "\tinput can be a comma separated list of files, they are concatenated in order\n"\
                "\tbatch_size is the mini-batch size for the data entry, must be set smaller than total number of entrys\n"\
-               "\tscale_score will divide the score by scale_score, we suggest to scale the score to 0-1 if it's too big\n");
-        return 0; 
+               "\tscale_score will divide the score by scale_score, we suggest to scale the score to 0-1 if it's too big\n"\
+               "\tnthread is the number of threads to parse input(default 2)\n"\
+               "\t-page 1 will output BINARY_PAGE(input_type=5) buffer instead of BINARY_BUFFER\n"\
+               "\t-compress 1 will compress each block or page of the buffer, training reads it with the same input_type\n"\
+               "\tchunk is size of input chunk each thread parses at a time(default 16)\n"\
+               "\t-hash_global/-hash_user/-hash_item size hash raw 64 bit ids of the field into a table of the size,\n"\
+               "\t  -hash_seed, -hash_seed_global/user/item and -hash_sign 1 are as in training configure\n");
+        return 0;
     }
-    int batch_size = 1000;
-    IDataIterator<SVDFeatureCSR::Elem> *loader = create_csr_iterator( input_type::TEXT_FEATURE );
-    loader->set_param( "scale_score", "1.0" );
-
-    time_t start = time( NULL );
+    int batch_size = 1000, nthread = 2, page = 0, compress = 0;
+    float scale_score = 1.0f;
+    FeatureHasher hasher;
+    double chunk = 16.0;
     for( int i = 3; i < argc; i ++ ){
-        if( !strcmp( argv[i], "-batch_size") ){
+        if( !strcmp( argv[i], "-batch_size") && i + 1 < argc ){
             batch_size = atoi( argv[++i] ); continue;
         }
-        if( !strcmp( argv[i], "-scale_score") ){
-            loader->set_param( "scale_score", argv[++i] ); continue;
+        if( !strcmp( argv[i], "-scale_score") && i + 1 < argc ){
+            scale_score = static_cast<float>( atof( argv[++i] ) ); continue;
+        }
+        if( !strcmp( argv[i], "-nthread") && i + 1 < argc ){
+            nthread = atoi( argv[++i] ); continue;
+        }
+        if( !strcmp( argv[i], "-page") && i + 1 < argc ){
+            page = atoi( argv[++i] ); continue;
+        }
+        if( !strcmp( argv[i], "-compress") && i + 1 < argc ){
+            compress = atoi( argv[++i] ); continue;
         }
+        if( !strcmp( argv[i], "-chunk") && i + 1 < argc ){
+            chunk = atof( argv[++i] ); continue;
+        }
+        if( !strncmp( argv[i], "-hash_", 6 ) && i + 1 < argc ){
+            hasher.set_param( argv[i] + 1, argv[i+1] ); i ++; continue;
+        }
+    }
+    apex_utils::assert_true( batch_size > 0 && nthread > 0 && chunk > 0.0, "invalid option" );
+    std::vector<std::string> fin;
+    {
+        std::string s( argv[1] );
+        size_t pos = 0, next;
+        while( ( next = s.find( ',', pos ) ) != std::string::npos ){
+            if( next != pos ) fin.push_back( s.substr( pos, next - pos ) );
+            pos = next + 1;
+        }
+        if( pos < s.length() ) fin.push_back( s.substr( pos ) );
     }
-    
-    loader->set_param( "data_in", argv[1] );
-    loader->init();
-    printf("start creating buffer...\n");
-    create_binary_buffer( argv[2], loader, batch_size );
+
+    time_t start = time( NULL );
+    printf("start creating buffer with %d threads...\n", nthread );
+    BufferMaker maker( argv[2], nthread, batch_size, page, compress, scale_score, static_cast<size_t>( chunk * ( 1 << 20 ) ), hasher );
+    maker.run( fin );
     printf("all generation end, %lu sec used\n", (unsigned long)(time(NULL) - start) );
-    delete loader;
     return 0;
 }
@@ -0,0 +1,566 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_DEPRECATE
+
+#include <ctime>
+#include <queue>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include "../apex_svd_data.h"
+#include "../apex-tensor/apex_random.h"
+#include "../apex-utils/apex_utils.h"
+#include "../apex-utils/apex_thread.h"
+
+// make user grouped buffer by external merge sort:
+//   records are sorted by (random hash of uid, uid, random key),
+//   which groups lines of the same user, and gives random order of groups and lines in a group,
+//   feedback records are sorted into the same stream to join with feature lines
+//   sorted runs are created by worker threads while the main thread parses input
+//   at most kMaxFanIn runs are opened at a time, more runs are merged in passes into intermediate runs
+
+using namespace apex_svd;
+
+// size of read buffer
+const size_t kIOBuffer = 16 << 20;
+// maximum number of runs merged at a time
+const int kMaxFanIn = 256;
+
+// run files created, the ones not yet removed are removed at exit when the program fails
+std::vector<std::string> temp_files;
+void remove_temp_files( void ){
+    for( size_t i = 0; i < temp_files.size(); i ++ ){
+        remove( temp_files[i].c_str() );
+    }
+}
+inline std::string run_name( const char *prefix, int id ){
+    char name[ 256 ];
+    sprintf( name, "%.200s.run%d", prefix, id );
+    return name;
+}
+
+// read lines from file with a large buffer
+class LineReader{
+private:
+    FILE *fi;
+    std::vector<char> buf;
+    size_t top, end;
+    bool eof;
+public:
+    LineReader( FILE *fi ):fi(fi){
+        buf.resize( kIOBuffer ); top = end = 0; eof = false;
+    }
+    // get next nonempty line, the line ends with '\0' and is valid until next call
+    inline bool next( char *&line ){
+        while( true ){
+            while( top < end && ( buf[top] == '\n' || buf[top] == '\r' ) ) ++ top;
+            size_t i = top;
+            while( i < end && buf[i] != '\n' && buf[i] != '\r' ) ++ i;
+            if( i < end || ( eof && i > top ) ){
+                if( i == buf.size() ) buf.push_back( '\0' );
+                buf[ i ] = '\0';
+                line = &buf[ top ];
+                top = i + 1;
+                return true;
+            }
+            if( eof ) return false;
+            memmove( &buf[0], &buf[top], end - top );
+            end -= top; top = 0;
+            if( end == buf.size() ) buf.resize( buf.size() * 2 );
+            size_t n = fread( &buf[end], sizeof(char), buf.size() - end, fi );
+            if( n == 0 ) eof = true;
+            end += n;
+        }
+    }
+};
+
+// header of a record in sorted run, followed by n Entry
+struct RecHead{
+    uint64_t hkey;
+    unsigned uid;
+    // 0 for feedback record, 1 for feature record
+    unsigned type;
+    unsigned rkey;
+    float    label;
+    // for feedback record, ng is number of feedback, nu = ni = 0
+    int      ng, nu, ni;
+    inline int total( void ) const{
+        return ng + nu + ni;
+    }
+    inline bool operator<( const RecHead &b ) const{
+        if( hkey != b.hkey ) return hkey < b.hkey;
+        if( uid  != b.uid  ) return uid < b.uid;
+        if( type != b.type ) return type < b.type;
+        return rkey < b.rkey;
+    }
+};
+struct Entry{
+    unsigned index;
+    float    value;
+    inline bool operator<( const Entry &b ) const{
+        return index < b.index;
+    }
+};
+
+// random hash of uid, decides the order of groups
+inline uint64_t hash_uid( unsigned uid, uint32_t seed ){
+    uint64_t z = ( static_cast<uint64_t>( seed ) << 32 | uid ) + 0x9e3779b97f4a7c15ULL;
+    z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+    return z ^ ( z >> 31 );
+}
+
+// in memory buffer of records, sorted and written as a run by a worker thread
+struct RunBuffer{
+    struct Key{
+        RecHead head;
+        size_t  offset;
+        inline bool operator<( const Key &b ) const{
+            return head < b.head;
+        }
+    };
+    std::vector<Key>   keys;
+    std::vector<Entry> entry;
+    char name[ 256 ];
+    inline size_t size( void ) const{
+        return keys.size() * sizeof(Key) + entry.size() * sizeof(Entry);
+    }
+    inline void add( const RecHead &h, const std::vector<Entry> &e ){
+        Key k; k.head = h; k.offset = entry.size();
+        keys.push_back( k );
+        entry.insert( entry.end(), e.begin(), e.end() );
+    }
+    inline void run( void ){
+        std::sort( keys.begin(), keys.end() );
+        FILE *fo = apex_utils::fopen_check( name, "wb" );
+        setvbuf( fo, NULL, _IOFBF, 4 << 20 );
+        for( size_t i = 0; i < keys.size(); i ++ ){
+            fwrite( &keys[i].head, sizeof(RecHead), 1, fo );
+            if( keys[i].head.total() != 0 ){
+                fwrite( &entry[ keys[i].offset ], sizeof(Entry), keys[i].head.total(), fo );
+            }
+        }
+        fclose( fo );
+        keys.clear(); entry.clear();
+    }
+};
+
+inline APEX_THREAD_PREFIX run_entry( void *p ){
+    static_cast<RunBuffer*>( p )->run();
+    apex_thread::thread_exit( NULL );
+    return NULL;
+}
+
+// create sorted runs from feature file and feedback file
+class RunCreator{
+private:
+    uint32_t seed;
+    float scale_score;
+    size_t run_size;
+    int  nrun;
+    std::vector<RunBuffer> buf;
+    std::vector<apex_thread::Thread> threads;
+    std::vector<bool> busy;
+    int  cur;
+    apex_random::RandomStream rnd;
+    std::vector<Entry> vg, vu, vi, ve;
+    const char *prefix;
+    inline void flush( void ){
+        if( buf[ cur ].keys.size() == 0 ) return;
+        sprintf( buf[ cur ].name, "%.200s.run%d", prefix, nrun ++ );
+        temp_files.push_back( buf[ cur ].name );
+        threads[ cur ].start( run_entry, &buf[ cur ] );
+        busy[ cur ] = true;
+        cur = ( cur + 1 ) % static_cast<int>( buf.size() );
+        if( busy[ cur ] ){
+            threads[ cur ].join(); busy[ cur ] = false;
+        }
+    }
+    inline static void parse( char *&p, int n, std::vector<Entry> &v ){
+        char *q;
+        v.resize( n );
+        for( int i = 0; i < n; i ++ ){
+            v[i].index = static_cast<unsigned>( strtoul( p, &q, 10 ) );
+            apex_utils::assert_true( *q == ':', "invalid feature format" );
+            v[i].value = static_cast<float>( strtod( q + 1, &p ) );
+        }
+        std::sort( v.begin(), v.end() );
+    }
+    inline void add( const RecHead &h ){
+        buf[ cur ].add( h, ve );
+        if( buf[ cur ].size() >= run_size ) this->flush();
+    }
+public:
+    RunCreator( const char *prefix, uint32_t seed, float scale_score, size_t run_size, int nthread )
+        :seed(seed), scale_score(scale_score), run_size(run_size), prefix(prefix){
+        nrun = 0; cur = 0;
+        buf.resize( nthread + 1 ); threads.resize( nthread + 1 ); busy.resize( nthread + 1, false );
+        rnd.seed( seed, 1 );
+    }
+    inline int num_run( void ) const{
+        return nrun;
+    }
+    // add feature file, format: label ng nu ni [features], uid is the first user feature
+    inline void add_feature( const char *fname ){
+        FILE *fi = apex_utils::fopen_check( fname, "rb" );
+        LineReader reader( fi );
+        char *line, *p, *q;
+        RecHead h; h.type = 1;
+        while( reader.next( line ) ){
+            h.label = static_cast<float>( strtod( line, &q ) ) / scale_score;
+            h.ng = static_cast<int>( strtol( q, &p, 10 ) );
+            h.nu = static_cast<int>( strtol( p, &q, 10 ) );
+            h.ni = static_cast<int>( strtol( q, &p, 10 ) );
+            apex_utils::assert_true( h.ng >= 0 && h.nu >= 0 && h.ni >= 0, "invalid feature format" );
+            parse( p, h.ng, vg ); parse( p, h.nu, vu ); parse( p, h.ni, vi );
+            apex_utils::assert_true( vu.size() != 0, "need at least one user feature in feature file" );
+            // uid is the first user feature after sorting, same as make_ugroup_buffer
+            h.uid  = vu[0].index;
+            h.hkey = hash_uid( h.uid, seed );
+            h.rkey = rnd.next_uint32();
+            ve = vg; ve.insert( ve.end(), vu.begin(), vu.end() ); ve.insert( ve.end(), vi.begin(), vi.end() );
+            this->add( h );
+        }
+        fclose( fi );
+    }
+    // add feedback file, format: uid num_ufeedback [feedbacks]
+    inline void add_feedback( const char *fname ){
+        FILE *fi = apex_utils::fopen_check( fname, "rb" );
+        LineReader reader( fi );
+        char *line, *p, *q;
+        RecHead h;
+        h.type = 0; h.rkey = 0; h.label = 0.0f; h.nu = h.ni = 0;
+        while( reader.next( line ) ){
+            h.uid = static_cast<unsigned>( strtoul( line, &q, 10 ) );
+            h.ng  = static_cast<int>( strtol( q, &p, 10 ) );
+            apex_utils::assert_true( h.ng >= 0, "invalid feedback format" );
+            parse( p, h.ng, ve );
+            h.hkey = hash_uid( h.uid, seed );
+            this->add( h );
+        }
+        fclose( fi );
+    }
+    inline void finish( void ){
+        this->flush();
+        for( size_t i = 0; i < buf.size(); i ++ ){
+            if( busy[i] ){
+                threads[i].join(); busy[i] = false;
+            }
+        }
+    }
+};
+
+// k-way merge of sorted runs, gives the records in order
+class RunMerger{
+private:
+    struct Run{
+        FILE *fi;
+        RecHead head;
+        std::vector<Entry> entry;
+        inline bool next( void ){
+            if( fread( &head, sizeof(RecHead), 1, fi ) == 0 ) return false;
+            entry.resize( head.total() );
+            if( head.total() != 0 ){
+                apex_utils::assert_true( fread( &entry[0], sizeof(Entry), head.total(), fi ) > 0, "invalid run file" );
+            }
+            return true;
+        }
+    };
+    struct HeapCmp{
+        const std::vector<Run> *run;
+        inline bool operator()( int a, int b ) const{
+            return (*run)[b].head < (*run)[a].head;
+        }
+    };
+    std::vector<Run> run;
+    std::priority_queue<int, std::vector<int>, HeapCmp> *heap;
+    // run of current record
+    int top;
+public:
+    RunMerger( void ){
+        heap = NULL; top = -1;
+    }
+    ~RunMerger( void ){
+        this->close();
+    }
+    inline void close( void ){
+        for( size_t i = 0; i < run.size(); i ++ ){
+            if( run[i].fi != NULL ) fclose( run[i].fi );
+        }
+        run.clear();
+        if( heap != NULL ) delete heap;
+        heap = NULL; top = -1;
+    }
+    // open runs of given ids, at most kMaxFanIn runs
+    inline void open( const char *prefix, const std::vector<int> &ids, size_t rbuf_size ){
+        apex_utils::assert_true( ids.size() <= static_cast<size_t>( kMaxFanIn ), "too many runs to merge" );
+        this->close();
+        run.resize( ids.size() );
+        for( size_t i = 0; i < run.size(); i ++ ) run[i].fi = NULL;
+        HeapCmp cmp; cmp.run = &run;
+        heap = new std::priority_queue<int, std::vector<int>, HeapCmp>( cmp );
+        for( size_t i = 0; i < run.size(); i ++ ){
+            run[i].fi = apex_utils::fopen_check( run_name( prefix, ids[i] ).c_str(), "rb" );
+            setvbuf( run[i].fi, NULL, _IOFBF, rbuf_size );
+            if( run[i].next() ) heap->push( static_cast<int>( i ) );
+        }
+    }
+    // move to next record, return false if all runs are exhausted
+    inline bool next( void ){
+        if( top >= 0 && run[ top ].next() ) heap->push( top );
+        if( heap->empty() ){
+            top = -1; return false;
+        }
+        top = heap->top(); heap->pop();
+        return true;
+    }
+    // current record, valid until next call of next
+    inline const RecHead &head( void ) const{
+        return run[ top ].head;
+    }
+    inline const std::vector<Entry> &entry( void ) const{
+        return run[ top ].entry;
+    }
+};
+
+// merge runs into run out_id, the input runs are removed after merging
+inline void merge_runs( const char *prefix, const std::vector<int> &ids, int out_id, size_t rbuf_size ){
+    const std::string name = run_name( prefix, out_id );
+    temp_files.push_back( name );
+    FILE *fo = apex_utils::fopen_check( name.c_str(), "wb" );
+    setvbuf( fo, NULL, _IOFBF, 4 << 20 );
+    RunMerger merger;
+    merger.open( prefix, ids, rbuf_size );
+    while( merger.next() ){
+        const RecHead &h = merger.head();
+        fwrite( &h, sizeof(RecHead), 1, fo );
+        if( h.total() != 0 ){
+            fwrite( &merger.entry()[0], sizeof(Entry), h.total(), fo );
+        }
+    }
+    merger.close();
+    fclose( fo );
+    for( size_t i = 0; i < ids.size(); i ++ ){
+        remove( run_name( prefix, ids[i] ).c_str() );
+    }
+}
+
+// merge sorted runs, group the records by user and output blocks
+class GroupMergeIterator : public IDataIterator<SVDPlusBlock>{
+private:
+    const char *prefix;
+    std::vector<int> ids;
+    int  block_max_line, use_feedback;
+    size_t rbuf_size;
+    RunMerger merger;
+    // whether merger holds a record not yet loaded
+    bool has_rec;
+    // records of current group
+    std::vector<Entry>    feedback;
+    std::vector<float>    glabel;
+    std::vector<int>      gptr;
+    std::vector<Entry>    gentry;
+    // block being output
+    int  gtop, nline_remain;
+    std::vector<unsigned> index_ufeedback;
+    std::vector<float>    value_ufeedback;
+    std::vector<float>    row_label;
+    std::vector<int>      row_ptr;
+    std::vector<unsigned> feat_index;
+    std::vector<float>    feat_value;
+    // load records of next user, return false if no more feature record
+    inline bool load_group( void ){
+        while( has_rec ){
+            feedback.clear(); glabel.clear(); gentry.clear();
+            gptr.resize( 1 ); gptr[0] = 0;
+            const RecHead first = merger.head();
+            do{
+                const RecHead &h = merger.head();
+                if( h.hkey != first.hkey || h.uid != first.uid ) break;
+                const std::vector<Entry> &entry = merger.entry();
+                if( h.type == 0 ){
+                    feedback.insert( feedback.end(), entry.begin(), entry.end() );
+                }else{
+                    glabel.push_back( h.label );
+                    gptr.push_back( gptr.back() + h.ng );
+                    gptr.push_back( gptr.back() + h.nu );
+                    gptr.push_back( gptr.back() + h.ni );
+                    gentry.insert( gentry.end(), entry.begin(), entry.end() );
+                }
+            }while( ( has_rec = merger.next() ) );
+            // feedback of user without any feature line is dropped
+            if( glabel.size() != 0 ){
+                std::sort( feedback.begin(), feedback.end() );
+                gtop = 0; nline_remain = static_cast<int>( glabel.size() );
+                return true;
+            }
+        }
+        return false;
+    }
+public:
+    GroupMergeIterator( const char *prefix, const std::vector<int> &ids, int block_max_line, int use_feedback, size_t rbuf_size )
+        :prefix(prefix), ids(ids), block_max_line(block_max_line), use_feedback(use_feedback), rbuf_size(rbuf_size){
+        has_rec = false; nline_remain = 0;
+    }
+    virtual ~GroupMergeIterator( void ){}
+    virtual void set_param( const char *name, const char *val ){}
+    virtual void init( void ){}
+    virtual void before_first( void ){
+        merger.open( prefix, ids, rbuf_size );
+        has_rec = merger.next();
+        nline_remain = 0;
+    }
+    virtual bool next( SVDPlusBlock &e ){
+        if( nline_remain == 0 && !this->load_group() ) return false;
+        // same block arrangement as make_ugroup_buffer
+        int num_line = nline_remain;
+        e.extend_tag = use_feedback ? svdpp_tag::MIDDLE_TAG : svdpp_tag::DEFAULT;
+        if( gtop == 0 ) e.extend_tag = e.extend_tag & svdpp_tag::START_TAG;
+        if( nline_remain > block_max_line ){
+            int pc = ( nline_remain + block_max_line - 1 ) / block_max_line;
+            num_line = ( nline_remain + pc - 1 ) / pc;
+        }else{
+            e.extend_tag = e.extend_tag & svdpp_tag::END_TAG;
+        }
+        index_ufeedback.clear(); value_ufeedback.clear();
+        if( use_feedback && e.extend_tag != svdpp_tag::MIDDLE_TAG ){
+            for( size_t i = 0; i < feedback.size(); i ++ ){
+                index_ufeedback.push_back( feedback[i].index );
+                value_ufeedback.push_back( feedback[i].value );
+            }
+        }
+        e.num_ufeedback = static_cast<int>( index_ufeedback.size() );
+        e.index_ufeedback = e.num_ufeedback != 0 ? &index_ufeedback[0] : NULL;
+        e.value_ufeedback = e.num_ufeedback != 0 ? &value_ufeedback[0] : NULL;
+
+        const int rbegin = gptr[ gtop * 3 ];
+        row_label.resize( num_line );
+        row_ptr.resize( num_line * 3 + 1 );
+        for( int i = 0; i < num_line; i ++ ){
+            row_label[i] = glabel[ gtop + i ];
+        }
+        for( int i = 0; i <= num_line * 3; i ++ ){
+            row_ptr[i] = gptr[ gtop * 3 + i ] - rbegin;
+        }
+        feat_index.resize( row_ptr.back() + 1 );
+        feat_value.resize( row_ptr.back() + 1 );
+        for( int i = 0; i < row_ptr.back(); i ++ ){
+            feat_index[i] = gentry[ rbegin + i ].index;
+            feat_value[i] = gentry[ rbegin + i ].value;
+        }
+        gtop += num_line; nline_remain -= num_line;
+
+        e.data.num_row   = num_line;
+        e.data.num_val   = row_ptr.back();
+        e.data.row_ptr   = &row_ptr[0];
+        e.data.row_label = &row_label[0];
+        e.data.feat_index= &feat_index[0];
+        e.data.feat_value= &feat_value[0];
+        return true;
+    }
+};
+
+int main( int argc, char *argv[] ){
+    if( argc < 3 ){
+        printf("Usage:make_ugroup_extsort <feature_file> <output> [options...]\n"\
+               "options: -seed seed -fd feedbackfile -max_block max_line -scale_score scale_score -mem mem_MB -nthread nthread\n"\
+               "example: make_ugroup_extsort input output -fd feedback_file -mem 2048\n"\
+               "\tmake a user grouped buffer from feature file in any order, in one pass with bounded memory\n"\
+               "\tlines of same user(first user feature) are grouped, order of users and lines in each user is random\n"\
+               "\tfeedback file is keyed by user, each line: uid num_feedback fid:fvalue ...\n"\
+               "\tmem is the memory budget of sorting in MB(default 1024), lines of one user are held in memory\n"\
+               "\tnthread is the number of threads to sort runs(default 2)\n"\
+               "\tmax_block specifies max number of lines of feature to be included in one storage block(default 10000)\n");
+        return 0;
+    }
+    uint32_t seed = 10;
+    const char *feedback = "NULL";
+    int block_max_line = 10000, nthread = 2;
+    float scale_score = 1.0f;
+    double mem = 1024.0;
+    for( int i = 3; i < argc; i ++ ){
+        if( i + 1 >= argc ){
+            printf("unknown option %s\n", argv[i] ); return -1;
+        }
+        if( !strcmp( argv[i], "-seed" ) ){
+            seed = static_cast<uint32_t>( atoi( argv[++i] ) ); continue;
+        }
+        if( !strcmp( argv[i], "-fd" ) ){
+            feedback = argv[++i]; continue;
+        }
+        if( !strcmp( argv[i], "-max_block" ) ){
+            block_max_line = atoi( argv[++i] ); continue;
+        }
+        if( !strcmp( argv[i], "-scale_score" ) ){
+            scale_score = static_cast<float>( atof( argv[++i] ) ); continue;
+        }
+        if( !strcmp( argv[i], "-mem" ) ){
+            mem = atof( argv[++i] ); continue;
+        }
+        if( !strcmp( argv[i], "-nthread" ) ){
+            nthread = atoi( argv[++i] ); continue;
+        }
+        printf("unknown option %s\n", argv[i] ); return -1;
+    }
+    apex_utils::assert_true( mem > 0.0 && nthread > 0 && block_max_line > 0, "invalid option" );
+    time_t start = time( NULL );
+    atexit( remove_temp_files );
+    const size_t mem_bytes = static_cast<size_t>( mem * ( 1 << 20 ) );
+
+    int nrun;
+    {// nthread + 1 run buffers are in memory at the same time, vector growth may double the space
+        RunCreator creator( argv[2], seed, scale_score, mem_bytes / ( 2 * ( nthread + 1 ) ), nthread );
+        creator.add_feature( argv[1] );
+        if( strcmp( feedback, "NULL" ) ) creator.add_feedback( feedback );
+        creator.finish();
+        nrun = creator.num_run();
+    }
+    printf("%d sorted runs created, %lu sec used, start merging...\n", nrun, (unsigned long)(time(NULL) - start) );
+    // read buffer of each run, the merge takes at most half of memory
+    const int fanin = std::max( std::min( nrun, kMaxFanIn ), 1 );
+    size_t rbuf_size = mem_bytes / 2 / fanin;
+    rbuf_size = std::max( rbuf_size, (size_t)( 64 << 10 ) );
+    rbuf_size = std::min( rbuf_size, (size_t)( 4 << 20 ) );
+    std::vector<int> runs;
+    for( int i = 0; i < nrun; i ++ ) runs.push_back( i );
+    // merge in passes until the remaining runs can be merged at once
+    for( int next_id = nrun; runs.size() > static_cast<size_t>( kMaxFanIn ); ){
+        std::vector<int> merged;
+        for( size_t i = 0; i < runs.size(); i += kMaxFanIn ){
+            std::vector<int> ids( runs.begin() + i, runs.begin() + std::min( i + kMaxFanIn, runs.size() ) );
+            if( ids.size() == 1 ){
+                merged.push_back( ids[0] ); continue;
+            }
+            merge_runs( argv[2], ids, next_id, rbuf_size );
+            merged.push_back( next_id ++ );
+        }
+        runs.swap( merged );
+        printf("merge pass end, %lu runs remain, %lu sec used\n", (unsigned long)runs.size(), (unsigned long)(time(NULL) - start) );
+    }
+    {
+        GroupMergeIterator itr( argv[2], runs, block_max_line, strcmp( feedback, "NULL" ) != 0, rbuf_size );
+        create_binary_buffer( argv[2], &itr );
+    }
+    remove_temp_files();
+    temp_files.clear();
+    printf("all generation end, %lu sec used\n", (unsigned long)(time(NULL) - start) );
+    return 0;
+}
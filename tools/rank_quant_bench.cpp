@@ -0,0 +1,131 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*!
+ * \brief benchmark of ranking by int8 item factors (rank_quant=1) against exact ranking,
+ *   every item of the model is a candidate, users are sampled from the model
+ */
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_DEPRECATE
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include "../apex_svd.h"
+#include "../apex-utils/apex_utils.h"
+
+using namespace apex_svd;
+
+// ranker of the model with given setting, all items of the model are put into the item set
+static ISVDRanker *create_ranker( const char *fname, int num_item, int top_k, int rank_quant, int rerank_size ){
+    FILE *fi = apex_utils::fopen_check( fname, "rb" );
+    SVDTypeParam mtype;
+    apex_utils::assert_true( fread( &mtype, sizeof(SVDTypeParam), 1, fi ) > 0, "load model" );
+    ISVDRanker *ranker = create_svd_ranker( mtype );
+    char val[ 32 ];
+    sprintf( val, "%d", top_k );       ranker->set_param( "top_k", val );
+    sprintf( val, "%d", rank_quant );  ranker->set_param( "rank_quant", val );
+    sprintf( val, "%d", rerank_size ); ranker->set_param( "rerank_size", val );
+    ranker->load_model( fi );
+    fclose( fi );
+    ranker->init_ranker( num_item );
+    std::vector<int> rst;
+    unsigned idx; float one = 1.0f;
+    SVDFeatureCSR::Elem e;
+    memset( &e, 0, sizeof(e) );
+    e.label = svdranker_tag::ITEM_TAG;
+    e.num_ifactor = 1; e.index_ifactor = &idx; e.value_ifactor = &one;
+    for( int i = 0; i < num_item; i ++ ){
+        idx = static_cast<unsigned>( i );
+        ranker->process( rst, e );
+    }
+    return ranker;
+}
+// rank for each user, return seconds used
+static double run( ISVDRanker *ranker, const std::vector<unsigned> &users, std::vector< std::vector<int> > &rst ){
+    unsigned idx; float one = 1.0f;
+    SVDFeatureCSR::Elem eu, ep;
+    memset( &eu, 0, sizeof(eu) );
+    memset( &ep, 0, sizeof(ep) );
+    eu.label = svdranker_tag::USER_TAG;
+    eu.num_ufactor = 1; eu.index_ufactor = &idx; eu.value_ufactor = &one;
+    ep.label = svdranker_tag::PROCESS_TAG;
+    rst.resize( users.size() );
+    clock_t start = clock();
+    for( size_t i = 0; i < users.size(); i ++ ){
+        idx = users[i];
+        rst[i].clear();
+        ranker->process( rst[i], eu );
+        ranker->process( rst[i], ep );
+    }
+    return static_cast<double>( clock() - start ) / CLOCKS_PER_SEC;
+}
+
+int main( int argc, char *argv[] ){
+    if( argc < 2 ){
+        printf("Usage:rank_quant_bench <model> [options]\n"\
+               "options: -top_k <k> -rerank_size <n> -num_user <n>\n"\
+               "\trank all items of the model for num_user users sampled from the model, exactly and with rank_quant=1,\n"\
+               "\treport recall of the top k items of rank_quant=1 against exact ranking, and the throughput of both\n"\
+               "\trerank_size is the number of candidates re-scored exactly, 0 means 4*top_k (default)\n");
+        return 0;
+    }
+    int top_k = 10, rerank_size = 0, num_user = 1000;
+    for( int i = 2; i + 1 < argc; i += 2 ){
+        if( !strcmp( argv[i], "-top_k" ) )       top_k = atoi( argv[i+1] );
+        if( !strcmp( argv[i], "-rerank_size" ) ) rerank_size = atoi( argv[i+1] );
+        if( !strcmp( argv[i], "-num_user" ) )    num_user = atoi( argv[i+1] );
+    }
+    SVDModelParam param;
+    {// only the model parameter is needed to decide item set and users
+        FILE *fi = apex_utils::fopen_check( argv[1], "rb" );
+        SVDTypeParam mtype;
+        apex_utils::assert_true( fread( &mtype, sizeof(SVDTypeParam), 1, fi ) > 0, "load model" );
+        apex_utils::assert_true( fread( &param, sizeof(SVDModelParam), 1, fi ) > 0, "load model" );
+        fclose( fi );
+    }
+    apex_utils::assert_true( param.num_item >= top_k, "top_k can not exceed number of items" );
+    std::vector<unsigned> users( num_user );
+    apex_random::RandomStream rnd = apex_random::task_stream( 5, 0 );
+    for( int i = 0; i < num_user; i ++ ){
+        users[i] = rnd.next_uint32( static_cast<uint32_t>( param.num_user ) );
+    }
+
+    std::vector< std::vector<int> > rst_exact, rst_quant;
+    ISVDRanker *exact = create_ranker( argv[1], param.num_item, top_k, 0, 0 );
+    const double t_exact = run( exact, users, rst_exact );
+    delete exact;
+    ISVDRanker *quant = create_ranker( argv[1], param.num_item, top_k, 1, rerank_size );
+    const double t_quant = run( quant, users, rst_quant );
+    delete quant;
+
+    size_t hit = 0;
+    for( int i = 0; i < num_user; i ++ ){
+        std::sort( rst_exact[i].begin(), rst_exact[i].end() );
+        for( size_t k = 0; k < rst_quant[i].size(); k ++ ){
+            if( std::binary_search( rst_exact[i].begin(), rst_exact[i].end(), rst_quant[i][k] ) ) hit ++;
+        }
+    }
+    const double nscore = static_cast<double>( num_user ) * param.num_item;
+    printf("%d items, %d factors, %d users, top_k=%d, rerank_size=%d\n",
+           param.num_item, param.num_factor, num_user, top_k, rerank_size > 0 ? rerank_size : 4 * top_k );
+    printf("exact: %.3f sec, %.0f users/sec, %.3g items scored/sec\n", t_exact, num_user / t_exact, nscore / t_exact );
+    printf("int8 : %.3f sec, %.0f users/sec, %.3g items scored/sec\n", t_quant, num_user / t_quant, nscore / t_quant );
+    printf("recall@%d=%f\n", top_k, static_cast<double>( hit ) / ( static_cast<double>( num_user ) * top_k ) );
+    return 0;
+}
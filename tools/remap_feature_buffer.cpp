@@ -0,0 +1,149 @@
+/*
+ *  Copyright 2009-2010 APEX Data & Knowledge Management Lab, Shanghai Jiao Tong University
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*!
+ * \brief renumber feature ids of random order input by descending frequency,
+ *   so that rows of frequent features are stored together in the model
+ */
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_DEPRECATE
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include "../apex_svd_data.h"
+#include "../apex-utils/apex_utils.h"
+
+using namespace apex_svd;
+
+// iterator that translates ids of the elements of another iterator
+class RemapIterator: public IDataIterator<SVDFeatureCSR::Elem>{
+private:
+    IDataIterator<SVDFeatureCSR::Elem> *base;
+    FeatureRemap &remap;
+    unsigned bound[3];
+public:
+    RemapIterator( IDataIterator<SVDFeatureCSR::Elem> *base, FeatureRemap &remap ):base(base), remap(remap){
+        bound[0] = bound[1] = bound[2] = ~0U;
+    }
+    virtual void set_param( const char *name, const char *val ){}
+    virtual void init( void ){}
+    virtual void before_first( void ){
+        base->before_first();
+    }
+    virtual bool next( SVDFeatureCSR::Elem &e ){
+        SVDFeatureCSR::Elem src;
+        if( !base->next( src ) ) return false;
+        e = remap.map( src, bound );
+        return true;
+    }
+    virtual size_t get_data_size( void ){
+        return base->get_data_size();
+    }
+};
+
+// order of ids: descending frequency, ties are broken by old id
+struct FreqCmp{
+    const std::vector<size_t> &cnt;
+    FreqCmp( const std::vector<size_t> &cnt ):cnt(cnt){}
+    inline bool operator()( unsigned a, unsigned b ) const{
+        if( cnt[a] != cnt[b] ) return cnt[a] > cnt[b];
+        return a < b;
+    }
+};
+
+int main( int argc, char *argv[] ){
+    if( argc < 4 ){
+        printf("Usage:remap_feature_buffer <remap_out> <input> <output> [<input> <output> ...] [options]\n"\
+               "options: -input_type <type> -batch_size <n> -compress <0/1>\n"\
+               "example: remap_feature_buffer ids.remap ua.base.buffer ua.base.remap ua.test.buffer ua.test.remap\n"\
+               "\tcount global/user/item feature frequency over all the inputs, renumber the ids by descending frequency,\n"\
+               "\tand write each input into a binary buffer in new ids. input_type is the type of the inputs, 0:binary buffer(default), 1:text feature\n"\
+               "\tset feature_remap=<remap_out> in training to store the remapping with the model,\n"\
+               "\tinference reads remapped inputs as they are, set remap_input=1 in inference only when its input is in original ids\n"\
+               "\tids that never occur are placed last, so num_global/num_user/num_item can be cut down to the number of used ids\n");
+        return 0;
+    }
+    int dtype = input_type::BINARY_BUFFER, batch_size = 1000, compress = 0;
+    std::vector<const char*> fin, fout;
+    for( int i = 2; i < argc; i ++ ){
+        if( argv[i][0] == '-' && i + 1 < argc ){
+            if( !strcmp( argv[i], "-input_type" ) ) dtype = atoi( argv[i+1] );
+            if( !strcmp( argv[i], "-batch_size" ) ) batch_size = atoi( argv[i+1] );
+            if( !strcmp( argv[i], "-compress" ) )   compress = atoi( argv[i+1] );
+            i ++; continue;
+        }
+        apex_utils::assert_true( i + 1 < argc, "each input must be followed by its output" );
+        fin.push_back( argv[i] ); fout.push_back( argv[i+1] );
+        i ++;
+    }
+    apex_utils::assert_true( fin.size() != 0, "no input is given" );
+    time_t start = time( NULL );
+
+    // count frequency of each id
+    std::vector<size_t> cnt[3];
+    for( size_t f = 0; f < fin.size(); f ++ ){
+        IDataIterator<SVDFeatureCSR::Elem> *itr = create_csr_iterator( dtype, fin[f] );
+        SVDFeatureCSR::Elem e;
+        itr->before_first();
+        while( itr->next( e ) ){
+            const int      num[3] = { e.num_global, e.num_ufactor, e.num_ifactor };
+            const unsigned *idx[3] = { e.index_global, e.index_ufactor, e.index_ifactor };
+            for( int k = 0; k < 3; k ++ ){
+                for( int i = 0; i < num[k]; i ++ ){
+                    if( idx[k][i] >= cnt[k].size() ) cnt[k].resize( idx[k][i] + 1, 0 );
+                    cnt[k][ idx[k][i] ] ++;
+                }
+            }
+        }
+        delete itr;
+    }
+
+    // build the remapping
+    FeatureRemap remap;
+    const char *fname[3] = { "global", "user", "item" };
+    for( int k = 0; k < 3; k ++ ){
+        const unsigned n = static_cast<unsigned>( cnt[k].size() );
+        std::vector<unsigned> order( n );
+        for( unsigned i = 0; i < n; i ++ ) order[i] = i;
+        std::sort( order.begin(), order.end(), FreqCmp( cnt[k] ) );
+        remap.id_map[k].resize( n );
+        unsigned num_used = 0;
+        for( unsigned i = 0; i < n; i ++ ){
+            remap.id_map[k][ order[i] ] = i;
+            if( cnt[k][ order[i] ] != 0 ) num_used ++;
+        }
+        printf("%s feature: max id=%u, %u ids used, num_%s can be set to %u\n",
+               fname[k], n == 0 ? 0 : n - 1, num_used, fname[k], num_used );
+    }
+    {
+        FILE *fo = apex_utils::fopen_check( argv[1], "wb" );
+        remap.save( fo );
+        fclose( fo );
+    }
+
+    // rewrite the inputs
+    for( size_t f = 0; f < fin.size(); f ++ ){
+        IDataIterator<SVDFeatureCSR::Elem> *itr = create_csr_iterator( dtype, fin[f] );
+        RemapIterator ritr( itr, remap );
+        create_binary_buffer( fout[f], &ritr, batch_size, compress );
+        delete itr;
+    }
+    printf("%lu files remapped, %lu sec used\n", (unsigned long)fin.size(), (unsigned long)(time(NULL) - start) );
+    return 0;
+}